@@ -1,15 +1,108 @@
+#include "render/glyph_atlas.h"
+#include "render/raster.h"
+#include "text/document.h"
+#include "text/follow.h"
+#include "text/highlight.h"
+#include "text/search.h"
+#include "text/view.h"
+#include "text/wrap.h"
+#include "wayland/io.h"
+#include "wayland/offscreen.h"
 #include "wayland/wayland.h"
 #include <stdio.h>
+#include <string.h>
 #include <wayland-client.h>
 
+#define GREETING "Hello, new world!"
+
+// Set by --font: text zooming in and out over the pattern
+static const char *font_path = NULL;
+static struct twl_glyph_atlas font_atlas;
+static struct twl_glyph_atlas *atlas = NULL;
+static struct twl_text_gamma text_gamma;
+static float greeting_width; // at 1 px
+
+// Set by --open: the file instead of the pattern, loaded in the background
+static struct twl_document document;
+static struct twl_text_view *view = NULL;
+static struct twl_text_view text_view;
+// Set by --find or --find-regex: matches are highlighted as the search finds them
+static const char *search_pattern = NULL;
+static uint32_t search_flags = 0;
+static struct twl_search search;
+// By the extension of the file opened: its lines are lexed on a worker, those in view first
+static const struct twl_language *language = NULL;
+static struct twl_highlighter highlighter;
+static struct twl_text_gamma token_gamma[TWL_NUM_TOKENS];
+static const uint32_t token_colors[TWL_NUM_TOKENS] = {
+    [TWL_TOKEN_TEXT] = 0xFF202020,
+    [TWL_TOKEN_KEYWORD] = 0xFF0033B3,
+    [TWL_TOKEN_TYPE] = 0xFF00627A,
+    [TWL_TOKEN_STRING] = 0xFF067D17,
+    [TWL_TOKEN_NUMBER] = 0xFF1750EB,
+    [TWL_TOKEN_COMMENT] = 0xFF8C8C8C,
+    [TWL_TOKEN_PREPROC] = 0xFF9E6A0D,
+    [TWL_TOKEN_TIME] = 0xFF6F42C1,
+    [TWL_TOKEN_ERROR] = 0xFFD00000,
+    [TWL_TOKEN_WARNING] = 0xFFB35900,
+};
+// Set by --wrap: lines are broken at the window's width
+static int is_wrapping = 0;
+static struct twl_wrap wrap;
+// Set by --follow: the document grows with the file and the view sticks to its end
+static int is_following = 0;
+static struct twl_io io;
+static struct twl_follow follow;
+
+// Runs while the window is being mapped (constraints.prepare_fn)
+static void prepare(void *data) {
+  if (twl_glyph_atlas_init(&font_atlas, font_path) != 0) {
+    fprintf(stderr, "Failed to load the font %s\n", font_path);
+    return;
+  }
+  // Whatever the cache misses is rasterized now rather than by the first frame
+  greeting_width = twl_glyph_atlas_measure_text(&font_atlas, GREETING, 1);
+  twl_text_gamma_init(&text_gamma, 0xFF202020, TWL_TEXT_GAMMA);
+  atlas = &font_atlas;
+  if (document.path) {
+    twl_text_view_init(&text_view, &document, atlas, 14);
+    text_view.follow = is_following;
+    if (is_wrapping && twl_wrap_init(&wrap, &document, atlas, text_view.size) == 0)
+      text_view.wrap = &wrap;
+    if (language && twl_highlighter_init(&highlighter, &document, language) == 0) {
+      for (int i = 0; i < TWL_NUM_TOKENS; ++i)
+        twl_text_gamma_init(&token_gamma[i], token_colors[i], TWL_TEXT_GAMMA);
+      text_view.highlighter = &highlighter;
+      text_view.token_gamma = token_gamma;
+    }
+    view = &text_view;
+  }
+}
+
 void draw(struct twl_window *win, void *frame) {
   static int i = 0;
-  uint32_t *data = frame;
-  uint32_t width = win->config.width;
-  uint32_t height = win->config.height;
+  struct twl_raster raster;
+  twl_raster_from_buffer(&raster, win->buffer);
 
   i += 1;
 
+  if (view) {
+    // Once the file is mapped, then the search runs alongside the rest of the loading
+    enum twl_document_state state = twl_document_state(&document);
+    if (search_pattern && !view->search && (state == TWL_DOCUMENT_LOADING || state == TWL_DOCUMENT_LOADED)) {
+      if (twl_search_start(&search, &document, search_pattern, search_flags) == 0)
+        view->search = &search;
+      else
+        fprintf(stderr, "Can't search for %s\n", search_pattern);
+      search_pattern = NULL;
+    }
+
+    struct twl_text_damage damage;
+    twl_text_view_draw(view, &raster, &text_gamma, twl_window_subpixel(win), win->buffer->serial, &damage);
+    twl_window_damage(win, 0, damage.y, raster.width, damage.height);
+    return;
+  }
+
   /* Draw checkerboxed background */
   uint32_t color = 0xFF666666;
   if (win->config.is_resizing)
@@ -17,21 +110,125 @@ void draw(struct twl_window *win, void *frame) {
   if (win->config.is_activated)
     color |= 0x00FF0000;
 
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      if ((i + x + (y / 16) * 16) % 32 < 16)
-        data[y * width + x] = color;
-      else
-        data[y * width + x] = 0xFFEEEEEE;
+  // The pattern only changes every 16 rows and 16 columns
+  for (int y = 0; y < raster.height; y += 16) {
+    for (int x = -(i % 16); x < (int)raster.width; x += 16) {
+      int on = ((i + x + y) % 32 + 32) % 32 < 16;
+      twl_raster_fill_rect(&raster, x, y, 16, 16, on ? color : 0xFFEEEEEE);
     }
   }
+
+  if (atlas) {
+    // Any size comes from the same distance fields, nothing is rasterized while zooming
+    float size = 12 + (i % 240 < 120 ? i % 120 : 120 - i % 120);
+    // Centered, per subpixel on LCDs
+    float x = ((float)raster.width - greeting_width * size) / 2;
+    twl_glyph_atlas_draw_text_lcd(atlas, &raster, GREETING, x, 16 + size, size, &text_gamma, twl_window_subpixel(win));
+  }
+}
+
+// Renders a single frame without a compositor: main --offscreen out.ppm
+static int render_offscreen(const char *path, enum twl_format format) {
+  struct twl_offscreen off;
+  if (twl_offscreen_init(&off, 800, 600, format, draw, NULL) != 0) {
+    return -1;
+  }
+  twl_offscreen_render(&off);
+  int res = twl_offscreen_dump_ppm(&off, path);
+  twl_offscreen_destroy(&off);
+  return res;
+}
+
+// twl_main() with the document followed from the window's event loop
+static int run_following(struct twl_window_constraints *constraints) {
+  struct twl_context ctx;
+  if (twl_init(&ctx) != 0)
+    return -1;
+
+  int res = -1;
+  if (twl_window_create(&ctx, GREETING, constraints, draw, NULL) && twl_io_init(&io, &ctx) == 0) {
+    if (twl_follow_init(&follow, &document, &io, &ctx) == 0) {
+      res = twl_run(&ctx);
+      twl_io_destroy(&io);
+      twl_follow_destroy(&follow);
+    } else {
+      fprintf(stderr, "Can't follow %s\n", document.path);
+      twl_io_destroy(&io);
+    }
+  }
+  twl_destroy(&ctx);
+  return res;
 }
 
 int main(int argc, char *argv[]) {
   struct twl_window_constraints constraints = {
       .default_width = 800,
       .default_height = 600,
+      .format = TWL_FORMAT_XRGB8888,
   };
-  twl_main("Hello, new world!", &constraints, draw, NULL);
-  return 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--rgb565") == 0) {
+      constraints.format = TWL_FORMAT_RGB565;
+    } else if (strcmp(argv[i], "--latency") == 0) {
+      constraints.measure_latency = 1;
+    } else if (strcmp(argv[i], "--trace-startup") == 0) {
+      constraints.trace_startup = 1;
+    } else if (strcmp(argv[i], "--font") == 0 && i + 1 < argc) {
+      font_path = argv[++i];
+      constraints.prepare_fn = prepare;
+    } else if (strcmp(argv[i], "--open") == 0 && font_path && i + 1 < argc) {
+      // Only starts the loader thread, the window comes up meanwhile
+      if (twl_document_load(&document, argv[++i]) != 0) {
+        fprintf(stderr, "Failed to load %s\n", argv[i]);
+        return 1;
+      }
+      language = twl_language_for_path(argv[i]);
+    } else if ((strcmp(argv[i], "--find") == 0 || strcmp(argv[i], "--find-regex") == 0) && document.path && i + 1 < argc) {
+      search_flags = strcmp(argv[i], "--find-regex") == 0 ? TWL_SEARCH_REGEX : 0;
+      search_pattern = argv[++i];
+    } else if (strcmp(argv[i], "--follow") == 0 && document.path) {
+      is_following = 1;
+    } else if (strcmp(argv[i], "--wrap") == 0 && document.path) {
+      is_wrapping = 1;
+    } else if (strcmp(argv[i], "--offscreen") == 0 && i + 1 < argc) {
+      if (font_path) {
+        prepare(NULL);
+        if (atlas == NULL)
+          return 1;
+      }
+      int res = render_offscreen(argv[i + 1], constraints.format);
+      if (text_view.search)
+        twl_search_destroy(&search);
+      if (text_view.highlighter)
+        twl_highlighter_destroy(&highlighter);
+      if (text_view.wrap)
+        twl_wrap_destroy(&wrap);
+      if (document.path)
+        twl_document_destroy(&document);
+      if (atlas)
+        twl_glyph_atlas_destroy(atlas);
+      return res == 0 ? 0 : 1;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--rgb565] [--latency] [--trace-startup] [--font file.ttf [--open file.txt [--find text | --find-regex re] [--follow] [--wrap]]]"
+              " [--offscreen out.ppm]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  int res = is_following ? run_following(&constraints) : twl_main(GREETING, &constraints, draw, NULL);
+  if (text_view.search)
+    twl_search_destroy(&search);
+  if (text_view.highlighter)
+    twl_highlighter_destroy(&highlighter);
+  if (text_view.wrap)
+    twl_wrap_destroy(&wrap);
+  if (document.path)
+    twl_document_destroy(&document);
+  // Saves the glyphs added this run to the cache
+  if (atlas)
+    twl_glyph_atlas_destroy(atlas);
+  return res == 0 ? 0 : 1;
 }
@@ -0,0 +1,182 @@
+#include "atlas_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "TWLATLAS"
+
+// Followed by num_glyphs struct twl_glyph and `height` rows of TWL_ATLAS_WIDTH pixels
+struct cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t glyph_size;
+  uint32_t sdf_size;
+  uint32_t sdf_spread;
+  uint32_t atlas_width;
+  uint32_t num_glyphs;
+  uint64_t font_hash;
+  uint32_t height;
+  uint32_t shelf_x;
+  uint32_t shelf_y;
+  uint32_t shelf_height;
+  float ascender;
+  float line_height;
+};
+
+_Static_assert(sizeof(struct cache_header) % 8 == 0, "glyphs must stay aligned");
+
+uint64_t twl_atlas_cache_hash(const void *data, size_t size) {
+  // FNV-1a over 8 bytes at a time, the tail is folded in bytewise
+  const uint8_t *bytes = data;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ull;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash ^ size;
+}
+
+static int cache_path(char *path, size_t size, const char *suffix, uint64_t font_hash) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+  if (base && base[0] == '/')
+    n = snprintf(path, size, "%s/twl/atlas-%016llx%s", base, (unsigned long long)font_hash, suffix);
+  else if (home)
+    n = snprintf(path, size, "%s/.cache/twl/atlas-%016llx%s", home, (unsigned long long)font_hash, suffix);
+  else
+    return -1;
+  return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+// mkdir -p of everything before the last slash
+static int make_parents(char *path) {
+  for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    int res = mkdir(path, 0700);
+    *slash = '/';
+    if (res != 0 && errno != EEXIST)
+      return -1;
+  }
+  return 0;
+}
+
+int twl_atlas_cache_load(struct twl_glyph_atlas *atlas) {
+  char path[PATH_MAX];
+  if (cache_path(path, sizeof(path), "", atlas->font_hash) != 0)
+    return -1;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_header)) {
+    close(fd);
+    return -1;
+  }
+  // Private and writable: glyphs added later go straight into the copy-on-write pages
+  fzn_mmap_config config = {.size = st.st_size, .prot = PROT_READ | PROT_WRITE, .flags = MAP_PRIVATE, .fd = fd};
+  fzn_mmap cache;
+  fzn_err err = fzn_mmap_new(&cache, &config);
+  close(fd);
+  if (err != FZN_SUCCESS)
+    return -1;
+
+  const struct cache_header *header = cache.addr;
+  size_t glyphs_size = (size_t)header->num_glyphs * sizeof(struct twl_glyph);
+  size_t pixels_size = (size_t)header->height * TWL_ATLAS_WIDTH;
+  int valid = memcmp(header->magic, CACHE_MAGIC, 8) == 0 && header->version == TWL_ATLAS_CACHE_VERSION &&
+              header->glyph_size == sizeof(struct twl_glyph) && header->sdf_size == TWL_SDF_SIZE && header->sdf_spread == TWL_SDF_SPREAD &&
+              header->atlas_width == TWL_ATLAS_WIDTH && header->font_hash == atlas->font_hash &&
+              cache.size == sizeof(struct cache_header) + glyphs_size + pixels_size && header->shelf_y + header->shelf_height <= header->height;
+
+  // A glyph outside of the pixels would be read out of bounds
+  const struct twl_glyph *glyphs = (const struct twl_glyph *)(header + 1);
+  for (uint32_t i = 0; valid && i < header->num_glyphs; ++i) {
+    valid = glyphs[i].x + glyphs[i].width <= TWL_ATLAS_WIDTH && glyphs[i].y + glyphs[i].height <= header->height;
+  }
+  if (!valid) {
+    fzn_mmap_unmap(&cache);
+    return -1;
+  }
+
+  atlas->cache = cache;
+  atlas->glyphs = (struct twl_glyph *)glyphs;
+  atlas->num_glyphs = header->num_glyphs;
+  atlas->glyph_capacity = header->num_glyphs;
+  atlas->num_cached = header->num_glyphs;
+  atlas->pixels = header->height ? (uint8_t *)cache.addr + sizeof(struct cache_header) + glyphs_size : NULL;
+  atlas->height = header->height;
+  atlas->shelf_x = header->shelf_x;
+  atlas->shelf_y = header->shelf_y;
+  atlas->shelf_height = header->shelf_height;
+  atlas->ascender = header->ascender;
+  atlas->line_height = header->line_height;
+  return 0;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = write(fd, (const char *)data + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+int twl_atlas_cache_save(const struct twl_glyph_atlas *atlas) {
+  char path[PATH_MAX], tmp_path[PATH_MAX];
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+  if (cache_path(path, sizeof(path), "", atlas->font_hash) != 0 || cache_path(tmp_path, sizeof(tmp_path), suffix, atlas->font_hash) != 0)
+    return -1;
+  if (make_parents(tmp_path) != 0)
+    return -1;
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+
+  // Rows below the last shelf are empty, they are not worth the disk space
+  uint32_t height = atlas->shelf_y + atlas->shelf_height;
+  struct cache_header header = {
+      .version = TWL_ATLAS_CACHE_VERSION,
+      .glyph_size = sizeof(struct twl_glyph),
+      .sdf_size = TWL_SDF_SIZE,
+      .sdf_spread = TWL_SDF_SPREAD,
+      .atlas_width = TWL_ATLAS_WIDTH,
+      .num_glyphs = atlas->num_glyphs,
+      .font_hash = atlas->font_hash,
+      .height = height,
+      .shelf_x = atlas->shelf_x,
+      .shelf_y = atlas->shelf_y,
+      .shelf_height = atlas->shelf_height,
+      .ascender = atlas->ascender,
+      .line_height = atlas->line_height,
+  };
+  memcpy(header.magic, CACHE_MAGIC, 8);
+
+  int res = write_all(fd, &header, sizeof(header)) == 0 &&
+                    write_all(fd, atlas->glyphs, (size_t)atlas->num_glyphs * sizeof(struct twl_glyph)) == 0 &&
+                    write_all(fd, atlas->pixels, (size_t)height * TWL_ATLAS_WIDTH) == 0
+                ? 0
+                : -1;
+  if (close(fd) != 0 || res != 0 || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef __TWL_ATLAS_CACHE_H__
+#define __TWL_ATLAS_CACHE_H__
+
+#include "glyph_atlas.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump whenever the file layout, struct twl_glyph or the rasterization changes
+#define TWL_ATLAS_CACHE_VERSION 2
+
+// Glyph atlases saved under $XDG_CACHE_HOME/twl, one file per font.
+// The distance fields don't depend on the drawn size or scale, so the key is the font's
+// content hash plus the field parameters, all checked against the file's header.
+uint64_t twl_atlas_cache_hash(const void *data, size_t size);
+// Maps the cache of atlas->font_hash; pixels and glyphs point into the private mapping.
+int twl_atlas_cache_load(struct twl_glyph_atlas *atlas);
+// Written to a temporary file and renamed over the old one, mappings of it stay valid
+int twl_atlas_cache_save(const struct twl_glyph_atlas *atlas);
+
+#endif
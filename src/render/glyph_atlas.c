@@ -0,0 +1,428 @@
+#include "glyph_atlas.h"
+#include "atlas_cache.h"
+#include FT_MODULE_H
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Pixels sampled and blended at a time
+#define CHUNK 256
+// Same for subpixel rendering, three samples per pixel plus the filter's borders
+#define LCD_CHUNK 64
+#define LCD_SAMPLES (LCD_CHUNK * 3 + 4)
+
+// Distance to coverage
+// ===================
+
+// Coverage is 50% on the outline and ramps over one pixel of the drawn size.
+// `scale` maps the 0..255 distances to that ramp: cov = dist * scale + bias.
+static void sdf_coverage_scalar(const float *dist, uint8_t *coverage, uint32_t n, float scale, float bias) {
+  for (uint32_t i = 0; i < n; ++i) {
+    float c = dist[i] * scale + bias;
+    coverage[i] = c <= 0 ? 0 : c >= 255 ? 255 : (uint8_t)(c + 0.5f);
+  }
+}
+
+#ifdef __SSE2__
+// SSE2 is part of x86-64, no runtime check needed. The packs saturate, so they clamp for free.
+static void sdf_coverage(const float *dist, uint8_t *coverage, uint32_t n, float scale, float bias) {
+  __m128 vscale = _mm_set1_ps(scale), vbias = _mm_set1_ps(bias);
+  uint32_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dist + i), vscale), vbias));
+    __m128i b = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dist + i + 4), vscale), vbias));
+    __m128i c = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dist + i + 8), vscale), vbias));
+    __m128i d = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dist + i + 12), vscale), vbias));
+    _mm_storeu_si128((__m128i *)(coverage + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+  }
+  sdf_coverage_scalar(dist + i, coverage + i, n - i, scale, bias);
+}
+#else
+#define sdf_coverage sdf_coverage_scalar
+#endif
+
+// Atlas
+// =====
+
+// Cached pixels and glyphs can be written to but not resized
+static int in_cache(const struct twl_glyph_atlas *atlas, const void *data) {
+  const uint8_t *start = atlas->cache.addr;
+  return start && (const uint8_t *)data >= start && (const uint8_t *)data < start + atlas->cache.size;
+}
+
+// realloc() that moves data out of the cache mapping
+static void *resize(struct twl_glyph_atlas *atlas, void *data, size_t old_size, size_t new_size) {
+  if (!in_cache(atlas, data))
+    return realloc(data, new_size);
+  void *copy = malloc(new_size);
+  if (copy)
+    memcpy(copy, data, old_size);
+  return copy;
+}
+
+static uint32_t hash(uint32_t codepoint) { return codepoint * 2654435761u; }
+
+static void insert_slot(uint32_t *slots, uint32_t num_slots, uint32_t codepoint, uint32_t value) {
+  uint32_t i = hash(codepoint) & (num_slots - 1);
+  while (slots[i] != 0)
+    i = (i + 1) & (num_slots - 1);
+  slots[i] = value;
+}
+
+static int grow_slots(struct twl_glyph_atlas *atlas) {
+  uint32_t num_slots = atlas->num_slots ? atlas->num_slots * 2 : 256;
+  uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+  if (slots == NULL)
+    return -1;
+  for (uint32_t i = 0; i < atlas->num_glyphs; ++i) {
+    insert_slot(slots, num_slots, atlas->glyphs[i].codepoint, i + 1);
+  }
+  free(atlas->slots);
+  atlas->slots = slots;
+  atlas->num_slots = num_slots;
+  return 0;
+}
+
+// Finds room on a shelf, the atlas gets taller when the last one is full
+static int pack(struct twl_glyph_atlas *atlas, uint32_t width, uint32_t height, uint32_t *x, uint32_t *y) {
+  if (width + 1 > TWL_ATLAS_WIDTH)
+    return -1;
+
+  if (atlas->shelf_x + width + 1 > TWL_ATLAS_WIDTH) {
+    atlas->shelf_y += atlas->shelf_height;
+    atlas->shelf_x = 0;
+    atlas->shelf_height = 0;
+  }
+
+  uint32_t bottom = atlas->shelf_y + height + 1;
+  if (bottom > atlas->height) {
+    uint32_t new_height = MAX(atlas->height * 2, bottom);
+    uint8_t *pixels = resize(atlas, atlas->pixels, (size_t)atlas->height * TWL_ATLAS_WIDTH, (size_t)new_height * TWL_ATLAS_WIDTH);
+    if (pixels == NULL)
+      return -1;
+    memset(pixels + (size_t)atlas->height * TWL_ATLAS_WIDTH, 0, (size_t)(new_height - atlas->height) * TWL_ATLAS_WIDTH);
+    atlas->pixels = pixels;
+    atlas->height = new_height;
+  }
+
+  // One pixel of padding keeps bilinear samples from bleeding into the neighbours
+  *x = atlas->shelf_x;
+  *y = atlas->shelf_y;
+  atlas->shelf_x += width + 1;
+  atlas->shelf_height = MAX(atlas->shelf_height, height + 1);
+  return 0;
+}
+
+static int load_face(struct twl_glyph_atlas *atlas) {
+  if (atlas->ft_face)
+    return 0;
+
+  if (FT_Init_FreeType(&atlas->ft_library) != 0)
+    return -1;
+  // Both SDF rasterizers, glyphs go through the bitmap one
+  FT_Int spread = TWL_SDF_SPREAD;
+  FT_Property_Set(atlas->ft_library, "sdf", "spread", &spread);
+  FT_Property_Set(atlas->ft_library, "bsdf", "spread", &spread);
+
+  if (FT_New_Memory_Face(atlas->ft_library, atlas->font.addr, atlas->font.size, 0, &atlas->ft_face) != 0 ||
+      FT_Set_Pixel_Sizes(atlas->ft_face, 0, TWL_SDF_SIZE) != 0) {
+    if (atlas->ft_face)
+      FT_Done_Face(atlas->ft_face);
+    FT_Done_FreeType(atlas->ft_library);
+    atlas->ft_face = NULL;
+    atlas->ft_library = NULL;
+    return -1;
+  }
+  atlas->ascender = atlas->ft_face->size->metrics.ascender / 64.0f;
+  atlas->line_height = atlas->ft_face->size->metrics.height / 64.0f;
+  return 0;
+}
+
+static struct twl_glyph *add_glyph(struct twl_glyph_atlas *atlas, const struct twl_glyph *glyph) {
+  if (atlas->num_glyphs == atlas->glyph_capacity) {
+    uint32_t capacity = atlas->glyph_capacity ? atlas->glyph_capacity * 2 : 128;
+    struct twl_glyph *glyphs = resize(atlas, atlas->glyphs, atlas->num_glyphs * sizeof(struct twl_glyph), capacity * sizeof(struct twl_glyph));
+    if (glyphs == NULL)
+      return NULL;
+    atlas->glyphs = glyphs;
+    atlas->glyph_capacity = capacity;
+  }
+  // Keep the table at most half full
+  if ((atlas->num_glyphs + 1) * 2 > atlas->num_slots && grow_slots(atlas) != 0)
+    return NULL;
+
+  atlas->glyphs[atlas->num_glyphs] = *glyph;
+  insert_slot(atlas->slots, atlas->num_slots, glyph->codepoint, ++atlas->num_glyphs);
+  return &atlas->glyphs[atlas->num_glyphs - 1];
+}
+
+static struct twl_glyph *rasterize(struct twl_glyph_atlas *atlas, uint32_t codepoint) {
+  if (load_face(atlas) != 0)
+    return NULL;
+
+  FT_UInt index = FT_Get_Char_Index(atlas->ft_face, codepoint);
+  if (index == 0 || FT_Load_Glyph(atlas->ft_face, index, FT_LOAD_NO_HINTING) != 0) {
+    struct twl_glyph missing = {.codepoint = codepoint, .missing = 1};
+    add_glyph(atlas, &missing);
+    return NULL;
+  }
+
+  FT_GlyphSlot slot = atlas->ft_face->glyph;
+  struct twl_glyph glyph = {.codepoint = codepoint, .advance = slot->advance.x / 64.0f};
+
+  // Blank glyphs (space) have no outline to measure distances to. Going through a bitmap
+  // picks FreeType's bsdf rasterizer, about twice as fast as the outline one and as good at this size.
+  if (slot->outline.n_contours > 0 && FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL) == 0 && FT_Render_Glyph(slot, FT_RENDER_MODE_SDF) == 0 &&
+      slot->bitmap.width > 0) {
+    FT_Bitmap *bitmap = &slot->bitmap;
+    uint32_t x, y;
+    if (pack(atlas, bitmap->width, bitmap->rows, &x, &y) != 0)
+      return NULL;
+
+    for (uint32_t row = 0; row < bitmap->rows; ++row) {
+      memcpy(atlas->pixels + (size_t)(y + row) * TWL_ATLAS_WIDTH + x, bitmap->buffer + (size_t)row * abs(bitmap->pitch), bitmap->width);
+    }
+    glyph.x = x;
+    glyph.y = y;
+    glyph.width = bitmap->width;
+    glyph.height = bitmap->rows;
+    glyph.left = slot->bitmap_left;
+    glyph.top = slot->bitmap_top;
+  }
+  return add_glyph(atlas, &glyph);
+}
+
+int twl_glyph_atlas_init(struct twl_glyph_atlas *atlas, const char *font_path) {
+  zero_init(atlas, struct twl_glyph_atlas);
+
+  int fd = open(font_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  fzn_mmap_config config = {.prot = PROT_READ, .flags = MAP_PRIVATE, .fd = fd};
+  int res = fstat(fd, &st) == 0 && (config.size = st.st_size) > 0 ? fzn_mmap_new(&atlas->font, &config) : -1;
+  close(fd);
+  if (res != FZN_SUCCESS)
+    return -1;
+
+  // A warm start maps the glyphs and never touches FreeType
+  atlas->font_hash = twl_atlas_cache_hash(atlas->font.addr, atlas->font.size);
+  if (twl_atlas_cache_load(atlas) != 0 && load_face(atlas) != 0) {
+    twl_glyph_atlas_destroy(atlas);
+    return -1;
+  }
+
+  while (atlas->num_glyphs * 2 > atlas->num_slots) {
+    if (grow_slots(atlas) != 0) {
+      twl_glyph_atlas_destroy(atlas);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void twl_glyph_atlas_destroy(struct twl_glyph_atlas *atlas) {
+  if (atlas->num_glyphs > atlas->num_cached && twl_atlas_cache_save(atlas) != 0)
+    fprintf(stderr, "Failed to save the glyph atlas cache\n");
+
+  if (atlas->ft_face)
+    FT_Done_Face(atlas->ft_face);
+  if (atlas->ft_library)
+    FT_Done_FreeType(atlas->ft_library);
+  fzn_mmap_unmap(&atlas->font);
+  if (!in_cache(atlas, atlas->pixels))
+    free(atlas->pixels);
+  if (!in_cache(atlas, atlas->glyphs))
+    free(atlas->glyphs);
+  fzn_mmap_unmap(&atlas->cache);
+  free(atlas->slots);
+  zero_init(atlas, struct twl_glyph_atlas);
+}
+
+const struct twl_glyph *twl_glyph_atlas_get(struct twl_glyph_atlas *atlas, uint32_t codepoint) {
+  if (atlas->num_slots > 0) {
+    for (uint32_t i = hash(codepoint) & (atlas->num_slots - 1); atlas->slots[i] != 0; i = (i + 1) & (atlas->num_slots - 1)) {
+      const struct twl_glyph *glyph = &atlas->glyphs[atlas->slots[i] - 1];
+      if (glyph->codepoint == codepoint)
+        return glyph->missing ? NULL : glyph;
+    }
+  }
+  return rasterize(atlas, codepoint);
+}
+
+// Drawing
+// =======
+
+// Bilinear sample of the field, outside of it is as far outside as the field goes
+static float sample(const struct twl_glyph_atlas *atlas, const struct twl_glyph *glyph, float u, float v) {
+  int32_t x0 = (int32_t)floorf(u), y0 = (int32_t)floorf(v);
+  float fx = u - x0, fy = v - y0;
+  float d[4];
+  for (int i = 0; i < 4; ++i) {
+    int32_t x = x0 + (i & 1), y = y0 + (i >> 1);
+    d[i] = x < 0 || y < 0 || x >= glyph->width || y >= glyph->height ? 0 : atlas->pixels[(size_t)(glyph->y + y) * TWL_ATLAS_WIDTH + glyph->x + x];
+  }
+  return (d[0] + (d[1] - d[0]) * fx) * (1 - fy) + (d[2] + (d[3] - d[2]) * fx) * fy;
+}
+
+// Where a glyph lands on the raster
+struct placement {
+  float s;      // raster pixels per field pixel
+  float ox, oy; // the field's top-left corner
+  int32_t x0, y0, x1, y1;
+  // Distance to coverage, see sdf_coverage()
+  float scale, bias;
+};
+
+static int place(const struct twl_raster *raster, const struct twl_glyph *glyph, float x, float baseline, float size, int32_t margin,
+                 struct placement *p) {
+  if (glyph->width == 0 || size <= 0)
+    return -1;
+
+  p->s = size / TWL_SDF_SIZE;
+  p->ox = x + glyph->left * p->s;
+  p->oy = baseline - glyph->top * p->s;
+  p->x0 = MAX((int32_t)floorf(p->ox) - margin, 0);
+  p->y0 = MAX((int32_t)floorf(p->oy), 0);
+  p->x1 = MIN((int32_t)ceilf(p->ox + glyph->width * p->s) + margin, (int32_t)raster->width);
+  p->y1 = MIN((int32_t)ceilf(p->oy + glyph->height * p->s), (int32_t)raster->height);
+
+  // 128 +- 128 covers +-TWL_SDF_SPREAD pixels of the field, i.e. TWL_SDF_SPREAD * s drawn pixels
+  p->scale = 255.0f * TWL_SDF_SPREAD * p->s / 128.0f;
+  p->bias = 127.5f - 128.0f * p->scale;
+  return p->x0 < p->x1 && p->y0 < p->y1 ? 0 : -1;
+}
+
+void twl_glyph_atlas_draw(const struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const struct twl_glyph *glyph, float x,
+                          float baseline, float size, uint32_t xrgb) {
+  struct placement p;
+  if (place(raster, glyph, x, baseline, size, 0, &p) != 0)
+    return;
+
+  float dist[CHUNK];
+  uint8_t coverage[CHUNK];
+  for (int32_t y = p.y0; y < p.y1; ++y) {
+    float v = (y + 0.5f - p.oy) / p.s - 0.5f;
+    for (int32_t cx = p.x0; cx < p.x1; cx += CHUNK) {
+      uint32_t n = MIN(p.x1 - cx, CHUNK);
+      for (uint32_t i = 0; i < n; ++i) {
+        dist[i] = sample(atlas, glyph, (cx + i + 0.5f - p.ox) / p.s - 0.5f, v);
+      }
+      sdf_coverage(dist, coverage, n, p.scale, p.bias);
+      twl_raster_blend_mask(raster, cx, y, coverage, n, 1, n, xrgb);
+    }
+  }
+}
+
+// FreeType's default LCD filter, a light low-pass that keeps color fringes down
+static void lcd_filter(const uint8_t *samples, uint8_t *mask, uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i) {
+    const uint8_t *c = samples + i + 2;
+    mask[i] = (8 * c[-2] + 77 * c[-1] + 86 * c[0] + 77 * c[1] + 8 * c[2]) >> 8;
+  }
+}
+
+void twl_glyph_atlas_draw_lcd(const struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const struct twl_glyph *glyph, float x,
+                              float baseline, float size, const struct twl_text_gamma *gamma, enum twl_subpixel order) {
+  struct placement p;
+  // The filter spreads coverage into the neighbouring pixels
+  if (place(raster, glyph, x, baseline, size, 1, &p) != 0)
+    return;
+
+  float dist[LCD_SAMPLES];
+  uint8_t samples[LCD_SAMPLES];
+  uint8_t mask[LCD_CHUNK * 3];
+  for (int32_t y = p.y0; y < p.y1; ++y) {
+    float v = (y + 0.5f - p.oy) / p.s - 0.5f;
+    for (int32_t cx = p.x0; cx < p.x1; cx += LCD_CHUNK) {
+      uint32_t n = MIN(p.x1 - cx, LCD_CHUNK);
+      // Three samples per pixel, at the centers of its subpixels, and two more on each side for the filter
+      for (uint32_t i = 0; i < n * 3 + 4; ++i) {
+        float sx = cx + (i - 2 + 0.5f) / 3;
+        dist[i] = sample(atlas, glyph, (sx - p.ox) / p.s - 0.5f, v);
+      }
+      sdf_coverage(dist, samples, n * 3 + 4, p.scale, p.bias);
+      lcd_filter(samples, mask, n * 3);
+      twl_raster_blend_lcd(raster, cx, y, mask, n, 1, n * 3, gamma, order);
+    }
+  }
+}
+
+// Decodes one UTF-8 sequence, invalid bytes come out as U+FFFD
+static uint32_t next_codepoint(const char **text, const char *end) {
+  const uint8_t *s = (const uint8_t *)*text;
+  uint32_t len = s[0] < 0x80 ? 1 : (s[0] & 0xE0) == 0xC0 ? 2 : (s[0] & 0xF0) == 0xE0 ? 3 : (s[0] & 0xF8) == 0xF0 ? 4 : 0;
+  uint32_t codepoint = len == 1 ? s[0] : len ? s[0] & (0x7F >> len) : 0xFFFD;
+  if (len > end - *text) {
+    *text = end;
+    return 0xFFFD;
+  }
+  for (uint32_t i = 1; i < len; ++i) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *text += i;
+      return 0xFFFD;
+    }
+    codepoint = (codepoint << 6) | (s[i] & 0x3F);
+  }
+  *text += len ? len : 1;
+  return codepoint;
+}
+
+float twl_glyph_atlas_draw_utf8(struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const char *text, size_t len, float x,
+                                float baseline, float size, const struct twl_text_gamma *gamma, enum twl_subpixel order) {
+  float s = size / TWL_SDF_SIZE;
+  const char *end = text + len;
+  // Long lines aren't decoded past the edge
+  while (text < end && x < raster->width) {
+    const struct twl_glyph *glyph = twl_glyph_atlas_get(atlas, next_codepoint(&text, end));
+    if (glyph == NULL)
+      glyph = twl_glyph_atlas_get(atlas, '?');
+    if (glyph == NULL)
+      continue;
+    if (order == TWL_SUBPIXEL_NONE)
+      twl_glyph_atlas_draw(atlas, raster, glyph, x, baseline, size, gamma->xrgb);
+    else
+      twl_glyph_atlas_draw_lcd(atlas, raster, glyph, x, baseline, size, gamma, order);
+    x += glyph->advance * s;
+  }
+  return x;
+}
+
+float twl_glyph_atlas_measure_text(struct twl_glyph_atlas *atlas, const char *text, float size) {
+  return twl_glyph_atlas_measure_utf8(atlas, text, strlen(text), size);
+}
+
+float twl_glyph_atlas_measure_utf8(struct twl_glyph_atlas *atlas, const char *text, size_t len, float size) {
+  float width = 0;
+  const char *end = text + len;
+  while (text < end) {
+    const struct twl_glyph *glyph = twl_glyph_atlas_get(atlas, next_codepoint(&text, end));
+    if (glyph == NULL)
+      glyph = twl_glyph_atlas_get(atlas, '?');
+    if (glyph)
+      width += glyph->advance;
+  }
+  return width * size / TWL_SDF_SIZE;
+}
+
+float twl_glyph_atlas_draw_text(struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const char *text, float x, float baseline,
+                                float size, uint32_t xrgb) {
+  struct twl_text_gamma gamma = {.xrgb = xrgb};
+  return twl_glyph_atlas_draw_utf8(atlas, raster, text, strlen(text), x, baseline, size, &gamma, TWL_SUBPIXEL_NONE);
+}
+
+float twl_glyph_atlas_draw_text_lcd(struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const char *text, float x, float baseline,
+                                    float size, const struct twl_text_gamma *gamma, enum twl_subpixel order) {
+  return twl_glyph_atlas_draw_utf8(atlas, raster, text, strlen(text), x, baseline, size, gamma, order);
+}
@@ -0,0 +1,88 @@
+#ifndef __TWL_GLYPH_ATLAS_H__
+#define __TWL_GLYPH_ATLAS_H__
+
+#include "../wayland/utils/fzn_std.h"
+#include "raster.h"
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <stdint.h>
+
+// Glyphs are rasterized once, as signed distance fields at this pixel size,
+// and drawn at any size from there: zooming never goes back to FreeType.
+#define TWL_SDF_SIZE 48
+// Distance range stored around the outline, in pixels at TWL_SDF_SIZE.
+// Bounds how far text can be scaled down before strokes start to merge.
+#define TWL_SDF_SPREAD 8
+#define TWL_ATLAS_WIDTH 1024
+
+struct twl_glyph {
+  uint32_t codepoint;
+  // Distance field in the atlas, empty for blank glyphs
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+  // Top-left of the field relative to the pen on the baseline, y up, at TWL_SDF_SIZE
+  int16_t left;
+  int16_t top;
+  float advance;
+  // Not in the font: kept so the lookup isn't repeated, not even on the next start
+  uint32_t missing;
+};
+
+// Single-channel atlas of distance fields, 128 on the outline and more inside.
+// Not thread-safe: glyphs are added on first use, keep one atlas per drawing thread.
+struct twl_glyph_atlas {
+  // Only loaded when a glyph is missing from the cache
+  FT_Library ft_library;
+  FT_Face ft_face;
+  fzn_mmap font; // the font file, FreeType reads it in place
+  uint64_t font_hash;
+  // Cache file the pixels and glyphs are used from until they outgrow it, see atlas_cache.h
+  fzn_mmap cache;
+  uint32_t num_cached; // glyphs already saved
+  // Rows of TWL_ATLAS_WIDTH bytes, glyphs are packed on shelves
+  uint8_t *pixels;
+  uint32_t height;
+  uint32_t shelf_x;
+  uint32_t shelf_y;
+  uint32_t shelf_height;
+  struct twl_glyph *glyphs;
+  uint32_t num_glyphs;
+  uint32_t glyph_capacity;
+  // Open addressing by codepoint, entries are glyph indices + 1
+  uint32_t *slots;
+  uint32_t num_slots;
+  // At TWL_SDF_SIZE
+  float ascender;
+  float line_height;
+};
+
+// Glyphs are rasterized on first use, a few ms each, and kept in an on-disk cache:
+// the next start maps them instead. New glyphs are saved by twl_glyph_atlas_destroy().
+int twl_glyph_atlas_init(struct twl_glyph_atlas *atlas, const char *font_path);
+void twl_glyph_atlas_destroy(struct twl_glyph_atlas *atlas);
+// NULL if the font has no such glyph. The pointer is valid until the next glyph is added.
+const struct twl_glyph *twl_glyph_atlas_get(struct twl_glyph_atlas *atlas, uint32_t codepoint);
+// Draws a glyph at `size` pixels with its pen at (x, baseline)
+void twl_glyph_atlas_draw(const struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const struct twl_glyph *glyph, float x,
+                          float baseline, float size, uint32_t xrgb);
+// Subpixel rendering: three times the horizontal resolution on LCDs, see twl_window_subpixel().
+// Only for opaque backgrounds.
+void twl_glyph_atlas_draw_lcd(const struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const struct twl_glyph *glyph, float x,
+                              float baseline, float size, const struct twl_text_gamma *gamma, enum twl_subpixel order);
+// Width of UTF-8 text on one line. Adds the glyphs it uses, so layout can run ahead of drawing.
+float twl_glyph_atlas_measure_text(struct twl_glyph_atlas *atlas, const char *text, float size);
+float twl_glyph_atlas_measure_utf8(struct twl_glyph_atlas *atlas, const char *text, size_t len, float size);
+// Draws UTF-8 text on one line, returns the pen position after it.
+// Glyphs past the raster's right edge are skipped, the position stops there.
+float twl_glyph_atlas_draw_text(struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const char *text, float x, float baseline,
+                                float size, uint32_t xrgb);
+// Falls back to grayscale for TWL_SUBPIXEL_NONE
+float twl_glyph_atlas_draw_text_lcd(struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const char *text, float x, float baseline,
+                                    float size, const struct twl_text_gamma *gamma, enum twl_subpixel order);
+// Text that isn't NUL-terminated, e.g. a line of a mapped file. Grayscale in gamma->xrgb for TWL_SUBPIXEL_NONE.
+float twl_glyph_atlas_draw_utf8(struct twl_glyph_atlas *atlas, const struct twl_raster *raster, const char *text, size_t len, float x,
+                                float baseline, float size, const struct twl_text_gamma *gamma, enum twl_subpixel order);
+
+#endif
@@ -0,0 +1,344 @@
+#include "raster.h"
+#include <math.h>
+#include <string.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Formats
+// =======
+
+uint32_t twl_format_bpp(enum twl_format format) {
+  switch (format) {
+  case TWL_FORMAT_RGB565:
+    return 2;
+  case TWL_FORMAT_XRGB8888:
+  default:
+    return 4;
+  }
+}
+
+uint32_t twl_format_pack(enum twl_format format, uint32_t xrgb) {
+  switch (format) {
+  case TWL_FORMAT_RGB565:
+    return ((xrgb >> 8) & 0xF800) | ((xrgb >> 5) & 0x07E0) | ((xrgb >> 3) & 0x001F);
+  case TWL_FORMAT_ARGB8888:
+    return xrgb;
+  case TWL_FORMAT_XRGB8888:
+  default:
+    return xrgb | 0xFF000000;
+  }
+}
+
+uint32_t twl_format_unpack(enum twl_format format, uint32_t pixel) {
+  switch (format) {
+  case TWL_FORMAT_RGB565: {
+    // Replicate the high bits so that white stays white
+    uint32_t r = (pixel >> 11) & 0x1F, g = (pixel >> 5) & 0x3F, b = pixel & 0x1F;
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return 0xFF000000 | (r << 16) | (g << 8) | b;
+  }
+  case TWL_FORMAT_ARGB8888:
+    return pixel;
+  case TWL_FORMAT_XRGB8888:
+  default:
+    return pixel | 0xFF000000;
+  }
+}
+
+// Kernels
+// =======
+
+// One kernel per pixel size; the loops are simple enough for the compiler to vectorize.
+
+static void fill_rect_32(const struct twl_raster *raster, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t pixel) {
+  for (uint32_t row = y; row < y + height; ++row) {
+    uint32_t *dst = (uint32_t *)(raster->pixels + (size_t)row * raster->stride) + x;
+    for (uint32_t i = 0; i < width; ++i)
+      dst[i] = pixel;
+  }
+}
+
+static void fill_rect_16(const struct twl_raster *raster, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t pixel) {
+  uint16_t value = pixel;
+  for (uint32_t row = y; row < y + height; ++row) {
+    uint16_t *dst = (uint16_t *)(raster->pixels + (size_t)row * raster->stride) + x;
+    for (uint32_t i = 0; i < width; ++i)
+      dst[i] = value;
+  }
+}
+
+// (d * (255 - a) + s * a) / 255, rounded, without the division
+static uint32_t lerp255(uint32_t d, uint32_t s, uint32_t a) {
+  uint32_t t = d * (255 - a) + s * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+// Per channel dst + (src - dst) * coverage, alpha included, so premultiplied ARGB stays valid
+static uint32_t blend_pixel(uint32_t dst, uint32_t src, uint32_t coverage) {
+  uint32_t out = 0;
+  for (uint32_t shift = 0; shift < 32; shift += 8) {
+    out |= lerp255((dst >> shift) & 0xFF, (src >> shift) & 0xFF, coverage) << shift;
+  }
+  return out;
+}
+
+static void blend_mask_32(const struct twl_raster *raster, uint32_t x, uint32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                          uint32_t mask_stride, uint32_t xrgb) {
+  for (uint32_t row = 0; row < height; ++row) {
+    uint32_t *dst = (uint32_t *)(raster->pixels + (size_t)(y + row) * raster->stride) + x;
+    const uint8_t *m = mask + (size_t)row * mask_stride;
+    for (uint32_t i = 0; i < width; ++i) {
+      if (m[i] == 0xFF)
+        dst[i] = xrgb;
+      else if (m[i])
+        dst[i] = blend_pixel(dst[i], xrgb, m[i]);
+    }
+  }
+}
+
+static void blend_mask_16(const struct twl_raster *raster, uint32_t x, uint32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                          uint32_t mask_stride, uint32_t xrgb) {
+  uint16_t solid = twl_format_pack(TWL_FORMAT_RGB565, xrgb);
+  for (uint32_t row = 0; row < height; ++row) {
+    uint16_t *dst = (uint16_t *)(raster->pixels + (size_t)(y + row) * raster->stride) + x;
+    const uint8_t *m = mask + (size_t)row * mask_stride;
+    for (uint32_t i = 0; i < width; ++i) {
+      if (m[i] == 0xFF)
+        dst[i] = solid;
+      else if (m[i])
+        dst[i] = twl_format_pack(TWL_FORMAT_RGB565, blend_pixel(twl_format_unpack(TWL_FORMAT_RGB565, dst[i]), xrgb, m[i]));
+    }
+  }
+}
+
+// Per channel coverage: what the LCD blend spends its time on, so it gets SIMD kernels.
+// `coverage` holds one byte per channel of every pixel, in the pixel's byte order (B, G, R, A).
+// Every kernel rounds exactly like lerp255().
+
+static void blend_channels_scalar(uint32_t *dst, const uint8_t *coverage, uint32_t n, uint32_t pixel) {
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t out = 0;
+    for (uint32_t c = 0; c < 4; ++c) {
+      out |= lerp255((dst[i] >> (c * 8)) & 0xFF, (pixel >> (c * 8)) & 0xFF, coverage[i * 4 + c]) << (c * 8);
+    }
+    dst[i] = out;
+  }
+}
+
+#ifdef __x86_64__
+// 8 bit lanes widened to 16 bits: d * (255 - c) + s * c fits, and so does the rounding
+static inline __m128i blend_epi16(__m128i d, __m128i s, __m128i c) {
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), c)), _mm_mullo_epi16(s, c));
+  t = _mm_add_epi16(t, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// SSE2 is part of x86-64: 4 pixels per iteration
+static void blend_channels_sse2(uint32_t *dst, const uint8_t *coverage, uint32_t n, uint32_t pixel) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32(pixel), zero);
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+    __m128i c = _mm_loadu_si128((__m128i *)(coverage + i * 4));
+    __m128i lo = blend_epi16(_mm_unpacklo_epi8(d, zero), s, _mm_unpacklo_epi8(c, zero));
+    __m128i hi = blend_epi16(_mm_unpackhi_epi8(d, zero), s, _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  blend_channels_scalar(dst + i, coverage + i * 4, n - i, pixel);
+}
+
+// 8 pixels per iteration, picked at runtime
+__attribute__((target("avx2"))) static void blend_channels_avx2(uint32_t *dst, const uint8_t *coverage, uint32_t n, uint32_t pixel) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i s = _mm256_unpacklo_epi8(_mm256_set1_epi32(pixel), zero);
+  __m256i max = _mm256_set1_epi16(255), round = _mm256_set1_epi16(128);
+  uint32_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+    __m256i c = _mm256_loadu_si256((__m256i *)(coverage + i * 4));
+    // unpack and pack work within 128-bit lanes, so the pixel order survives the round trip
+    __m256i out[2];
+    for (int half = 0; half < 2; ++half) {
+      __m256i dh = half ? _mm256_unpackhi_epi8(d, zero) : _mm256_unpacklo_epi8(d, zero);
+      __m256i ch = half ? _mm256_unpackhi_epi8(c, zero) : _mm256_unpacklo_epi8(c, zero);
+      __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(dh, _mm256_sub_epi16(max, ch)), _mm256_mullo_epi16(s, ch));
+      t = _mm256_add_epi16(t, round);
+      out[half] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    }
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(out[0], out[1]));
+  }
+  blend_channels_sse2(dst + i, coverage + i * 4, n - i, pixel);
+}
+
+static void blend_channels(uint32_t *dst, const uint8_t *coverage, uint32_t n, uint32_t pixel) {
+  static int has_avx2 = -1;
+  if (has_avx2 < 0)
+    has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2)
+    blend_channels_avx2(dst, coverage, n, pixel);
+  else
+    blend_channels_sse2(dst, coverage, n, pixel);
+}
+#else
+#define blend_channels blend_channels_scalar
+#endif
+
+// Pixels expanded and blended at a time
+#define LCD_CHUNK 64
+
+static void blend_lcd_32(const struct twl_raster *raster, uint32_t x, uint32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                         uint32_t mask_stride, const struct twl_text_gamma *gamma, const uint32_t order[3], uint32_t pixel) {
+  uint8_t coverage[LCD_CHUNK * 4];
+  for (uint32_t row = 0; row < height; ++row) {
+    uint32_t *dst = (uint32_t *)(raster->pixels + (size_t)(y + row) * raster->stride) + x;
+    const uint8_t *m = mask + (size_t)row * mask_stride;
+
+    for (uint32_t start = 0; start < width; start += LCD_CHUNK) {
+      uint32_t n = MIN(width - start, LCD_CHUNK);
+      // The gamma lookups don't vectorize without gathers, they run on the bytes first
+      for (uint32_t i = 0; i < n; ++i) {
+        const uint8_t *sub = m + (start + i) * 3;
+        uint8_t r = gamma->lut[0][sub[order[0]]], g = gamma->lut[1][sub[order[1]]], b = gamma->lut[2][sub[order[2]]];
+        coverage[i * 4 + 0] = b;
+        coverage[i * 4 + 1] = g;
+        coverage[i * 4 + 2] = r;
+        coverage[i * 4 + 3] = MAX(r, MAX(g, b));
+      }
+      blend_channels(dst + start, coverage, n, pixel);
+    }
+  }
+}
+
+static void blend_lcd_16(const struct twl_raster *raster, uint32_t x, uint32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                         uint32_t mask_stride, const struct twl_text_gamma *gamma, const uint32_t order[3]) {
+  for (uint32_t row = 0; row < height; ++row) {
+    uint16_t *dst = (uint16_t *)(raster->pixels + (size_t)(y + row) * raster->stride) + x;
+    const uint8_t *m = mask + (size_t)row * mask_stride;
+    for (uint32_t i = 0; i < width; ++i) {
+      const uint8_t *sub = m + i * 3;
+      uint32_t d = twl_format_unpack(TWL_FORMAT_RGB565, dst[i]), out = 0;
+      for (uint32_t c = 0; c < 3; ++c) {
+        uint32_t shift = 16 - c * 8;
+        out |= lerp255((d >> shift) & 0xFF, (gamma->xrgb >> shift) & 0xFF, gamma->lut[c][sub[order[c]]]) << shift;
+      }
+      dst[i] = twl_format_pack(TWL_FORMAT_RGB565, out);
+    }
+  }
+}
+
+// Text Gamma
+// ==========
+
+void twl_text_gamma_init(struct twl_text_gamma *gamma, uint32_t xrgb, float exponent) {
+  gamma->xrgb = xrgb;
+
+  // Dark text blended in sRGB already has the right weight, light text comes out thin.
+  // The correction grows with the text's luminance, so both themes look alike.
+  float luminance = (0.2126f * ((xrgb >> 16) & 0xFF) + 0.7152f * ((xrgb >> 8) & 0xFF) + 0.0722f * (xrgb & 0xFF)) / 255.0f;
+  exponent = 1 + (exponent - 1) * luminance;
+
+  for (uint32_t c = 0; c < 3; ++c) {
+    float s = ((xrgb >> (16 - c * 8)) & 0xFF) / 255.0f, d = 1 - s;
+    float ls = powf(s, exponent), ld = powf(d, exponent);
+    for (uint32_t i = 0; i < 256; ++i) {
+      // Mid grey has no contrasting background, coverage is left alone
+      if (fabsf(s - d) < 1 / 255.0f) {
+        gamma->lut[c][i] = i;
+        continue;
+      }
+      float blended = powf(ld + (ls - ld) * (i / 255.0f), 1 / exponent);
+      float corrected = (blended - d) / (s - d);
+      gamma->lut[c][i] = (uint8_t)(fminf(fmaxf(corrected, 0), 1) * 255 + 0.5f);
+    }
+  }
+}
+
+// Raster
+// ======
+
+void twl_raster_from_buffer(struct twl_raster *raster, const struct twl_buffer *buffer) {
+  raster->pixels = buffer->mmap.addr;
+  raster->width = buffer->width;
+  raster->height = buffer->height;
+  raster->stride = buffer->stride;
+  raster->format = buffer->format;
+}
+
+void twl_raster_fill_rect(const struct twl_raster *raster, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t xrgb) {
+  int32_t x0 = MAX(x, 0), y0 = MAX(y, 0);
+  int32_t x1 = MIN(x + width, (int32_t)raster->width), y1 = MIN(y + height, (int32_t)raster->height);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  uint32_t pixel = twl_format_pack(raster->format, xrgb);
+  switch (raster->format) {
+  case TWL_FORMAT_RGB565:
+    fill_rect_16(raster, x0, y0, x1 - x0, y1 - y0, pixel);
+    break;
+  default:
+    fill_rect_32(raster, x0, y0, x1 - x0, y1 - y0, pixel);
+    break;
+  }
+}
+
+void twl_raster_blend_mask(const struct twl_raster *raster, int32_t x, int32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                           uint32_t mask_stride, uint32_t xrgb) {
+  int32_t x0 = MAX(x, 0), y0 = MAX(y, 0);
+  int32_t x1 = MIN(x + (int32_t)width, (int32_t)raster->width), y1 = MIN(y + (int32_t)height, (int32_t)raster->height);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  mask += (size_t)(y0 - y) * mask_stride + (x0 - x);
+  uint32_t pixel = twl_format_pack(raster->format, xrgb);
+  switch (raster->format) {
+  case TWL_FORMAT_RGB565:
+    blend_mask_16(raster, x0, y0, mask, x1 - x0, y1 - y0, mask_stride, xrgb);
+    break;
+  default:
+    blend_mask_32(raster, x0, y0, mask, x1 - x0, y1 - y0, mask_stride, pixel);
+    break;
+  }
+}
+
+void twl_raster_blend_lcd(const struct twl_raster *raster, int32_t x, int32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                          uint32_t mask_stride, const struct twl_text_gamma *gamma, enum twl_subpixel order) {
+  int32_t x0 = MAX(x, 0), y0 = MAX(y, 0);
+  int32_t x1 = MIN(x + (int32_t)width, (int32_t)raster->width), y1 = MIN(y + (int32_t)height, (int32_t)raster->height);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  // Index of the subpixel feeding red, green and blue
+  static const uint32_t rgb[3] = {0, 1, 2}, bgr[3] = {2, 1, 0};
+  const uint32_t *channels = order == TWL_SUBPIXEL_BGR ? bgr : rgb;
+
+  mask += (size_t)(y0 - y) * mask_stride + (x0 - x) * 3;
+  switch (raster->format) {
+  case TWL_FORMAT_RGB565:
+    blend_lcd_16(raster, x0, y0, mask, x1 - x0, y1 - y0, mask_stride, gamma, channels);
+    break;
+  default:
+    blend_lcd_32(raster, x0, y0, mask, x1 - x0, y1 - y0, mask_stride, gamma, channels, twl_format_pack(raster->format, gamma->xrgb));
+    break;
+  }
+}
+
+void twl_raster_read_row(const struct twl_raster *raster, uint32_t y, uint32_t *out) {
+  const uint8_t *row = raster->pixels + (size_t)y * raster->stride;
+  switch (raster->format) {
+  case TWL_FORMAT_RGB565:
+    for (uint32_t x = 0; x < raster->width; ++x)
+      out[x] = twl_format_unpack(TWL_FORMAT_RGB565, ((const uint16_t *)row)[x]);
+    break;
+  case TWL_FORMAT_XRGB8888:
+  default:
+    memcpy(out, row, (size_t)raster->width * 4);
+    break;
+  }
+}
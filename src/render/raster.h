@@ -0,0 +1,47 @@
+#ifndef __TWL_RASTER_H__
+#define __TWL_RASTER_H__
+
+#include "../wayland/wayland.h"
+#include <stdint.h>
+
+// View of a buffer for the raster kernels.
+// Colors are always passed as (A)RGB8888 and packed once per call into the target format.
+// Alpha is only kept by ARGB8888 targets; only coverage masks are blended.
+struct twl_raster {
+  uint8_t *pixels;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  enum twl_format format;
+};
+
+// Exponent of the display's transfer curve, close enough to sRGB
+#define TWL_TEXT_GAMMA 2.2f
+
+// Coverage correction for one text color. Blending in sRGB by the corrected coverage gives what
+// blending in linear light would over the background that contrasts most with the text,
+// scaled down for dark text.
+struct twl_text_gamma {
+  uint32_t xrgb;
+  uint8_t lut[3][256]; // red, green, blue
+};
+
+uint32_t twl_format_bpp(enum twl_format format);
+uint32_t twl_format_pack(enum twl_format format, uint32_t xrgb);
+uint32_t twl_format_unpack(enum twl_format format, uint32_t pixel);
+
+void twl_raster_from_buffer(struct twl_raster *raster, const struct twl_buffer *buffer);
+// Clipped to the raster
+void twl_raster_fill_rect(const struct twl_raster *raster, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t xrgb);
+// Blends `xrgb` over the raster by a 0-255 coverage mask, e.g. text. Clipped to the raster.
+void twl_raster_blend_mask(const struct twl_raster *raster, int32_t x, int32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                           uint32_t mask_stride, uint32_t xrgb);
+void twl_text_gamma_init(struct twl_text_gamma *gamma, uint32_t xrgb, float exponent);
+// Blends gamma->xrgb by a mask of three coverages per pixel, one per subpixel from left to right.
+// `order` says which channel each of them belongs to; NONE treats the mask as RGB.
+void twl_raster_blend_lcd(const struct twl_raster *raster, int32_t x, int32_t y, const uint8_t *mask, uint32_t width, uint32_t height,
+                          uint32_t mask_stride, const struct twl_text_gamma *gamma, enum twl_subpixel order);
+// Converts a row to XRGB8888
+void twl_raster_read_row(const struct twl_raster *raster, uint32_t y, uint32_t *out);
+
+#endif
@@ -0,0 +1,503 @@
+#include "document.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// UTF-8
+// =====
+
+// Length of the well-formed sequence at p, 0 if there is none (overlongs, surrogates and
+// anything above U+10FFFF included)
+static uint32_t utf8_sequence(const uint8_t *p, const uint8_t *end) {
+  uint8_t b = p[0];
+  if (b < 0x80)
+    return 1;
+
+  uint32_t len;
+  uint8_t lo = 0x80, hi = 0xBF; // range of the second byte
+  if (b >= 0xC2 && b <= 0xDF) {
+    len = 2;
+  } else if (b >= 0xE0 && b <= 0xEF) {
+    len = 3;
+    lo = b == 0xE0 ? 0xA0 : lo;
+    hi = b == 0xED ? 0x9F : hi;
+  } else if (b >= 0xF0 && b <= 0xF4) {
+    len = 4;
+    lo = b == 0xF0 ? 0x90 : lo;
+    hi = b == 0xF4 ? 0x8F : hi;
+  } else {
+    return 0;
+  }
+
+  if (end - p < len || p[1] < lo || p[1] > hi)
+    return 0;
+  for (uint32_t i = 2; i < len; ++i) {
+    if ((p[i] & 0xC0) != 0x80)
+      return 0;
+  }
+  return len;
+}
+
+// Validates from *pos until at least `until`, the last sequence may end past it
+static int validate_utf8(const uint8_t *p, const uint8_t *end, uint32_t *pos, uint32_t until) {
+  while (*pos < until) {
+    uint32_t len = utf8_sequence(p + *pos, end);
+    if (len == 0)
+      return 0;
+    *pos += len;
+  }
+  return 1;
+}
+
+// Bytes at the start of a chunk that finish the previous chunk's last sequence, it checks them
+static uint32_t continued_bytes(const uint8_t *file, uint64_t start) {
+  for (uint32_t back = 1; back <= 3 && back <= start; ++back) {
+    uint8_t b = file[start - back];
+    if ((b & 0xC0) != 0x80) {
+      uint32_t len = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : b >= 0xC0 ? 2 : 1;
+      return len > back ? len - back : 0;
+    }
+  }
+  return 0;
+}
+
+// Indexing
+// ========
+
+static int push_newline(struct twl_document_chunk *chunk, uint32_t offset) {
+  if (chunk->num_newlines == chunk->capacity) {
+    uint32_t capacity = MAX(chunk->capacity * 2, 1024);
+    uint32_t *newlines = realloc(chunk->newlines, capacity * sizeof(uint32_t));
+    if (newlines == NULL)
+      return -1;
+    chunk->newlines = newlines;
+    chunk->capacity = capacity;
+  }
+  chunk->newlines[chunk->num_newlines++] = offset;
+  return 0;
+}
+
+// One pass over the chunk finds the newlines and validates UTF-8; the validator only
+// looks at blocks with non-ASCII bytes in them.
+static int index_chunk(struct twl_document *doc, struct twl_document_chunk *chunk) {
+  const uint8_t *file = doc->file.addr;
+  const uint8_t *end = file + doc->size;
+  const uint8_t *p = file + chunk->start;
+  uint32_t n = chunk->size;
+  uint32_t utf8 = continued_bytes(file, chunk->start); // next byte to validate
+  int valid = 1;
+  uint32_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+    uint32_t non_ascii = _mm_movemask_epi8(v);
+    for (; newlines; newlines &= newlines - 1) {
+      if (push_newline(chunk, i + __builtin_ctz(newlines)) != 0)
+        return -1;
+    }
+    if (!valid || utf8 >= i + 16)
+      continue;
+    if (non_ascii == 0 && utf8 <= i)
+      utf8 = i + 16;
+    else
+      valid = validate_utf8(p, end, &utf8, i + 16);
+  }
+#endif
+  for (; i < n; ++i) {
+    if (p[i] == '\n' && push_newline(chunk, i) != 0)
+      return -1;
+  }
+  if (valid)
+    valid = validate_utf8(p, end, &utf8, n);
+
+  chunk->is_valid_utf8 = valid;
+  return 0;
+}
+
+static void notify(struct twl_document *doc) {
+  uint64_t one = 1;
+  if (write(doc->event_fd, &one, sizeof(one)) < 0) {
+    // Only fails when the counter is saturated, which wakes the reader just the same
+  }
+}
+
+// Numbers the lines of the chunks indexed so far, as far as they are contiguous from the start
+static void merge(struct twl_document *doc) {
+  pthread_mutex_lock(&doc->merge_lock);
+  uint32_t start = atomic_load_explicit(&doc->num_ready, memory_order_relaxed);
+  uint32_t ready = start;
+  while (ready < doc->num_chunks && atomic_load_explicit(&doc->chunks[ready].is_indexed, memory_order_acquire)) {
+    struct twl_document_chunk *chunk = &doc->chunks[ready];
+    chunk->first_line = ready ? chunk[-1].first_line + chunk[-1].num_newlines : 0;
+    ready++;
+  }
+  if (ready > start)
+    atomic_store_explicit(&doc->num_ready, ready, memory_order_release);
+  pthread_mutex_unlock(&doc->merge_lock);
+
+  if (ready > start)
+    notify(doc);
+}
+
+static void fail(struct twl_document *doc, int error) {
+  doc->error = error;
+  atomic_store(&doc->cancel, 1);
+  atomic_store(&doc->state, TWL_DOCUMENT_FAILED);
+}
+
+static void *worker_main(void *data) {
+  struct twl_document *doc = data;
+  const uint8_t *file = doc->file.addr;
+
+  while (!atomic_load(&doc->cancel)) {
+    uint32_t i = atomic_fetch_add(&doc->next_chunk, 1);
+    if (i >= doc->num_chunks)
+      break;
+
+    // Every worker takes a chunk per round: have the one this worker gets next read in meanwhile
+    uint32_t ahead = i + doc->num_workers;
+    if (ahead < doc->num_chunks)
+      madvise((void *)(file + doc->chunks[ahead].start), doc->chunks[ahead].size, MADV_WILLNEED);
+
+    if (index_chunk(doc, &doc->chunks[i]) != 0) {
+      fail(doc, ENOMEM);
+      break;
+    }
+    atomic_store_explicit(&doc->chunks[i].is_indexed, 1, memory_order_release);
+    merge(doc);
+  }
+  return NULL;
+}
+
+static int open_file(struct twl_document *doc) {
+  int fd = open(doc->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    doc->error = errno;
+    return -1;
+  }
+  struct stat st;
+  int res = fstat(fd, &st);
+  if (res != 0 || !S_ISREG(st.st_mode)) {
+    doc->error = res != 0 ? errno : EINVAL;
+    close(fd);
+    return -1;
+  }
+
+  doc->fd = fd;
+  doc->size = st.st_size;
+  if (doc->size) {
+    fzn_mmap_config config = {.size = doc->size, .prot = PROT_READ, .flags = MAP_PRIVATE, .fd = fd};
+    if (fzn_mmap_new(&doc->file, &config) != FZN_SUCCESS) {
+      doc->error = errno;
+      return -1;
+    }
+  }
+
+  doc->num_chunks = (doc->size + TWL_DOCUMENT_CHUNK_SIZE - 1) / TWL_DOCUMENT_CHUNK_SIZE;
+  doc->chunk_capacity = MAX(doc->num_chunks, 1);
+  doc->chunks = calloc(doc->chunk_capacity, sizeof(struct twl_document_chunk));
+  if (doc->chunks == NULL) {
+    doc->error = ENOMEM;
+    return -1;
+  }
+  for (uint32_t i = 0; i < doc->num_chunks; ++i) {
+    doc->chunks[i].start = (uint64_t)i * TWL_DOCUMENT_CHUNK_SIZE;
+    doc->chunks[i].size = MIN(TWL_DOCUMENT_CHUNK_SIZE, doc->size - doc->chunks[i].start);
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_workers = cpus > 0 ? MIN((uint32_t)cpus, TWL_DOCUMENT_MAX_WORKERS) : 1;
+  doc->num_workers = MAX(MIN(num_workers, doc->num_chunks), 1);
+  // The first round of chunks
+  if (doc->size)
+    madvise(doc->file.addr, MIN(doc->size, (uint64_t)doc->num_workers * TWL_DOCUMENT_CHUNK_SIZE), MADV_WILLNEED);
+  return 0;
+}
+
+static void *loader_main(void *data) {
+  struct twl_document *doc = data;
+
+  if (open_file(doc) != 0) {
+    atomic_store(&doc->state, TWL_DOCUMENT_FAILED);
+    notify(doc);
+    return NULL;
+  }
+  atomic_store(&doc->state, TWL_DOCUMENT_LOADING);
+  notify(doc);
+
+  // The loader is a worker too
+  uint32_t num_started = 0;
+  while (num_started + 1 < doc->num_workers && pthread_create(&doc->workers[num_started], NULL, worker_main, doc) == 0) {
+    num_started++;
+  }
+  worker_main(doc);
+  for (uint32_t i = 0; i < num_started; ++i) {
+    pthread_join(doc->workers[i], NULL);
+  }
+
+  uint32_t loading = TWL_DOCUMENT_LOADING;
+  if (!atomic_load(&doc->cancel))
+    atomic_compare_exchange_strong(&doc->state, &loading, TWL_DOCUMENT_LOADED);
+  notify(doc);
+  return NULL;
+}
+
+// Document
+// ========
+
+int twl_document_load(struct twl_document *doc, const char *path) {
+  zero_init(doc, struct twl_document);
+  doc->fd = -1;
+  doc->path = strdup(path);
+  doc->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (doc->path == NULL || doc->event_fd < 0) {
+    free(doc->path);
+    if (doc->event_fd >= 0)
+      close(doc->event_fd);
+    return -1;
+  }
+  pthread_mutex_init(&doc->merge_lock, NULL);
+  pthread_rwlock_init(&doc->append_lock, NULL);
+
+  if (pthread_create(&doc->loader, NULL, loader_main, doc) != 0) {
+    pthread_mutex_destroy(&doc->merge_lock);
+    pthread_rwlock_destroy(&doc->append_lock);
+    close(doc->event_fd);
+    free(doc->path);
+    return -1;
+  }
+  return 0;
+}
+
+void twl_document_destroy(struct twl_document *doc) {
+  atomic_store(&doc->cancel, 1);
+  pthread_join(doc->loader, NULL);
+
+  for (uint32_t i = 0; i < doc->num_chunks; ++i) {
+    free(doc->chunks[i].newlines);
+  }
+  free(doc->chunks);
+  free(doc->tail);
+  fzn_mmap_unmap(&doc->file);
+  if (doc->fd >= 0)
+    close(doc->fd);
+  close(doc->event_fd);
+  pthread_mutex_destroy(&doc->merge_lock);
+  pthread_rwlock_destroy(&doc->append_lock);
+  free(doc->path);
+  zero_init(doc, struct twl_document);
+}
+
+enum twl_document_state twl_document_state(const struct twl_document *doc) { return atomic_load(&doc->state); }
+
+// Appended text is read from the tail, the rest from the mapping
+static const char *text_at(const struct twl_document *doc, uint64_t offset) {
+  if (doc->tail && offset >= doc->tail_start)
+    return (const char *)doc->tail + (offset - doc->tail_start);
+  return (const char *)doc->file.addr + offset;
+}
+
+// Newlines in the first `ready` chunks
+static uint64_t ready_newlines(const struct twl_document *doc, uint32_t ready) {
+  return ready ? doc->chunks[ready - 1].first_line + doc->chunks[ready - 1].num_newlines : 0;
+}
+
+uint64_t twl_document_num_lines(struct twl_document *doc) {
+  // The state first: once loaded, every chunk is ready
+  enum twl_document_state state = atomic_load(&doc->state);
+  if (state != TWL_DOCUMENT_LOADING && state != TWL_DOCUMENT_LOADED)
+    return 0;
+
+  uint64_t newlines = ready_newlines(doc, atomic_load_explicit(&doc->num_ready, memory_order_acquire));
+  // Text after the last '\n' makes one more line, as does an empty file
+  if (state == TWL_DOCUMENT_LOADED && (doc->size == 0 || *text_at(doc, doc->size - 1) != '\n'))
+    return newlines + 1;
+  return newlines;
+}
+
+// Position of the k-th '\n', which has to be in the first `ready` chunks
+static uint64_t newline_offset(const struct twl_document *doc, uint32_t ready, uint64_t k) {
+  // Last chunk starting at or before it; empty chunks share their first_line with the next one
+  uint32_t lo = 0, hi = ready;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (doc->chunks[mid].first_line <= k)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  const struct twl_document_chunk *chunk = &doc->chunks[lo];
+  return chunk->start + chunk->newlines[k - chunk->first_line];
+}
+
+int twl_document_line(struct twl_document *doc, uint64_t line, const char **text, size_t *len) {
+  if (line >= twl_document_num_lines(doc))
+    return -1;
+
+  // At least as far along as when the lines were counted
+  uint32_t ready = atomic_load_explicit(&doc->num_ready, memory_order_acquire);
+  uint64_t newlines = ready_newlines(doc, ready);
+  uint64_t start = line ? newline_offset(doc, ready, line - 1) + 1 : 0;
+  uint64_t end = line < newlines ? newline_offset(doc, ready, line) : doc->size;
+
+  *text = text_at(doc, start);
+  *len = end - start;
+  return 0;
+}
+
+// Appending
+// =========
+
+void *twl_document_reserve(struct twl_document *doc, size_t len) {
+  if (atomic_load(&doc->state) != TWL_DOCUMENT_LOADED)
+    return NULL;
+
+  if (doc->tail == NULL) {
+    // From the start of the mapping's unfinished last line, so that lines never straddle the two
+    uint64_t newlines = ready_newlines(doc, doc->num_chunks);
+    doc->tail_start = newlines ? newline_offset(doc, doc->num_chunks, newlines - 1) + 1 : 0;
+    doc->utf8_checked = doc->size;
+  }
+  size_t used = doc->size - doc->tail_start;
+  if (used + len > doc->tail_capacity) {
+    size_t capacity = MAX(MAX(doc->tail_capacity * 2, used + len), 64u << 10);
+    pthread_rwlock_wrlock(&doc->append_lock);
+    uint8_t *tail = realloc(doc->tail, capacity);
+    if (tail && doc->tail == NULL)
+      memcpy(tail, (const uint8_t *)doc->file.addr + doc->tail_start, used);
+    if (tail) {
+      doc->tail = tail;
+      doc->tail_capacity = capacity;
+    }
+    pthread_rwlock_unlock(&doc->append_lock);
+    if (tail == NULL)
+      return NULL;
+  }
+  return doc->tail + used;
+}
+
+static struct twl_document_chunk *push_chunk(struct twl_document *doc) {
+  if (doc->num_chunks == doc->chunk_capacity) {
+    uint32_t capacity = doc->chunk_capacity * 2;
+    struct twl_document_chunk *chunks = realloc(doc->chunks, capacity * sizeof(struct twl_document_chunk));
+    if (chunks == NULL)
+      return NULL;
+    doc->chunks = chunks;
+    doc->chunk_capacity = capacity;
+  }
+
+  struct twl_document_chunk *chunk = &doc->chunks[doc->num_chunks];
+  zero_init(chunk, struct twl_document_chunk);
+  chunk->start = doc->size;
+  chunk->first_line = ready_newlines(doc, doc->num_chunks);
+  chunk->is_valid_utf8 = 1;
+  chunk->is_indexed = 1;
+  doc->num_chunks++;
+  return chunk;
+}
+
+// A sequence cut short by the end of what was appended so far
+static int utf8_is_truncated(const uint8_t *p, const uint8_t *end) {
+  uint32_t len = p[0] >= 0xF0 && p[0] <= 0xF4 ? 4 : p[0] >= 0xE0 && p[0] <= 0xEF ? 3 : p[0] >= 0xC2 && p[0] <= 0xDF ? 2 : 0;
+  if (end - p >= len)
+    return 0;
+  for (const uint8_t *c = p + 1; c < end; ++c) {
+    if ((*c & 0xC0) != 0x80)
+      return 0;
+  }
+  return 1;
+}
+
+static int append(struct twl_document *doc, size_t len) {
+  const uint8_t *p = (const uint8_t *)text_at(doc, doc->size);
+  const uint8_t *end = p + len;
+
+  // The last chunk fills up before a new one starts, so a stream of short writes makes few chunks
+  while (p < end) {
+    struct twl_document_chunk *chunk = doc->num_chunks ? &doc->chunks[doc->num_chunks - 1] : NULL;
+    if (chunk == NULL || chunk->size == TWL_DOCUMENT_CHUNK_SIZE)
+      chunk = push_chunk(doc);
+    if (chunk == NULL)
+      return -1;
+
+    uint32_t n = MIN(end - p, TWL_DOCUMENT_CHUNK_SIZE - chunk->size);
+    uint32_t num_newlines = chunk->num_newlines;
+    for (const uint8_t *c = p; (c = memchr(c, '\n', p + n - c)); ++c) {
+      if (push_newline(chunk, chunk->size + (c - p)) != 0) {
+        chunk->num_newlines = num_newlines;
+        return -1;
+      }
+    }
+    chunk->size += n;
+    doc->size += n;
+    p += n;
+  }
+
+  // Up to a sequence the writer hasn't finished yet
+  const uint8_t *utf8 = (const uint8_t *)text_at(doc, doc->utf8_checked);
+  while (utf8 < end) {
+    uint32_t n = utf8_sequence(utf8, end);
+    if (n == 0 && utf8_is_truncated(utf8, end))
+      break;
+    if (n == 0) {
+      doc->chunks[doc->num_chunks - 1].is_valid_utf8 = 0;
+      utf8 = end;
+      break;
+    }
+    utf8 += n;
+  }
+  doc->utf8_checked += utf8 - (const uint8_t *)text_at(doc, doc->utf8_checked);
+
+  atomic_store_explicit(&doc->num_ready, doc->num_chunks, memory_order_release);
+  return 0;
+}
+
+int twl_document_append(struct twl_document *doc, size_t len) {
+  pthread_rwlock_wrlock(&doc->append_lock);
+  int res = append(doc, len);
+  pthread_rwlock_unlock(&doc->append_lock);
+  return res;
+}
+
+int twl_document_truncated(struct twl_document *doc, uint64_t file_size) {
+  // The page holding the new end reads as zeros past it, only whole pages fault
+  size_t page_size = getpagesize();
+  uint64_t start = (file_size + page_size - 1) & ~(uint64_t)(page_size - 1);
+  if (doc->file.addr == NULL || start >= doc->file.size)
+    return 0;
+
+  pthread_rwlock_wrlock(&doc->append_lock);
+  void *addr = mmap((char *)doc->file.addr + start, doc->file.size - start, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  pthread_rwlock_unlock(&doc->append_lock);
+  return addr == MAP_FAILED ? -1 : 0;
+}
+
+uint64_t twl_document_offset(const struct twl_document *doc, const char *text) {
+  // Tail first, as in text_at(): it may start right where the mapping ends
+  const char *tail = (const char *)doc->tail;
+  if (tail && text >= tail && text <= tail + (doc->size - doc->tail_start))
+    return doc->tail_start + (text - tail);
+  return text - (const char *)doc->file.addr;
+}
+
+int twl_document_is_valid_utf8(const struct twl_document *doc) {
+  for (uint32_t i = 0; i < doc->num_chunks; ++i) {
+    if (!doc->chunks[i].is_valid_utf8)
+      return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,89 @@
+#ifndef __TWL_DOCUMENT_H__
+#define __TWL_DOCUMENT_H__
+
+#include "../wayland/utils/fzn_std.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Unit of work of the loader: indexed by one worker, merged into the line numbers in file order
+#define TWL_DOCUMENT_CHUNK_SIZE (4u << 20)
+#define TWL_DOCUMENT_MAX_WORKERS 8
+
+enum twl_document_state {
+  TWL_DOCUMENT_OPENING,
+  TWL_DOCUMENT_LOADING, // the file is mapped, lines become available from the start
+  TWL_DOCUMENT_LOADED,
+  TWL_DOCUMENT_FAILED, // see `error`
+};
+
+struct twl_document_chunk {
+  uint64_t start;
+  uint32_t size;
+  // Offsets of the chunk's '\n' from its start
+  uint32_t *newlines;
+  uint32_t num_newlines;
+  uint32_t capacity;
+  // Newlines before the chunk, known once every chunk before it is indexed
+  uint64_t first_line;
+  uint32_t is_valid_utf8;
+  _Atomic uint32_t is_indexed;
+};
+
+// Read-only text file, mapped and indexed by line on worker threads.
+// Nothing here blocks on disk: even opening the file happens on the loader thread.
+struct twl_document {
+  char *path;
+  int fd; // kept open to read what is appended later, see follow.h
+  fzn_mmap file;
+  uint64_t size;
+  struct twl_document_chunk *chunks;
+  uint32_t num_chunks;
+  uint32_t chunk_capacity;
+  // Text appended after loading, from the start of the mapping's unfinished last line on
+  uint8_t *tail;
+  uint64_t tail_start;
+  size_t tail_capacity;
+  uint64_t utf8_checked; // appended text before it is validated
+  // Held for writing while appending: other threads read lines under it
+  pthread_rwlock_t append_lock;
+  // Handed out in file order, so the first screen is the first thing indexed
+  _Atomic uint32_t next_chunk;
+  // Leading chunks with their line numbers, lines in them can be read
+  _Atomic uint32_t num_ready;
+  pthread_mutex_t merge_lock;
+  pthread_t loader;
+  pthread_t workers[TWL_DOCUMENT_MAX_WORKERS - 1];
+  uint32_t num_workers;
+  _Atomic uint32_t state; // enum twl_document_state
+  _Atomic uint32_t cancel;
+  int error; // errno of a failed open
+  // Readable whenever more lines are ready or the state changes. Watch it from the
+  // event loop (twl_watch_fd) and read the 8-byte count to clear it.
+  int event_fd;
+};
+
+// Returns right away, -1 if the loader thread can't be started
+int twl_document_load(struct twl_document *doc, const char *path);
+// Stops loading if it's still going
+void twl_document_destroy(struct twl_document *doc);
+enum twl_document_state twl_document_state(const struct twl_document *doc);
+// Lines that can be read so far; the count is final once the document is loaded
+uint64_t twl_document_num_lines(struct twl_document *doc);
+// Text of a line without its '\n', valid until the next append. -1 if it isn't indexed yet.
+int twl_document_line(struct twl_document *doc, uint64_t line, const char **text, size_t *len);
+// File offset of text returned by twl_document_line()
+uint64_t twl_document_offset(const struct twl_document *doc, const char *text);
+// Growing the document once loaded, from one thread; other threads read lines holding append_lock.
+// Reserve room for `len` bytes at the end, write them there, then index them with
+// twl_document_append(). Only the new bytes are scanned. NULL if the document isn't loaded or out of memory.
+void *twl_document_reserve(struct twl_document *doc, size_t len);
+int twl_document_append(struct twl_document *doc, size_t len);
+// The file was cut to `file_size` under the mapping, whose pages past it would fault on the next
+// read: zero pages take their place. Lines keep their offsets, the text cut off reads as NULs.
+int twl_document_truncated(struct twl_document *doc, uint64_t file_size);
+// Only meaningful once loaded
+int twl_document_is_valid_utf8(const struct twl_document *doc);
+
+#endif
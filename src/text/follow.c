@@ -0,0 +1,138 @@
+#include "follow.h"
+#include "../wayland/wayland.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+
+static void read_appended(struct twl_follow *follow);
+
+static void stop(struct twl_follow *follow, const char *reason) {
+  if (follow->is_stopped)
+    return;
+  fprintf(stderr, "No longer following %s: %s\n", follow->doc->path, reason);
+  twl_unwatch_fd(follow->ctx, follow->inotify_fd);
+  follow->is_stopped = 1;
+}
+
+// A shrunk file can't be followed, and the mapping must let go of what was cut off before it's read
+static int check_size(struct twl_follow *follow) {
+  struct stat st;
+  if (fstat(follow->doc->fd, &st) != 0) {
+    stop(follow, strerror(errno));
+    return -1;
+  }
+  if ((uint64_t)st.st_size >= follow->doc->size)
+    return 0;
+
+  if (twl_document_truncated(follow->doc, st.st_size) != 0)
+    fprintf(stderr, "Can't unmap the truncated part of %s: %s\n", follow->doc->path, strerror(errno));
+  stop(follow, "truncated");
+  return -1;
+}
+
+static void cb_read(void *data, int64_t result) {
+  struct twl_follow *follow = data;
+  follow->is_reading = 0;
+  if (result < 0) {
+    fprintf(stderr, "Can't read %s: %s\n", follow->doc->path, strerror(-result));
+    return;
+  }
+  if (result > 0 && twl_document_append(follow->doc, result) != 0) {
+    fprintf(stderr, "Out of memory following %s\n", follow->doc->path);
+    return;
+  }
+
+  // A full read may have left more behind
+  if (result == TWL_FOLLOW_READ_SIZE || follow->is_stale)
+    read_appended(follow);
+}
+
+// From the document's end, however far the file has grown since
+static void read_appended(struct twl_follow *follow) {
+  if (follow->is_reading) {
+    follow->is_stale = 1;
+    return;
+  }
+  if (follow->is_stopped || twl_document_state(follow->doc) != TWL_DOCUMENT_LOADED || check_size(follow) != 0)
+    return;
+
+  void *buf = twl_document_reserve(follow->doc, TWL_FOLLOW_READ_SIZE);
+  if (buf == NULL || twl_io_read(follow->io, follow->doc->fd, buf, TWL_FOLLOW_READ_SIZE, follow->doc->size, cb_read, follow) != 0 ||
+      twl_io_submit(follow->io) != 0) {
+    fprintf(stderr, "Can't follow %s\n", follow->doc->path);
+    return;
+  }
+  follow->is_reading = 1;
+  follow->is_stale = 0;
+}
+
+static void cb_inotify(void *data, int fd) {
+  struct twl_follow *follow = data;
+  // Writes only say the file changed, one read catches up with all of them
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  uint32_t mask = 0;
+  ssize_t len;
+  while ((len = read(fd, events, sizeof(events))) > 0) {
+    for (char *p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+      mask |= ((struct inotify_event *)p)->mask;
+  }
+
+  read_appended(follow);
+
+  // Rotated: the fd still reads the old file, what's written next goes to another one.
+  // IN_ATTRIB is how an unlink shows while the file is still open elsewhere.
+  struct stat st;
+  if (mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+    stop(follow, "moved or deleted");
+  else if ((mask & IN_ATTRIB) && fstat(follow->doc->fd, &st) == 0 && st.st_nlink == 0)
+    stop(follow, "deleted");
+}
+
+static void cb_document(void *data, int fd) {
+  struct twl_follow *follow = data;
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0) {
+    // Cleared already
+  }
+
+  enum twl_document_state state = twl_document_state(follow->doc);
+  if (state == TWL_DOCUMENT_LOADED || state == TWL_DOCUMENT_FAILED)
+    twl_unwatch_fd(follow->ctx, fd);
+  if (state == TWL_DOCUMENT_LOADED)
+    read_appended(follow);
+}
+
+int twl_follow_init(struct twl_follow *follow, struct twl_document *doc, struct twl_io *io, struct twl_context *ctx) {
+  zero_init(follow, struct twl_follow);
+  follow->doc = doc;
+  follow->io = io;
+  follow->ctx = ctx;
+  follow->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (follow->inotify_fd < 0)
+    return -1;
+  if (inotify_add_watch(follow->inotify_fd, doc->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0) {
+    close(follow->inotify_fd);
+    return -1;
+  }
+
+  twl_watch_fd(ctx, follow->inotify_fd, POLLIN, cb_inotify, follow);
+  // Loaded already, or notified when it is
+  if (twl_document_state(doc) == TWL_DOCUMENT_LOADED)
+    read_appended(follow);
+  else
+    twl_watch_fd(ctx, doc->event_fd, POLLIN, cb_document, follow);
+  return 0;
+}
+
+void twl_follow_destroy(struct twl_follow *follow) {
+  twl_unwatch_fd(follow->ctx, follow->inotify_fd);
+  twl_unwatch_fd(follow->ctx, follow->doc->event_fd); // if it's still watched
+  close(follow->inotify_fd);
+  zero_init(follow, struct twl_follow);
+}
@@ -0,0 +1,32 @@
+#ifndef __TWL_FOLLOW_H__
+#define __TWL_FOLLOW_H__
+
+#include "../wayland/io.h"
+#include "document.h"
+#include <stdint.h>
+
+// Largest read of appended text, a bigger burst takes several
+#define TWL_FOLLOW_READ_SIZE (1u << 20)
+
+// Like tail -f: the document grows with its file. inotify wakes the event loop when the file is
+// written, only the appended range is read (through twl_io, straight into the document) and only
+// the new text is indexed, so an update costs what was appended and not the file's size.
+// Following stops once the file is moved, deleted or truncated (logrotate's copytruncate): the
+// text already read stays, see twl_document_truncated() for what was cut off.
+struct twl_follow {
+  struct twl_document *doc;
+  struct twl_io *io;
+  struct twl_context *ctx;
+  int inotify_fd;
+  uint32_t is_reading;
+  uint32_t is_stale; // written to while a read was in flight
+  uint32_t is_stopped;
+};
+
+// Starts once the document is loaded, with whatever was appended while it was loading.
+// Watches the document's event_fd, don't watch it elsewhere.
+int twl_follow_init(struct twl_follow *follow, struct twl_document *doc, struct twl_io *io, struct twl_context *ctx);
+// Destroy the io first, a read in flight would complete into the follower otherwise
+void twl_follow_destroy(struct twl_follow *follow);
+
+#endif
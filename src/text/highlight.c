@@ -0,0 +1,284 @@
+#include "highlight.h"
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Lexer states
+// ============
+
+static uint32_t lex_state(struct twl_highlighter *hl, uint32_t state, const char *text, size_t len) {
+  uint32_t num_spans = 0;
+  return hl->language->lex(state, text, len, NULL, &num_spans, 0);
+}
+
+static int store_state(struct twl_highlighter *hl, uint64_t i, uint32_t state) {
+  if (i >= hl->capacity) {
+    uint64_t capacity = MAX(hl->capacity * 2, 4096);
+    uint32_t *states = realloc(hl->states, capacity * sizeof(uint32_t));
+    if (states == NULL)
+      return -1;
+    hl->states = states;
+    hl->capacity = capacity;
+  }
+  hl->states[i] = state;
+  return 0;
+}
+
+// Lexes on from the last right state, up to TWL_HIGHLIGHT_SLICE lines.
+// Returns 1 if there are more lines to go.
+static int lex_slice(struct twl_highlighter *hl) {
+  struct twl_document *doc = hl->doc;
+  pthread_rwlock_rdlock(&doc->append_lock);
+
+  uint64_t num_lines = twl_document_num_lines(doc);
+  uint64_t line = (hl->num_valid - 1) * TWL_HIGHLIGHT_INTERVAL;
+  uint64_t end = MIN(line + TWL_HIGHLIGHT_SLICE, num_lines);
+  uint32_t state = hl->states[hl->num_valid - 1];
+  const char *text;
+  size_t len;
+  while (line < end && twl_document_line(doc, line, &text, &len) == 0) {
+    state = lex_state(hl, state, text, len);
+    if (++line % TWL_HIGHLIGHT_INTERVAL)
+      continue;
+
+    uint64_t i = line / TWL_HIGHLIGHT_INTERVAL;
+    if (i < hl->num_states && hl->states[i] == state && line >= hl->converge_line) {
+      // Past the change and in the same state as before: so is every line after
+      hl->num_valid = hl->num_states;
+      break;
+    }
+    if (store_state(hl, i, state) != 0)
+      break;
+    hl->num_states = MAX(hl->num_states, i + 1);
+    hl->num_valid = i + 1;
+  }
+
+  int has_more = hl->num_valid * TWL_HIGHLIGHT_INTERVAL <= num_lines;
+  pthread_rwlock_unlock(&doc->append_lock);
+  return has_more;
+}
+
+// Lines in view
+// =============
+
+// Known state closest before the line, if it's close enough. Otherwise lexing starts a bit
+// before the line from state 0, which is usually right again by the time it gets there.
+static uint64_t start_line(struct twl_highlighter *hl, uint64_t line, uint32_t *state, uint32_t *is_exact) {
+  uint64_t i = MIN(line / TWL_HIGHLIGHT_INTERVAL, hl->num_valid - 1);
+  *is_exact = line - i * TWL_HIGHLIGHT_INTERVAL <= TWL_HIGHLIGHT_LOOKBACK;
+  if (!*is_exact) {
+    *state = 0;
+    return line - TWL_HIGHLIGHT_LOOKBACK;
+  }
+  *state = hl->states[i];
+  return i * TWL_HIGHLIGHT_INTERVAL;
+}
+
+static int reserve_lines(struct twl_highlight_lines *lines, uint32_t num_lines, uint32_t num_spans) {
+  if (num_lines + 1 > lines->line_capacity) {
+    uint32_t *line_spans = realloc(lines->line_spans, (num_lines + 1) * sizeof(uint32_t));
+    if (line_spans == NULL)
+      return -1;
+    lines->line_spans = line_spans;
+    lines->line_capacity = num_lines + 1;
+  }
+  if (num_spans > lines->span_capacity) {
+    uint32_t capacity = MAX(lines->span_capacity * 2, num_spans);
+    struct twl_token_span *spans = realloc(lines->spans, capacity * sizeof(struct twl_token_span));
+    if (spans == NULL)
+      return -1;
+    lines->spans = spans;
+    lines->span_capacity = capacity;
+  }
+  return 0;
+}
+
+static void lex_view(struct twl_highlighter *hl, struct twl_highlight_lines *lines, uint64_t first_line, uint32_t rows) {
+  struct twl_document *doc = hl->doc;
+  pthread_rwlock_rdlock(&doc->append_lock);
+
+  uint32_t state;
+  uint64_t line = start_line(hl, first_line, &state, &lines->is_exact);
+  lines->first_line = first_line;
+  lines->num_lines = 0;
+
+  const char *text;
+  size_t len;
+  for (; line < first_line && twl_document_line(doc, line, &text, &len) == 0; ++line) {
+    state = lex_state(hl, state, text, len);
+  }
+  uint32_t num_spans = 0;
+  for (uint32_t row = 0; row < rows && line == first_line + row && twl_document_line(doc, line, &text, &len) == 0; ++row, ++line) {
+    if (reserve_lines(lines, row + 1, num_spans + TWL_HIGHLIGHT_MAX_SPANS) != 0)
+      break;
+    uint32_t n = 0;
+    state = hl->language->lex(state, text, len, lines->spans + num_spans, &n, TWL_HIGHLIGHT_MAX_SPANS);
+    lines->line_spans[row] = num_spans;
+    num_spans += n;
+    lines->line_spans[row + 1] = num_spans;
+    lines->num_lines = row + 1;
+  }
+  pthread_rwlock_unlock(&doc->append_lock);
+}
+
+// Worker
+// ======
+
+static void notify(struct twl_highlighter *hl) {
+  uint64_t one = 1;
+  if (write(hl->event_fd, &one, sizeof(one)) < 0) {
+    // Only fails when the counter is saturated, which wakes the reader just the same
+  }
+}
+
+static void *worker_main(void *data) {
+  struct twl_highlighter *hl = data;
+  pthread_mutex_lock(&hl->lock);
+  while (!hl->stop) {
+    if (hl->has_changed) {
+      // The state at a line only depends on the lines before it
+      int is_past = (hl->num_valid - 1) * TWL_HIGHLIGHT_INTERVAL >= hl->converge_line;
+      hl->converge_line = is_past ? hl->changed_end : MAX(hl->converge_line, hl->changed_end);
+      hl->num_valid = MIN(hl->num_valid, hl->changed_line / TWL_HIGHLIGHT_INTERVAL + 1);
+      hl->has_changed = 0;
+      hl->has_more = 1;
+      // A change above the view may change the state it starts in
+      if (hl->changed_line < hl->view_line)
+        hl->lines[hl->front].is_exact = 0;
+    }
+
+    // Guessed states are replaced as soon as the background pass gets close enough
+    const struct twl_highlight_lines *front = &hl->lines[hl->front];
+    uint64_t first_line = hl->view_line;
+    uint32_t rows = hl->view_rows;
+    uint32_t state, is_exact;
+    start_line(hl, first_line, &state, &is_exact);
+    int is_stale = hl->view_dirty || hl->built_line != first_line || hl->built_rows != rows || (is_exact && !front->is_exact);
+
+    if (is_stale && rows) {
+      hl->view_dirty = 0;
+      struct twl_highlight_lines *back = &hl->lines[!hl->front];
+      pthread_mutex_unlock(&hl->lock);
+      lex_view(hl, back, first_line, rows);
+      pthread_mutex_lock(&hl->lock);
+      hl->front = !hl->front;
+      hl->built_line = first_line;
+      hl->built_rows = rows;
+      notify(hl);
+    } else if (hl->has_more) {
+      pthread_mutex_unlock(&hl->lock);
+      int has_more = lex_slice(hl);
+      pthread_mutex_lock(&hl->lock);
+      hl->has_more = has_more || hl->has_changed;
+    } else {
+      pthread_cond_wait(&hl->cond, &hl->lock);
+    }
+  }
+  pthread_mutex_unlock(&hl->lock);
+  return NULL;
+}
+
+int twl_highlighter_init(struct twl_highlighter *hl, struct twl_document *doc, const struct twl_language *language) {
+  zero_init(hl, struct twl_highlighter);
+  hl->doc = doc;
+  hl->language = language;
+  // The first line starts in state 0
+  if (store_state(hl, 0, 0) != 0)
+    return -1;
+  hl->num_states = hl->num_valid = 1;
+  hl->has_more = 1;
+  hl->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (hl->event_fd < 0) {
+    free(hl->states);
+    return -1;
+  }
+
+  pthread_mutex_init(&hl->lock, NULL);
+  pthread_cond_init(&hl->cond, NULL);
+  if (pthread_create(&hl->thread, NULL, worker_main, hl) != 0) {
+    pthread_cond_destroy(&hl->cond);
+    pthread_mutex_destroy(&hl->lock);
+    close(hl->event_fd);
+    free(hl->states);
+    return -1;
+  }
+  return 0;
+}
+
+void twl_highlighter_destroy(struct twl_highlighter *hl) {
+  pthread_mutex_lock(&hl->lock);
+  hl->stop = 1;
+  pthread_cond_signal(&hl->cond);
+  pthread_mutex_unlock(&hl->lock);
+  pthread_join(hl->thread, NULL);
+
+  for (int i = 0; i < 2; ++i) {
+    free(hl->lines[i].line_spans);
+    free(hl->lines[i].spans);
+  }
+  free(hl->states);
+  close(hl->event_fd);
+  pthread_cond_destroy(&hl->cond);
+  pthread_mutex_destroy(&hl->lock);
+  zero_init(hl, struct twl_highlighter);
+}
+
+static void invalidate(struct twl_highlighter *hl, uint64_t first_line, uint64_t end_line) {
+  hl->changed_line = hl->has_changed ? MIN(hl->changed_line, first_line) : first_line;
+  hl->changed_end = hl->has_changed ? MAX(hl->changed_end, end_line) : end_line;
+  hl->has_changed = 1;
+  if (first_line < hl->view_line + hl->view_rows && end_line > hl->view_line)
+    hl->view_dirty = 1;
+}
+
+void twl_highlighter_view(struct twl_highlighter *hl, uint64_t first_line, uint32_t rows) {
+  // Only this thread appends, the size can be read without the append lock
+  struct twl_document *doc = hl->doc;
+  uint64_t num_lines = twl_document_num_lines(doc);
+  uint64_t size = doc->size;
+
+  pthread_mutex_lock(&hl->lock);
+  int wake = hl->view_line != first_line || hl->view_rows != rows;
+  hl->view_line = first_line;
+  hl->view_rows = rows;
+  if (num_lines != hl->lines_seen || size != hl->size_seen) {
+    // Lines are only ever added, but an append may go on with the last one
+    if (twl_document_state(doc) == TWL_DOCUMENT_LOADED && hl->lines_seen && size != hl->size_seen)
+      invalidate(hl, hl->lines_seen - 1, hl->lines_seen);
+    if (num_lines > hl->lines_seen && hl->lines_seen < first_line + rows && num_lines > first_line)
+      hl->view_dirty = 1;
+    hl->has_more = 1;
+    hl->lines_seen = num_lines;
+    hl->size_seen = size;
+    wake = 1;
+  }
+  if (wake)
+    pthread_cond_signal(&hl->cond);
+  pthread_mutex_unlock(&hl->lock);
+}
+
+void twl_highlighter_invalidate(struct twl_highlighter *hl, uint64_t first_line, uint64_t num_lines) {
+  pthread_mutex_lock(&hl->lock);
+  invalidate(hl, first_line, first_line + num_lines);
+  pthread_cond_signal(&hl->cond);
+  pthread_mutex_unlock(&hl->lock);
+}
+
+const struct twl_highlight_lines *twl_highlighter_lock(struct twl_highlighter *hl) {
+  pthread_mutex_lock(&hl->lock);
+  return &hl->lines[hl->front];
+}
+
+void twl_highlighter_unlock(struct twl_highlighter *hl) { pthread_mutex_unlock(&hl->lock); }
+
+const struct twl_token_span *twl_highlight_line_spans(const struct twl_highlight_lines *lines, uint64_t line, uint32_t *num_spans) {
+  if (line < lines->first_line || line - lines->first_line >= lines->num_lines)
+    return NULL;
+  uint32_t row = line - lines->first_line;
+  *num_spans = lines->line_spans[row + 1] - lines->line_spans[row];
+  return lines->spans + lines->line_spans[row];
+}
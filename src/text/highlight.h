@@ -0,0 +1,118 @@
+#ifndef __TWL_HIGHLIGHT_H__
+#define __TWL_HIGHLIGHT_H__
+
+#include "document.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lexer states are kept at the start of every this many lines
+#define TWL_HIGHLIGHT_INTERVAL 16
+// Lines lexed by the background pass between looks at the view
+#define TWL_HIGHLIGHT_SLICE 4096
+// Without a known state nearby, lines in view are lexed from this far back, from the start state
+#define TWL_HIGHLIGHT_LOOKBACK 1024
+#define TWL_HIGHLIGHT_MAX_SPANS 256 // per line, the rest of it is plain text
+
+enum twl_token {
+  TWL_TOKEN_TEXT,
+  TWL_TOKEN_KEYWORD,
+  TWL_TOKEN_TYPE,
+  TWL_TOKEN_STRING,
+  TWL_TOKEN_NUMBER,
+  TWL_TOKEN_COMMENT,
+  TWL_TOKEN_PREPROC,
+  TWL_TOKEN_TIME,
+  TWL_TOKEN_ERROR,
+  TWL_TOKEN_WARNING,
+  TWL_NUM_TOKENS,
+};
+
+// Bytes of a line, sorted and not overlapping. Text outside any span is TWL_TOKEN_TEXT.
+struct twl_token_span {
+  uint32_t start;
+  uint32_t len;
+  enum twl_token token;
+};
+
+// Lexes a line without its '\n' from the state at its start, 0 for the first line, and returns
+// the state at the next one. At most max_spans spans are written, spans may be NULL.
+typedef uint32_t (*twl_lex_fn)(uint32_t state, const char *text, size_t len, struct twl_token_span *spans, uint32_t *num_spans,
+                               uint32_t max_spans);
+
+struct twl_language {
+  const char *name;
+  twl_lex_fn lex;
+};
+
+extern const struct twl_language twl_language_c;
+extern const struct twl_language twl_language_log;
+// By the file's extension, NULL for plain text
+const struct twl_language *twl_language_for_path(const char *path);
+
+// Spans of consecutive lines
+struct twl_highlight_lines {
+  uint64_t first_line;
+  uint32_t num_lines;
+  uint32_t *line_spans; // first span of each line, num_lines + 1 entries
+  uint32_t line_capacity;
+  struct twl_token_span *spans;
+  uint32_t span_capacity;
+  // Lexed from a known state, a guess otherwise: lexing from the top only just started
+  uint32_t is_exact;
+};
+
+// Syntax highlighting on a worker thread. Lines in view are lexed first, from the closest known
+// state, so opening a file isn't gated on lexing all of it; meanwhile a background pass keeps the
+// states at line boundaries. After a change only the lines from it on are lexed again, until the
+// state at a boundary is the same as before.
+// The document may grow while it runs, the worker reads lines under doc->append_lock.
+struct twl_highlighter {
+  struct twl_document *doc;
+  const struct twl_language *language;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Guarded by lock
+  uint64_t view_line; // requested by twl_highlighter_view()
+  uint32_t view_rows;
+  uint32_t view_dirty; // lines in view changed
+  // Lines [changed_line, changed_end) changed since the worker last looked
+  uint64_t changed_line;
+  uint64_t changed_end;
+  uint32_t has_changed;
+  uint32_t has_more; // the background pass hasn't caught up with the lines so far
+  uint32_t stop;
+  struct twl_highlight_lines lines[2]; // the front one is read by the view
+  uint32_t front;
+  uint64_t built_line; // what the front lines were asked for
+  uint32_t built_rows;
+  // Only touched by the worker thread: states[i] is the state at line i * TWL_HIGHLIGHT_INTERVAL.
+  // The first num_valid are right, the rest are from before a change.
+  uint32_t *states;
+  uint64_t num_states;
+  uint64_t num_valid;
+  uint64_t capacity;
+  uint64_t converge_line; // states past it can match the old ones
+  // Seen by the UI thread, to notice appends
+  uint64_t size_seen;
+  uint64_t lines_seen;
+  // Readable whenever the lines in view are lexed again, as the document's event_fd
+  int event_fd;
+};
+
+int twl_highlighter_init(struct twl_highlighter *hl, struct twl_document *doc, const struct twl_language *language);
+void twl_highlighter_destroy(struct twl_highlighter *hl);
+// The lines in view, call it every frame: it's cheap when nothing changed. Appends to the
+// document are noticed here.
+void twl_highlighter_view(struct twl_highlighter *hl, uint64_t first_line, uint32_t rows);
+// Lines [first_line, first_line + num_lines) were changed in place
+void twl_highlighter_invalidate(struct twl_highlighter *hl, uint64_t first_line, uint64_t num_lines);
+// Hold the lock while reading the spans of the front lines
+const struct twl_highlight_lines *twl_highlighter_lock(struct twl_highlighter *hl);
+void twl_highlighter_unlock(struct twl_highlighter *hl);
+// NULL if the line isn't in `lines`
+const struct twl_token_span *twl_highlight_line_spans(const struct twl_highlight_lines *lines, uint64_t line, uint32_t *num_spans);
+
+#endif
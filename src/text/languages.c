@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include "highlight.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+// Lexing helpers
+// ==============
+
+struct word {
+  const char *text;
+  size_t len;
+};
+
+static void push_span(struct twl_token_span *spans, uint32_t *num_spans, uint32_t max_spans, size_t start, size_t end,
+                      enum twl_token token) {
+  if (spans == NULL || *num_spans >= max_spans || end <= start)
+    return;
+  spans[(*num_spans)++] = (struct twl_token_span){.start = start, .len = end - start, .token = token};
+}
+
+static int is_ident(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'; }
+static int is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static int is_blank_before(const char *text, size_t i) {
+  while (i && (text[i - 1] == ' ' || text[i - 1] == '\t'))
+    --i;
+  return i == 0;
+}
+
+static int compare_word(const void *key, const void *entry) {
+  const struct word *word = key;
+  const char *name = *(const char *const *)entry;
+  int cmp = strncmp(word->text, name, word->len);
+  return cmp ? cmp : -(unsigned char)name[word->len];
+}
+
+static int is_word_in(const char *const *table, size_t count, const char *text, size_t len) {
+  struct word word = {text, len};
+  return bsearch(&word, table, count, sizeof(*table), compare_word) != NULL;
+}
+
+// End of a quoted string starting at i, past the closing quote or at the end of the line
+static size_t skip_quoted(const char *text, size_t len, size_t i) {
+  char quote = text[i++];
+  while (i < len && text[i] != quote)
+    i += text[i] == '\\' ? 2 : 1;
+  return MIN(i + 1, len);
+}
+
+static size_t skip_number(const char *text, size_t len, size_t i) {
+  // Hex digits, exponents and suffixes alike: whatever follows a digit up to the next non word byte
+  while (i < len && (is_ident(text[i]) || text[i] == '.' || ((text[i] == '+' || text[i] == '-') && (text[i - 1] == 'e' || text[i - 1] == 'E'))))
+    ++i;
+  return i;
+}
+
+// C
+// =
+
+enum c_state {
+  C_STATE_CODE,
+  C_STATE_COMMENT, // in a /* comment */
+  C_STATE_PREPROC, // a directive continued with a backslash
+};
+
+// Sorted for bsearch()
+static const char *const c_keywords[] = {
+    "_Alignas", "_Alignof", "_Atomic", "_Generic", "_Noreturn", "_Static_assert", "_Thread_local", "break", "case", "const", "continue", "default", "do",
+    "else", "enum", "extern", "for", "goto", "if", "inline", "register", "restrict", "return", "sizeof", "static", "struct", "switch", "typedef", "union",
+    "volatile", "while",
+};
+static const char *const c_types[] = {
+    "_Bool", "bool", "char", "double", "float", "int", "int16_t", "int32_t", "int64_t", "int8_t", "long", "off_t", "ptrdiff_t", "short", "signed", "size_t",
+    "ssize_t", "uint16_t", "uint32_t", "uint64_t", "uint8_t", "uintptr_t", "unsigned", "void",
+};
+
+static uint32_t lex_c(uint32_t state, const char *text, size_t len, struct twl_token_span *spans, uint32_t *num_spans, uint32_t max_spans) {
+  size_t i = 0;
+  if (state == C_STATE_PREPROC) {
+    push_span(spans, num_spans, max_spans, 0, len, TWL_TOKEN_PREPROC);
+    return len && text[len - 1] == '\\' ? C_STATE_PREPROC : C_STATE_CODE;
+  }
+  if (state == C_STATE_COMMENT) {
+    const char *end = memmem(text, len, "*/", 2);
+    i = end ? (size_t)(end - text) + 2 : len;
+    push_span(spans, num_spans, max_spans, 0, i, TWL_TOKEN_COMMENT);
+    if (end == NULL)
+      return C_STATE_COMMENT;
+  }
+
+  while (i < len) {
+    size_t start = i;
+    char c = text[i];
+    if (c == ' ' || c == '\t') {
+      ++i;
+    } else if (c == '#' && is_blank_before(text, start)) {
+      push_span(spans, num_spans, max_spans, start, len, TWL_TOKEN_PREPROC);
+      return text[len - 1] == '\\' ? C_STATE_PREPROC : C_STATE_CODE;
+    } else if (c == '/' && i + 1 < len && text[i + 1] == '/') {
+      push_span(spans, num_spans, max_spans, start, len, TWL_TOKEN_COMMENT);
+      return C_STATE_CODE;
+    } else if (c == '/' && i + 1 < len && text[i + 1] == '*') {
+      const char *end = memmem(text + i + 2, len - i - 2, "*/", 2);
+      i = end ? (size_t)(end - text) + 2 : len;
+      push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_COMMENT);
+      if (end == NULL)
+        return C_STATE_COMMENT;
+    } else if (c == '"' || c == '\'') {
+      i = skip_quoted(text, len, i);
+      push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_STRING);
+    } else if (is_digit(c) || (c == '.' && i + 1 < len && is_digit(text[i + 1]))) {
+      i = skip_number(text, len, i + 1);
+      push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_NUMBER);
+    } else if (is_ident(c)) {
+      while (i < len && is_ident(text[i]))
+        ++i;
+      if (is_word_in(c_keywords, sizeof(c_keywords) / sizeof(*c_keywords), text + start, i - start))
+        push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_KEYWORD);
+      else if (is_word_in(c_types, sizeof(c_types) / sizeof(*c_types), text + start, i - start))
+        push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_TYPE);
+    } else {
+      ++i;
+    }
+  }
+  return C_STATE_CODE;
+}
+
+// Logs
+// ====
+
+static const char *const log_errors[] = {"CRITICAL", "ERROR", "FATAL", "PANIC", "critical", "error", "fatal", "panic"};
+static const char *const log_warnings[] = {"WARN", "WARNING", "warn", "warning"};
+static const char *const log_quiet[] = {"DEBUG", "TRACE", "debug", "trace"};
+
+// A date or time of day at the start of the line: digits and -/:.,T up to the first other byte
+static size_t skip_time(const char *text, size_t len) {
+  size_t i = 0, num_separators = 0;
+  if (len && text[0] == '[')
+    ++i;
+  while (i < len) {
+    char c = text[i];
+    int is_space = c == ' ' && num_separators && i + 1 < len && is_digit(text[i + 1]);
+    if (c == '-' || c == '/' || c == ':' || c == '.' || c == ',' || c == 'T' || c == 'Z' || is_space)
+      ++num_separators;
+    else if (!is_digit(c))
+      break;
+    ++i;
+  }
+  if (i < len && text[i] == ']')
+    ++i;
+  return num_separators >= 2 ? i : 0;
+}
+
+// Every line is lexed on its own
+static uint32_t lex_log(uint32_t state, const char *text, size_t len, struct twl_token_span *spans, uint32_t *num_spans, uint32_t max_spans) {
+  size_t i = skip_time(text, len);
+  push_span(spans, num_spans, max_spans, 0, i, TWL_TOKEN_TIME);
+
+  while (i < len) {
+    size_t start = i;
+    char c = text[i];
+    if (c == '"') {
+      i = skip_quoted(text, len, i);
+      push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_STRING);
+    } else if (is_digit(c) && (start == 0 || !is_ident(text[start - 1]))) {
+      i = skip_number(text, len, i + 1);
+      push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_NUMBER);
+    } else if (is_ident(c)) {
+      while (i < len && is_ident(text[i]))
+        ++i;
+      if (is_word_in(log_errors, sizeof(log_errors) / sizeof(*log_errors), text + start, i - start))
+        push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_ERROR);
+      else if (is_word_in(log_warnings, sizeof(log_warnings) / sizeof(*log_warnings), text + start, i - start))
+        push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_WARNING);
+      else if (is_word_in(log_quiet, sizeof(log_quiet) / sizeof(*log_quiet), text + start, i - start))
+        push_span(spans, num_spans, max_spans, start, i, TWL_TOKEN_COMMENT);
+    } else {
+      ++i;
+    }
+  }
+  return state;
+}
+
+// Languages
+// =========
+
+const struct twl_language twl_language_c = {.name = "c", .lex = lex_c};
+const struct twl_language twl_language_log = {.name = "log", .lex = lex_log};
+
+const struct twl_language *twl_language_for_path(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot == NULL || strchr(dot, '/') != NULL)
+    return NULL;
+  if (strcmp(dot, ".c") == 0 || strcmp(dot, ".h") == 0)
+    return &twl_language_c;
+  if (strcmp(dot, ".log") == 0)
+    return &twl_language_log;
+  return NULL;
+}
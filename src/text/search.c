@@ -0,0 +1,246 @@
+#include "search.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+static int push_match(struct twl_search_chunk *chunk, uint64_t offset, uint32_t len) {
+  if (chunk->num_matches == chunk->capacity) {
+    uint32_t capacity = MAX(chunk->capacity * 2, 64);
+    struct twl_match *matches = realloc(chunk->matches, capacity * sizeof(struct twl_match));
+    if (matches == NULL)
+      return -1;
+    chunk->matches = matches;
+    chunk->capacity = capacity;
+  }
+  chunk->matches[chunk->num_matches++] = (struct twl_match){.offset = offset, .len = len};
+  return 0;
+}
+
+// Matches starting in the chunk, they may end past it
+static int search_plain(struct twl_search *search, uint32_t i) {
+  struct twl_search_chunk *chunk = &search->chunks[i];
+  const uint8_t *text = search->text;
+  const uint8_t *needle = (const uint8_t *)search->pattern;
+  size_t n = search->pattern_len;
+  if (search->size < n)
+    return 0;
+  uint64_t pos = (uint64_t)i * TWL_SEARCH_CHUNK_SIZE;
+  uint64_t end = MIN(pos + TWL_SEARCH_CHUNK_SIZE, search->size - n + 1);
+
+#ifdef __SSE2__
+  // Candidates have the needle's first and last bytes in place, only those are compared in full
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[n - 1]);
+  for (; pos + 16 <= end; pos += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(text + pos));
+    __m128i b = _mm_loadu_si128((const __m128i *)(text + pos + n - 1));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      uint64_t offset = pos + __builtin_ctz(mask);
+      if ((n <= 2 || memcmp(text + offset + 1, needle + 1, n - 2) == 0) && push_match(chunk, offset, n) != 0)
+        return -1;
+    }
+  }
+#endif
+  for (; pos < end; ++pos) {
+    if (text[pos] == needle[0] && text[pos + n - 1] == needle[n - 1] && memcmp(text + pos, needle, n) == 0 &&
+        push_match(chunk, pos, n) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Matches in the lines starting in the chunk, empty ones left out
+static int search_regex(struct twl_search *search, uint32_t i, regex_t *regex) {
+  struct twl_search_chunk *chunk = &search->chunks[i];
+  const uint8_t *text = search->text;
+  uint64_t start = (uint64_t)i * TWL_SEARCH_CHUNK_SIZE;
+  uint64_t end = MIN(start + TWL_SEARCH_CHUNK_SIZE, search->size);
+
+  if (start > 0 && text[start - 1] != '\n') {
+    const uint8_t *newline = memchr(text + start, '\n', end - start);
+    if (newline == NULL)
+      return 0;
+    start = newline - text + 1;
+  }
+  if (end < search->size && text[end - 1] != '\n') {
+    const uint8_t *newline = memchr(text + end, '\n', search->size - end);
+    end = newline ? newline - text + 1 : search->size;
+  }
+
+  // Offsets relative to the lines' start, the text before a match gives ^ its context.
+  // regoff_t is an int: a line over 2 GiB isn't searched.
+  if (end - start > INT_MAX)
+    return 0;
+  const char *lines = (const char *)text + start;
+  regoff_t pos = 0, len = end - start;
+  while (pos < len && !atomic_load_explicit(&search->cancel, memory_order_relaxed)) {
+    regmatch_t match = {.rm_so = pos, .rm_eo = len};
+    if (regexec(regex, lines, 1, &match, REG_STARTEND) != 0)
+      break;
+    if (match.rm_eo == match.rm_so) {
+      pos = match.rm_so + 1;
+      continue;
+    }
+    if (push_match(chunk, start + match.rm_so, match.rm_eo - match.rm_so) != 0)
+      return -1;
+    pos = match.rm_eo;
+  }
+  return 0;
+}
+
+static void notify(struct twl_search *search) {
+  uint64_t one = 1;
+  if (write(search->event_fd, &one, sizeof(one)) < 0) {
+    // Only fails when the counter is saturated, which wakes the reader just the same
+  }
+}
+
+static void *worker_main(void *data) {
+  struct twl_search_worker *worker = data;
+  struct twl_search *search = worker->search;
+
+  while (!atomic_load(&search->cancel)) {
+    uint32_t i = atomic_fetch_add(&search->next_chunk, 1);
+    if (i >= search->num_chunks)
+      break;
+
+    struct twl_search_chunk *chunk = &search->chunks[i];
+    int res = search->flags & TWL_SEARCH_REGEX ? search_regex(search, i, &worker->regex) : search_plain(search, i);
+    if (res != 0)
+      search->error = ENOMEM; // what was found is still shown
+
+    atomic_store_explicit(&chunk->is_done, 1, memory_order_release);
+    atomic_fetch_add(&search->num_matches, chunk->num_matches);
+    atomic_fetch_add(&search->num_done, 1);
+    notify(search);
+  }
+  return NULL;
+}
+
+int twl_search_start(struct twl_search *search, struct twl_document *doc, const char *pattern, uint32_t flags) {
+  zero_init(search, struct twl_search);
+  enum twl_document_state state = twl_document_state(doc);
+  if ((state != TWL_DOCUMENT_LOADING && state != TWL_DOCUMENT_LOADED) || pattern[0] == '\0')
+    return -1;
+
+  search->doc = doc;
+  search->text = doc->file.addr;
+  search->size = doc->file.size;
+  search->pattern_len = strlen(pattern);
+  search->flags = flags;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  search->num_chunks = (search->size + TWL_SEARCH_CHUNK_SIZE - 1) / TWL_SEARCH_CHUNK_SIZE;
+  search->num_workers = MAX(MIN(cpus > 0 ? (uint32_t)cpus : 1, MIN(search->num_chunks, TWL_SEARCH_MAX_WORKERS)), 1);
+
+  search->pattern = strdup(pattern);
+  search->chunks = calloc(MAX(search->num_chunks, 1), sizeof(struct twl_search_chunk));
+  search->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (search->pattern == NULL || search->chunks == NULL || search->event_fd < 0) {
+    free(search->pattern);
+    free(search->chunks);
+    if (search->event_fd >= 0)
+      close(search->event_fd);
+    return -1;
+  }
+
+  uint32_t num_workers = search->num_workers;
+  search->num_workers = 0;
+  for (uint32_t i = 0; i < num_workers && (flags & TWL_SEARCH_REGEX); ++i) {
+    if (regcomp(&search->workers[i].regex, pattern, REG_EXTENDED | REG_NEWLINE) != 0) {
+      twl_search_destroy(search);
+      return -1;
+    }
+    search->num_regex++;
+  }
+  for (uint32_t i = 0; i < num_workers; ++i) {
+    search->workers[i].search = search;
+    if (pthread_create(&search->workers[i].thread, NULL, worker_main, &search->workers[i]) != 0)
+      break;
+    search->num_workers++;
+  }
+  if (search->num_workers == 0) {
+    twl_search_destroy(search);
+    return -1;
+  }
+  return 0;
+}
+
+void twl_search_destroy(struct twl_search *search) {
+  atomic_store(&search->cancel, 1);
+  for (uint32_t i = 0; i < search->num_workers; ++i) {
+    pthread_join(search->workers[i].thread, NULL);
+  }
+  for (uint32_t i = 0; i < search->num_regex; ++i) {
+    regfree(&search->workers[i].regex);
+  }
+  for (uint32_t i = 0; i < search->num_chunks; ++i) {
+    free(search->chunks[i].matches);
+  }
+  free(search->chunks);
+  free(search->pattern);
+  close(search->event_fd);
+  zero_init(search, struct twl_search);
+}
+
+int twl_search_is_done(const struct twl_search *search) { return atomic_load(&search->num_done) == search->num_chunks; }
+
+// First match of a done chunk ending after `offset`, matches never end before an earlier one does
+static uint32_t first_ending_after(const struct twl_search_chunk *chunk, uint64_t offset) {
+  uint32_t lo = 0, hi = chunk->num_matches;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (chunk->matches[mid].offset + chunk->matches[mid].len > offset)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+uint32_t twl_search_find(struct twl_search *search, uint64_t start, uint64_t end, struct twl_match *matches, uint32_t max) {
+  if (search->num_chunks == 0 || end <= start)
+    return 0;
+
+  // A match may start in the chunk before, in a line or a pattern reaching into the next one
+  uint32_t first = start / TWL_SEARCH_CHUNK_SIZE;
+  first = first ? MIN(first - 1, search->num_chunks - 1) : 0;
+  uint32_t last = MIN((end - 1) / TWL_SEARCH_CHUNK_SIZE, search->num_chunks - 1);
+
+  uint32_t n = 0;
+  for (uint32_t i = first; i <= last && n < max; ++i) {
+    const struct twl_search_chunk *chunk = &search->chunks[i];
+    if (!atomic_load_explicit(&chunk->is_done, memory_order_acquire))
+      continue;
+    for (uint32_t k = first_ending_after(chunk, start); k < chunk->num_matches && chunk->matches[k].offset < end && n < max; ++k) {
+      matches[n++] = chunk->matches[k];
+    }
+  }
+  return n;
+}
+
+int twl_search_next(struct twl_search *search, uint64_t offset, struct twl_match *match) {
+  uint32_t first = offset / TWL_SEARCH_CHUNK_SIZE;
+  for (uint32_t i = first ? first - 1 : 0; i < search->num_chunks; ++i) {
+    const struct twl_search_chunk *chunk = &search->chunks[i];
+    if (!atomic_load_explicit(&chunk->is_done, memory_order_acquire))
+      return 1;
+    for (uint32_t k = first_ending_after(chunk, offset); k < chunk->num_matches; ++k) {
+      if (chunk->matches[k].offset >= offset) {
+        *match = chunk->matches[k];
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
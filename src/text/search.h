@@ -0,0 +1,74 @@
+#ifndef __TWL_SEARCH_H__
+#define __TWL_SEARCH_H__
+
+#include "document.h"
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Chunks are searched in file order, each by one worker
+#define TWL_SEARCH_CHUNK_SIZE TWL_DOCUMENT_CHUNK_SIZE
+#define TWL_SEARCH_MAX_WORKERS 8
+
+enum twl_search_flags {
+  TWL_SEARCH_REGEX = 1 << 0, // POSIX extended, matched within lines
+};
+
+struct twl_match {
+  uint64_t offset;
+  uint32_t len;
+};
+
+struct twl_search_chunk {
+  // Sorted by offset
+  struct twl_match *matches;
+  uint32_t num_matches;
+  uint32_t capacity;
+  _Atomic uint32_t is_done;
+};
+
+struct twl_search_worker {
+  struct twl_search *search;
+  pthread_t thread;
+  regex_t regex; // one each, glibc serializes matching on a regex
+};
+
+// Every match of a pattern in a document, searched on worker threads. Results are streamed:
+// a chunk's matches can be read as soon as it's done, and chunks are handed out in file order,
+// so the first hits show up after a few ms whatever the file's size. Plain patterns are found
+// with SIMD, overlapping matches included. Only the text mapped when loading is searched.
+struct twl_search {
+  struct twl_document *doc;
+  const uint8_t *text;
+  uint64_t size;
+  char *pattern;
+  size_t pattern_len;
+  uint32_t flags;
+  struct twl_search_chunk *chunks;
+  uint32_t num_chunks;
+  _Atomic uint32_t next_chunk;
+  _Atomic uint32_t num_done;
+  _Atomic uint64_t num_matches;
+  struct twl_search_worker workers[TWL_SEARCH_MAX_WORKERS];
+  uint32_t num_workers;
+  uint32_t num_regex; // compiled, for TWL_SEARCH_REGEX
+  _Atomic uint32_t cancel;
+  _Atomic int error; // ENOMEM if matches were dropped
+  // Readable whenever chunks are done, as the document's event_fd
+  int event_fd;
+};
+
+// The document has to be mapped already (loading or loaded). -1 for an empty or invalid pattern.
+int twl_search_start(struct twl_search *search, struct twl_document *doc, const char *pattern, uint32_t flags);
+// Stops searching if it's still going
+void twl_search_destroy(struct twl_search *search);
+int twl_search_is_done(const struct twl_search *search);
+// Matches overlapping [start, end) found so far, at most `max`. Cheap enough to run every frame
+// for what's in view.
+uint32_t twl_search_find(struct twl_search *search, uint64_t start, uint64_t end, struct twl_match *matches, uint32_t max);
+// The first match at or after `offset`: 0 if found, 1 if the search hasn't got that far yet,
+// -1 if there is none.
+int twl_search_next(struct twl_search *search, uint64_t offset, struct twl_match *match);
+
+#endif
@@ -0,0 +1,338 @@
+#include "view.h"
+#include <math.h>
+#include <string.h>
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+void twl_text_view_init(struct twl_text_view *view, struct twl_document *doc, struct twl_glyph_atlas *atlas, float size) {
+  memset(view, 0, sizeof(struct twl_text_view));
+  view->doc = doc;
+  view->atlas = atlas;
+  view->size = size;
+  view->margin = roundf(size / 2);
+  view->background = 0xFFFFFFFF;
+  view->highlight = 0xFFFFE27A;
+}
+
+float twl_text_view_line_height(const struct twl_text_view *view) {
+  return MAX(roundf(view->atlas->line_height * view->size / TWL_SDF_SIZE), 1);
+}
+
+uint32_t twl_text_view_rows(const struct twl_text_view *view, uint32_t height) {
+  float rows = (height - view->margin) / twl_text_view_line_height(view);
+  return rows > 0 ? (uint32_t)rows + 1 : 0;
+}
+
+void twl_text_view_position(struct twl_text_view *view, uint64_t *row, uint64_t *num_rows) {
+  if (view->wrap == NULL) {
+    *row = view->top_line;
+    *num_rows = twl_document_num_lines(view->doc);
+    return;
+  }
+  *row = twl_wrap_row(view->wrap, view->top_line) + view->top_row;
+  *num_rows = twl_wrap_num_rows(view->wrap);
+}
+
+void twl_text_view_scroll_to(struct twl_text_view *view, uint64_t row) {
+  uint64_t row_in_view, num_rows;
+  twl_text_view_position(view, &row_in_view, &num_rows);
+  if (num_rows && row >= num_rows)
+    row = num_rows - 1;
+  if (view->wrap) {
+    view->top_line = twl_wrap_line_at(view->wrap, row, &view->top_row);
+  } else {
+    view->top_line = row;
+  }
+}
+
+void twl_text_view_scroll(struct twl_text_view *view, int64_t rows) {
+  uint64_t row, num_rows;
+  twl_text_view_position(view, &row, &num_rows);
+  int64_t top = (int64_t)row + rows;
+  twl_text_view_scroll_to(view, top > 0 ? top : 0);
+}
+
+static float tab_width(struct twl_text_view *view) {
+  const struct twl_glyph *space = twl_glyph_atlas_get(view->atlas, ' ');
+  return space ? space->advance * view->size / TWL_SDF_SIZE * TWL_TAB_WIDTH : view->size * 4;
+}
+
+// Pen position after the first `len` bytes of a line, laid out as draw_line() does
+static float line_x(struct twl_text_view *view, const char *text, size_t len, float tab) {
+  float x = view->margin;
+  const char *end = text + len;
+  while (text < end) {
+    const char *next = memchr(text, '\t', end - text);
+    size_t n = next ? next - text : end - text;
+    x += twl_glyph_atlas_measure_utf8(view->atlas, text, n, view->size);
+    if (next) {
+      x = view->margin + ((int)((x - view->margin) / tab) + 1) * tab;
+      n++;
+    }
+    text += n;
+  }
+  return x;
+}
+
+// Tabs are drawn as jumps to the next stop
+static float draw_run(struct twl_text_view *view, const struct twl_raster *raster, const char *text, size_t len, float x, float baseline,
+                      const struct twl_text_gamma *gamma, enum twl_subpixel order) {
+  float tab = tab_width(view);
+  const char *end = text + len;
+  while (text < end && x < raster->width) {
+    const char *next = memchr(text, '\t', end - text);
+    size_t n = next ? next - text : end - text;
+    x = twl_glyph_atlas_draw_utf8(view->atlas, raster, text, n, x, baseline, view->size, gamma, order);
+    if (next) {
+      x = view->margin + ((int)((x - view->margin) / tab) + 1) * tab;
+      n++;
+    }
+    text += n;
+  }
+  return x;
+}
+
+// Bytes [start, end) of a line, text between the spans is plain. A CR before the line's end is left out.
+static void draw_line(struct twl_text_view *view, const struct twl_raster *raster, const char *text, size_t start, size_t end, float baseline,
+                      const struct twl_text_gamma *gamma, enum twl_subpixel order, const struct twl_token_span *spans, uint32_t num_spans) {
+  if (end > start && text[end - 1] == '\r')
+    end--;
+
+  float x = view->margin;
+  size_t pos = start;
+  for (uint32_t i = 0; i < num_spans && spans[i].start < end && x < raster->width; ++i) {
+    size_t from = MAX(spans[i].start, pos);
+    size_t to = MIN(spans[i].start + spans[i].len, end);
+    if (to <= from)
+      continue;
+    x = draw_run(view, raster, text + pos, from - pos, x, baseline, gamma, order);
+    x = draw_run(view, raster, text + from, to - from, x, baseline, &view->token_gamma[spans[i].token], order);
+    pos = to;
+  }
+  draw_run(view, raster, text + pos, end - pos, x, baseline, gamma, order);
+}
+
+// Behind a row's text, from the matches in view
+static void draw_highlights(struct twl_text_view *view, const struct twl_raster *raster, const char *text, const struct twl_text_row *row,
+                            float y, uint32_t *next) {
+  uint64_t offset = twl_document_offset(view->doc, text);
+  uint64_t start = offset + row->start, end = offset + row->end;
+  float tab = tab_width(view);
+  float line_height = twl_text_view_line_height(view);
+  for (; *next < view->num_highlights; ++*next) {
+    const struct twl_match *match = &view->highlights[*next];
+    if (match->offset >= end)
+      break;
+    if (match->offset + match->len <= start)
+      continue;
+    uint64_t from = MAX(match->offset, start) - start;
+    uint64_t to = MIN(match->offset + match->len, end) - start;
+    float x = line_x(view, text + row->start, from, tab);
+    if (x >= raster->width)
+      break;
+    twl_raster_fill_rect(raster, x, y, ceilf(line_x(view, text + row->start, to, tab) - x), line_height, view->highlight);
+    // A match going on in the next row is drawn again there
+    if (match->offset + match->len > end)
+      break;
+  }
+}
+
+// Top line and row that show the last `full` rows of the document
+static void follow_end(struct twl_text_view *view, uint64_t full, float width) {
+  view->top_line = view->top_row = 0;
+  const char *text;
+  size_t len;
+  for (uint64_t line = twl_document_num_lines(view->doc); line-- > 0 && twl_document_line(view->doc, line, &text, &len) == 0;) {
+    uint32_t rows = 1;
+    if (view->wrap) {
+      rows = twl_wrap_line(view->wrap, view->atlas, text, len, width, NULL, 0, 0);
+      twl_wrap_set(view->wrap, line, rows);
+    }
+    if (rows >= full) {
+      view->top_line = line;
+      view->top_row = rows - full;
+      return;
+    }
+    full -= rows;
+  }
+}
+
+// Rows from the top of the view down, lines broken at `width` if the view wraps
+static uint32_t layout(struct twl_text_view *view, uint32_t max_rows, float width) {
+  size_t starts[TWL_TEXT_VIEW_MAX_ROWS + 1];
+  uint32_t n = 0;
+  const char *text;
+  size_t len;
+  for (uint64_t line = view->top_line; n < max_rows && twl_document_line(view->doc, line, &text, &len) == 0; ++line) {
+    if (view->wrap == NULL) {
+      view->rows[n++] = (struct twl_text_row){.line = line, .start = 0, .end = len};
+      continue;
+    }
+    // Each row's end is the next one's start
+    uint32_t first = line == view->top_line ? view->top_row : 0;
+    uint32_t num_rows = twl_wrap_line(view->wrap, view->atlas, text, len, width, starts, first, max_rows - n + 1);
+    if (first >= num_rows) {
+      // Fewer rows since a resize
+      first = view->top_row = num_rows - 1;
+      num_rows = twl_wrap_line(view->wrap, view->atlas, text, len, width, starts, first, max_rows - n + 1);
+    }
+    twl_wrap_set(view->wrap, line, num_rows);
+    for (uint32_t row = first; row < num_rows && n < max_rows; ++row) {
+      size_t end = row + 1 < num_rows ? starts[row + 1 - first] : len;
+      view->rows[n++] = (struct twl_text_row){.line = line, .start = starts[row - first], .end = end};
+    }
+  }
+  return n;
+}
+
+static int same_layout(const struct twl_text_view_frame *a, const struct twl_text_view_frame *b) {
+  return a->size == b->size && a->order == b->order && a->width == b->width && a->height == b->height;
+}
+
+// Leading rows of `to` that `from` has drawn already, in the same place or `shift` rows further down
+static uint32_t kept_rows(struct twl_text_view *view, const struct twl_text_view_frame *from, const struct twl_text_view_frame *to,
+                          uint32_t *shift) {
+  *shift = 0;
+  if (!same_layout(from, to) || from->highlights != to->highlights || to->rows == 0)
+    return 0;
+
+  uint32_t s = 0;
+  while (s < from->rows && from->row_hashes[s] != to->row_hashes[0])
+    s++;
+  uint32_t kept = 0;
+  while (kept < to->rows && s + kept < from->rows && from->row_hashes[s + kept] == to->row_hashes[kept])
+    kept++;
+  // A row cut off at the bottom can't be scrolled up
+  uint32_t full = (from->height - view->margin) / twl_text_view_line_height(view);
+  if (s && from->rows > full)
+    kept = MIN(kept, full > s ? full - s : 0);
+  *shift = kept ? s : 0;
+  return kept;
+}
+
+void twl_text_view_draw(struct twl_text_view *view, const struct twl_raster *raster, const struct twl_text_gamma *gamma,
+                        enum twl_subpixel order, uint64_t buffer, struct twl_text_damage *damage) {
+  float line_height = twl_text_view_line_height(view);
+  uint32_t rows = MIN(twl_text_view_rows(view, raster->height), TWL_TEXT_VIEW_MAX_ROWS);
+  float width = MAX(raster->width - 2 * view->margin, 0);
+  if (view->wrap)
+    twl_wrap_view(view->wrap, width);
+  if (view->follow) {
+    // The last row fully visible at the bottom
+    uint64_t full = raster->height > view->margin ? (uint64_t)((raster->height - view->margin) / line_height) : 0;
+    follow_end(view, MAX(full, 1), width);
+  }
+
+  struct twl_text_view_frame now = {
+      .buffer = buffer,
+      .size = view->size,
+      .order = order,
+      .width = raster->width,
+      .height = raster->height,
+      .rows = layout(view, rows, width),
+  };
+  const struct twl_text_row *first = &view->rows[0], *last = &view->rows[now.rows ? now.rows - 1 : 0];
+  const char *text;
+  size_t len;
+
+  // The matches in view are all the search is asked for
+  view->num_highlights = 0;
+  if (view->search && now.rows && twl_document_line(view->doc, first->line, &text, &len) == 0) {
+    uint64_t start = twl_document_offset(view->doc, text) + first->start;
+    twl_document_line(view->doc, last->line, &text, &len);
+    uint64_t end = twl_document_offset(view->doc, text) + last->end;
+    view->num_highlights = twl_search_find(view->search, start, end, view->highlights, TWL_TEXT_VIEW_MAX_HIGHLIGHTS);
+    // FNV-1a: a frame with other matches in view is redrawn
+    now.highlights = 0xCBF29CE484222325u;
+    for (uint32_t i = 0; i < view->num_highlights; ++i) {
+      now.highlights = (now.highlights ^ view->highlights[i].offset) * 0x100000001B3u;
+      now.highlights = (now.highlights ^ view->highlights[i].len) * 0x100000001B3u;
+    }
+  }
+
+  // Spans of the lines in view, from the worker's last pass over them
+  const struct twl_highlight_lines *lines = NULL;
+  if (view->highlighter) {
+    twl_highlighter_view(view->highlighter, first->line, now.rows ? last->line - first->line + 1 : 0);
+    lines = twl_highlighter_lock(view->highlighter);
+  }
+  // FNV-1a of what each row shows: a row drawn before the spans of its line were lexed, or
+  // before the line grew, is drawn again
+  for (uint32_t row = 0; row < now.rows; ++row) {
+    const struct twl_text_row *r = &view->rows[row];
+    uint64_t hash = 0xCBF29CE484222325u;
+    hash = (hash ^ r->line) * 0x100000001B3u;
+    hash = (hash ^ r->start) * 0x100000001B3u;
+    hash = (hash ^ r->end) * 0x100000001B3u;
+    uint32_t num_spans = 0;
+    const struct twl_token_span *spans = lines ? twl_highlight_line_spans(lines, r->line, &num_spans) : NULL;
+    hash = (hash ^ (spans != NULL)) * 0x100000001B3u;
+    for (uint32_t i = 0; spans && i < num_spans; ++i) {
+      hash = (hash ^ spans[i].start) * 0x100000001B3u;
+      hash = (hash ^ spans[i].len) * 0x100000001B3u;
+      hash = (hash ^ spans[i].token) * 0x100000001B3u;
+    }
+    now.row_hashes[row] = hash;
+  }
+
+  // What the buffer already shows
+  struct twl_text_view_frame *frame = NULL;
+  for (uint32_t i = 0; i < TWL_TEXT_VIEW_FRAMES && buffer; ++i) {
+    if (view->frames[i].buffer == buffer)
+      frame = &view->frames[i];
+  }
+  if (frame == NULL) {
+    frame = &view->frames[view->next_frame++ % TWL_TEXT_VIEW_FRAMES];
+    memset(frame, 0, sizeof(struct twl_text_view_frame));
+  }
+  uint32_t shift;
+  uint32_t kept = kept_rows(view, frame, &now, &shift);
+
+  uint32_t top = view->margin;
+  if (shift) {
+    // Scroll-blit: the kept rows move up in place, only the ones scrolled in are drawn
+    uint32_t from = top + shift * (uint32_t)line_height;
+    memmove(raster->pixels + (size_t)top * raster->stride, raster->pixels + (size_t)from * raster->stride,
+            (size_t)(raster->height - from) * raster->stride);
+  }
+
+  if (shift || kept < now.rows || frame->rows != now.rows) {
+    uint32_t y = kept ? top + kept * (uint32_t)line_height : 0;
+    twl_raster_fill_rect(raster, 0, y, raster->width, raster->height - y, view->background);
+
+    float ascender = view->atlas->ascender * view->size / TWL_SDF_SIZE;
+    uint32_t next = 0;
+    for (uint32_t row = kept; row < now.rows; ++row) {
+      const struct twl_text_row *r = &view->rows[row];
+      if (twl_document_line(view->doc, r->line, &text, &len) != 0)
+        break;
+      uint32_t y = top + row * (uint32_t)line_height;
+      if (view->num_highlights)
+        draw_highlights(view, raster, text, r, y, &next);
+      // Clipped to its own pixel rows, so that a row looks the same whatever was drawn around it
+      struct twl_raster clip = *raster;
+      clip.pixels += (size_t)y * raster->stride;
+      clip.height = MIN((uint32_t)line_height, raster->height - y);
+      uint32_t num_spans = 0;
+      const struct twl_token_span *spans = lines ? twl_highlight_line_spans(lines, r->line, &num_spans) : NULL;
+      draw_line(view, &clip, text, r->start, r->end, ascender, gamma, order, spans, spans ? num_spans : 0);
+    }
+  }
+  if (lines)
+    twl_highlighter_unlock(view->highlighter);
+
+  // Against the frame on screen, which may be another buffer
+  uint32_t same_shift;
+  uint32_t same = kept_rows(view, &view->last, &now, &same_shift);
+  same = same_shift ? 0 : same;
+  if (same_layout(&view->last, &now) && same == now.rows && view->last.rows == now.rows) {
+    damage->y = damage->height = 0;
+  } else {
+    damage->y = same ? top + same * (uint32_t)line_height : 0;
+    damage->height = raster->height - damage->y;
+  }
+
+  *frame = now;
+  view->last = now;
+}
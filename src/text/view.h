@@ -0,0 +1,91 @@
+#ifndef __TWL_VIEW_H__
+#define __TWL_VIEW_H__
+
+#include "../render/glyph_atlas.h"
+#include "../render/raster.h"
+#include "document.h"
+#include "highlight.h"
+#include "search.h"
+#include "wrap.h"
+#include <stdint.h>
+
+// Buffers whose content the view keeps track of
+#define TWL_TEXT_VIEW_FRAMES 4
+// Search matches highlighted at once, the rest of the screen isn't
+#define TWL_TEXT_VIEW_MAX_HIGHLIGHTS 256
+// Rows drawn at most, however tall the raster
+#define TWL_TEXT_VIEW_MAX_ROWS 512
+
+// What a buffer was last drawn with
+struct twl_text_view_frame {
+  uint64_t buffer; // twl_buffer.serial, 0 for none
+  float size;
+  enum twl_subpixel order;
+  uint32_t width;
+  uint32_t height;
+  uint32_t rows; // drawn
+  uint64_t highlights; // hash of the matches highlighted
+  uint64_t row_hashes[TWL_TEXT_VIEW_MAX_ROWS]; // of what each row shows: its line, bytes and token spans
+};
+
+// A row on screen: bytes [start, end) of a line
+struct twl_text_row {
+  uint64_t line;
+  size_t start;
+  size_t end;
+};
+
+// Rows of the raster a draw changed, see twl_window_damage()
+struct twl_text_damage {
+  uint32_t y;
+  uint32_t height;
+};
+
+// Lines of a document drawn top to bottom from `top_line`, or from its `top_row` when wrapped
+struct twl_text_view {
+  struct twl_document *doc;
+  struct twl_glyph_atlas *atlas;
+  float size; // font size in pixels
+  float margin; // around the text, whole pixels
+  uint32_t background;
+  uint64_t top_line;
+  uint32_t top_row;
+  uint32_t follow; // keeps the last line in view as the document grows
+  // Breaks lines at the raster's width when set: a resize only rewraps the lines in view on the
+  // spot, the rest of the document is rewrapped in the background
+  struct twl_wrap *wrap;
+  struct twl_text_row rows[TWL_TEXT_VIEW_MAX_ROWS]; // laid out by the last draw
+  // Matches of a running search are highlighted as they come in, only those in view are looked up
+  struct twl_search *search;
+  uint32_t highlight;
+  struct twl_match highlights[TWL_TEXT_VIEW_MAX_HIGHLIGHTS];
+  uint32_t num_highlights;
+  // Syntax highlighting: token spans are drawn in token_gamma[span.token], TWL_NUM_TOKENS of them.
+  // Lines whose spans aren't lexed yet are drawn plain, and again once they are.
+  struct twl_highlighter *highlighter;
+  const struct twl_text_gamma *token_gamma;
+  struct twl_text_view_frame frames[TWL_TEXT_VIEW_FRAMES];
+  uint32_t next_frame;
+  struct twl_text_view_frame last; // the frame drawn last, on screen
+};
+
+void twl_text_view_init(struct twl_text_view *view, struct twl_document *doc, struct twl_glyph_atlas *atlas, float size);
+// Whole pixels, so that lines can be scrolled by copying rows
+float twl_text_view_line_height(const struct twl_text_view *view);
+// Rows that fit in `height` pixels, counting a partly visible last one
+uint32_t twl_text_view_rows(const struct twl_text_view *view, uint32_t height);
+// For a scrollbar: the first row in view and how many there are, O(log n) when wrapped. Rows of
+// lines the background pass hasn't rewrapped yet are estimates.
+void twl_text_view_position(struct twl_text_view *view, uint64_t *row, uint64_t *num_rows);
+// By rows: lines, or rows of wrapped lines. Clamped to the lines loaded so far.
+void twl_text_view_scroll(struct twl_text_view *view, int64_t rows);
+void twl_text_view_scroll_to(struct twl_text_view *view, uint64_t row);
+// Fills the raster with the lines loaded so far: the first screen shows up as soon as the first
+// chunk is indexed and the rest fills in on the next frames. `buffer` is the raster's
+// twl_buffer.serial, 0 if its content is unknown. A buffer drawn before is brought up to date:
+// scrolled in place by copying rows, with only the rows new to it drawn. `damage` is what
+// changed since the last frame, whatever buffer that was drawn in.
+void twl_text_view_draw(struct twl_text_view *view, const struct twl_raster *raster, const struct twl_text_gamma *gamma,
+                        enum twl_subpixel order, uint64_t buffer, struct twl_text_damage *damage);
+
+#endif
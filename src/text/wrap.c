@@ -0,0 +1,257 @@
+#include "wrap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Fenwick tree
+// ============
+
+// Rows of lines [0, n)
+static uint64_t prefix(const struct twl_wrap *wrap, uint64_t n) {
+  uint64_t sum = 0;
+  for (; n; n &= n - 1)
+    sum += wrap->tree[n];
+  return sum;
+}
+
+static void add(struct twl_wrap *wrap, uint64_t line, int64_t delta) {
+  for (uint64_t i = line + 1; i <= wrap->num_lines; i += i & -i)
+    wrap->tree[i] += delta;
+}
+
+static void set_rows(struct twl_wrap *wrap, uint64_t line, uint32_t rows) {
+  if (wrap->rows[line] != rows)
+    add(wrap, line, (int64_t)rows - wrap->rows[line]);
+  wrap->rows[line] = rows;
+}
+
+// Appends a line: its node sums the lines it covers, which are all in the tree already
+static int push_line(struct twl_wrap *wrap, uint32_t rows) {
+  if (wrap->num_lines == wrap->capacity) {
+    uint64_t capacity = MAX(wrap->capacity * 2, 4096);
+    uint32_t *line_rows = realloc(wrap->rows, capacity * sizeof(uint32_t));
+    if (line_rows == NULL)
+      return -1;
+    wrap->rows = line_rows;
+    uint64_t *tree = realloc(wrap->tree, (capacity + 1) * sizeof(uint64_t));
+    if (tree == NULL)
+      return -1;
+    wrap->tree = tree;
+    wrap->capacity = capacity;
+  }
+  uint64_t i = ++wrap->num_lines;
+  wrap->rows[i - 1] = rows;
+  wrap->tree[i] = rows + prefix(wrap, i - 1) - prefix(wrap, i - (i & -i));
+  return 0;
+}
+
+// Breaking lines
+// ==============
+
+static size_t codepoint_len(const char *text, size_t len) {
+  uint8_t c = text[0];
+  size_t n = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+  return MIN(n, len);
+}
+
+static float advance(const struct twl_wrap *wrap, struct twl_glyph_atlas *atlas, const char *text, size_t n) {
+  if (n == 1 && (uint8_t)text[0] < 0x80)
+    return wrap->advances[(uint8_t)text[0]];
+  return atlas ? twl_glyph_atlas_measure_utf8(atlas, text, n, wrap->size) : wrap->fallback;
+}
+
+uint32_t twl_wrap_line(const struct twl_wrap *wrap, struct twl_glyph_atlas *atlas, const char *text, size_t len, float width, size_t *starts,
+                       uint32_t first_row, uint32_t max_rows) {
+  // As drawn: a CR before the line's end is left out, tabs jump to the next stop
+  if (len && text[len - 1] == '\r')
+    len--;
+
+  uint32_t rows = 1;
+  size_t start = 0, space = 0, i = 0;
+  float x = 0;
+  if (first_row == 0 && max_rows)
+    starts[0] = 0;
+  while (i < len && width > 0) {
+    size_t n = codepoint_len(text + i, len - i);
+    float next = text[i] == '\t' ? ((int)(x / wrap->tab) + 1) * wrap->tab : x + advance(wrap, atlas, text + i, n);
+    // Spaces may hang past the width, a row has at least one glyph
+    if (next > width && i > start && text[i] != ' ') {
+      start = space > start ? space : i;
+      if (rows >= first_row && rows - first_row < max_rows)
+        starts[rows - first_row] = start;
+      rows++;
+      i = start;
+      x = 0;
+      continue;
+    }
+    x = next;
+    i += n;
+    if (text[i - n] == ' ' || text[i - n] == '\t')
+      space = i;
+  }
+  return rows;
+}
+
+// Worker
+// ======
+
+static void *worker_main(void *data) {
+  struct twl_wrap *wrap = data;
+  struct twl_document *doc = wrap->doc;
+  uint32_t rows[TWL_WRAP_BATCH];
+  int is_full = 0;
+
+  pthread_mutex_lock(&wrap->lock);
+  while (!wrap->stop) {
+    uint64_t first = wrap->num_wrapped;
+    uint64_t generation = wrap->generation;
+    float width = wrap->width;
+    if (is_full || first >= twl_document_num_lines(doc)) {
+      pthread_cond_wait(&wrap->cond, &wrap->lock);
+      is_full = 0;
+      continue;
+    }
+    pthread_mutex_unlock(&wrap->lock);
+
+    pthread_rwlock_rdlock(&doc->append_lock);
+    uint32_t n = 0;
+    const char *text;
+    size_t len;
+    while (n < TWL_WRAP_BATCH && twl_document_line(doc, first + n, &text, &len) == 0) {
+      rows[n++] = twl_wrap_line(wrap, NULL, text, len, width, NULL, 0, 0);
+    }
+    pthread_rwlock_unlock(&doc->append_lock);
+
+    pthread_mutex_lock(&wrap->lock);
+    // Dropped if the width changed meanwhile, or an append sent the worker back
+    if (generation != wrap->generation || first != wrap->num_wrapped)
+      continue;
+    for (uint32_t i = 0; i < n && !is_full; ++i) {
+      if (first + i < wrap->num_lines)
+        set_rows(wrap, first + i, rows[i]);
+      else
+        is_full = push_line(wrap, rows[i]) != 0;
+      if (!is_full)
+        wrap->num_wrapped = first + i + 1;
+    }
+  }
+  pthread_mutex_unlock(&wrap->lock);
+  return NULL;
+}
+
+int twl_wrap_init(struct twl_wrap *wrap, struct twl_document *doc, struct twl_glyph_atlas *atlas, float size) {
+  zero_init(wrap, struct twl_wrap);
+  wrap->doc = doc;
+  wrap->size = size;
+  for (int c = 0; c < 0x80; ++c) {
+    char s = c;
+    wrap->advances[c] = twl_glyph_atlas_measure_utf8(atlas, &s, 1, size);
+  }
+  // Other codepoints count as an average letter until they're in view
+  for (char c = 'a'; c <= 'z'; ++c)
+    wrap->fallback += wrap->advances[(int)c] / 26;
+  wrap->tab = wrap->advances[' '] * TWL_TAB_WIDTH;
+  if (wrap->tab <= 0)
+    wrap->tab = size * 4;
+
+  pthread_mutex_init(&wrap->lock, NULL);
+  pthread_cond_init(&wrap->cond, NULL);
+  if (pthread_create(&wrap->thread, NULL, worker_main, wrap) != 0) {
+    pthread_cond_destroy(&wrap->cond);
+    pthread_mutex_destroy(&wrap->lock);
+    return -1;
+  }
+  return 0;
+}
+
+void twl_wrap_destroy(struct twl_wrap *wrap) {
+  pthread_mutex_lock(&wrap->lock);
+  wrap->stop = 1;
+  pthread_cond_signal(&wrap->cond);
+  pthread_mutex_unlock(&wrap->lock);
+  pthread_join(wrap->thread, NULL);
+
+  free(wrap->rows);
+  free(wrap->tree);
+  pthread_cond_destroy(&wrap->cond);
+  pthread_mutex_destroy(&wrap->lock);
+  zero_init(wrap, struct twl_wrap);
+}
+
+// Index
+// =====
+
+void twl_wrap_view(struct twl_wrap *wrap, float width) {
+  // Only this thread appends, the size can be read without the append lock
+  struct twl_document *doc = wrap->doc;
+  uint64_t num_lines = twl_document_num_lines(doc);
+  uint64_t size = doc->size;
+
+  pthread_mutex_lock(&wrap->lock);
+  int wake = 0;
+  if (width != wrap->width) {
+    // Lines keep their rows at the old width until the worker gets to them
+    wrap->width = width;
+    wrap->generation++;
+    wrap->num_wrapped = 0;
+    wake = 1;
+  }
+  if (num_lines != wrap->lines_seen || size != wrap->size_seen) {
+    // Lines are only ever added, but an append may go on with the last one
+    if (twl_document_state(doc) == TWL_DOCUMENT_LOADED && wrap->lines_seen && size != wrap->size_seen)
+      wrap->num_wrapped = MIN(wrap->num_wrapped, wrap->lines_seen - 1);
+    wrap->lines_seen = num_lines;
+    wrap->size_seen = size;
+    wake = 1;
+  }
+  if (wake)
+    pthread_cond_signal(&wrap->cond);
+  pthread_mutex_unlock(&wrap->lock);
+}
+
+void twl_wrap_set(struct twl_wrap *wrap, uint64_t line, uint32_t rows) {
+  pthread_mutex_lock(&wrap->lock);
+  if (line < wrap->num_lines)
+    set_rows(wrap, line, rows);
+  pthread_mutex_unlock(&wrap->lock);
+}
+
+uint64_t twl_wrap_row(struct twl_wrap *wrap, uint64_t line) {
+  pthread_mutex_lock(&wrap->lock);
+  uint64_t n = MIN(line, wrap->num_lines);
+  uint64_t row = prefix(wrap, n) + (line - n);
+  pthread_mutex_unlock(&wrap->lock);
+  return row;
+}
+
+uint64_t twl_wrap_line_at(struct twl_wrap *wrap, uint64_t row, uint32_t *line_row) {
+  pthread_mutex_lock(&wrap->lock);
+  // Down the tree: the most lines whose rows all come before `row`
+  uint64_t line = 0, left = row;
+  uint64_t step = wrap->num_lines;
+  while (step & (step - 1))
+    step &= step - 1;
+  for (; step; step >>= 1) {
+    if (line + step <= wrap->num_lines && wrap->tree[line + step] <= left) {
+      line += step;
+      left -= wrap->tree[line];
+    }
+  }
+  // Past the index, lines count as one row
+  int is_past = line == wrap->num_lines;
+  pthread_mutex_unlock(&wrap->lock);
+  *line_row = is_past ? 0 : left;
+  return is_past ? line + left : line;
+}
+
+uint64_t twl_wrap_num_rows(struct twl_wrap *wrap) {
+  uint64_t num_lines = twl_document_num_lines(wrap->doc);
+  pthread_mutex_lock(&wrap->lock);
+  uint64_t n = MIN(num_lines, wrap->num_lines);
+  uint64_t rows = prefix(wrap, n) + (num_lines - n);
+  pthread_mutex_unlock(&wrap->lock);
+  return rows;
+}
@@ -0,0 +1,60 @@
+#ifndef __TWL_WRAP_H__
+#define __TWL_WRAP_H__
+
+#include "../render/glyph_atlas.h"
+#include "document.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TWL_TAB_WIDTH 8 // in spaces
+// Lines wrapped by the worker between looks at the width
+#define TWL_WRAP_BATCH 4096
+
+// Rows each line takes once broken to fit a width, in a Fenwick tree: the row a line starts at
+// and the line at a row are O(log n), so is keeping them up to date as lines rewrap. A resize
+// doesn't rewrap anything on the spot: the worker goes over every line again from the start,
+// meanwhile lines keep their rows at the old width. The view wraps the lines it shows itself
+// and passes their rows on, so the ones in view are always right.
+struct twl_wrap {
+  struct twl_document *doc;
+  float size;
+  // Copied from the atlas, which the worker can't use: other codepoints are estimated
+  float advances[128];
+  float fallback;
+  float tab;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Guarded by lock
+  float width; // lines are broken at, 0 to not wrap
+  uint64_t generation; // of the width, a batch wrapped at an older one is dropped
+  uint64_t num_wrapped; // leading lines the worker wrapped at width
+  uint32_t *rows; // per line in the index, at width or an older one
+  uint64_t *tree; // 1-based, tree[i] sums rows of lines (i - lowbit(i), i]
+  uint64_t num_lines; // in the index, the worker adds lines as it first wraps them
+  uint64_t capacity;
+  uint32_t stop;
+  // Seen by the UI thread, to notice appends
+  uint64_t size_seen;
+  uint64_t lines_seen;
+};
+
+int twl_wrap_init(struct twl_wrap *wrap, struct twl_document *doc, struct twl_glyph_atlas *atlas, float size);
+void twl_wrap_destroy(struct twl_wrap *wrap);
+// Rows of a line at `width`, breaking after spaces when a word fits. starts[i] is where row
+// first_row + i starts, for up to max_rows rows. With an atlas, on its thread, every glyph is measured.
+uint32_t twl_wrap_line(const struct twl_wrap *wrap, struct twl_glyph_atlas *atlas, const char *text, size_t len, float width, size_t *starts,
+                       uint32_t first_row, uint32_t max_rows);
+// Call every frame with the width lines are broken at: a change only restarts the worker.
+// Appends to the document are noticed here.
+void twl_wrap_view(struct twl_wrap *wrap, float width);
+// Rows of a line wrapped in view, at the width last passed to twl_wrap_view()
+void twl_wrap_set(struct twl_wrap *wrap, uint64_t line, uint32_t rows);
+// Row a line starts at; lines the worker hasn't reached yet count as one row each
+uint64_t twl_wrap_row(struct twl_wrap *wrap, uint64_t line);
+// Line at a row, and the row within it
+uint64_t twl_wrap_line_at(struct twl_wrap *wrap, uint64_t row, uint32_t *line_row);
+uint64_t twl_wrap_num_rows(struct twl_wrap *wrap);
+
+#endif
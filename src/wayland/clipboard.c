@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+#include "clipboard.h"
+#include "wayland.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+// Bytes moved per wakeup, a fast peer can't keep the loop busy for longer than that
+#define TRANSFER_BUDGET (4u << 20)
+// Bigger pipes mean fewer wakeups for large pastes
+#define PIPE_SIZE (1u << 20)
+#define SEND_IOV_MAX 64
+
+// Text types in order of preference, the rank of an offer is its best index + 1
+static const char *text_mime_types[] = {"text/plain;charset=utf-8", "text/plain", "UTF8_STRING", "STRING", "TEXT"};
+#define NUM_TEXT_MIME_TYPES (sizeof(text_mime_types) / sizeof(text_mime_types[0]))
+
+struct twl_copy_source {
+  struct twl_clipboard *cb;
+  struct wl_data_source *wl_data_source;
+  struct iovec *pieces;
+  uint32_t num_pieces;
+  // The selection itself and every send in flight
+  uint32_t refs;
+  twl_copy_done_fn done_fn;
+  void *data;
+};
+
+// A pipe polled by the event loop, either received into a memfd or written from a source
+struct twl_transfer {
+  struct twl_clipboard *cb;
+  struct wl_list link; // twl_clipboard.transfers
+  int fd;
+  // Receiving
+  struct wl_data_offer *offer; // drops are finished once read
+  struct twl_paste paste;
+  size_t size;
+  twl_paste_fn fn;
+  void *data;
+  // Sending
+  struct twl_copy_source *source;
+  uint32_t piece;
+  size_t offset;
+};
+
+// Functions
+// =========
+
+static void cb_wl_data_device_data_offer(void *data, struct wl_data_device *wl_data_device, struct wl_data_offer *offer);
+static void cb_wl_data_device_enter(void *data, struct wl_data_device *wl_data_device, uint32_t serial, struct wl_surface *surface, wl_fixed_t x,
+                                    wl_fixed_t y, struct wl_data_offer *offer);
+static void cb_wl_data_device_leave(void *data, struct wl_data_device *wl_data_device);
+static void cb_wl_data_device_motion(void *data, struct wl_data_device *wl_data_device, uint32_t time, wl_fixed_t x, wl_fixed_t y);
+static void cb_wl_data_device_drop(void *data, struct wl_data_device *wl_data_device);
+static void cb_wl_data_device_selection(void *data, struct wl_data_device *wl_data_device, struct wl_data_offer *offer);
+static void cb_wl_data_offer_offer(void *data, struct wl_data_offer *offer, const char *mime_type);
+static void cb_wl_data_offer_source_actions(void *data, struct wl_data_offer *offer, uint32_t actions);
+static void cb_wl_data_offer_action(void *data, struct wl_data_offer *offer, uint32_t action);
+static void cb_wl_data_source_target(void *data, struct wl_data_source *wl_data_source, const char *mime_type);
+static void cb_wl_data_source_send(void *data, struct wl_data_source *wl_data_source, const char *mime_type, int32_t fd);
+static void cb_wl_data_source_cancelled(void *data, struct wl_data_source *wl_data_source);
+static void cb_wl_data_source_dnd_drop_performed(void *data, struct wl_data_source *wl_data_source);
+static void cb_wl_data_source_dnd_finished(void *data, struct wl_data_source *wl_data_source);
+static void cb_wl_data_source_action(void *data, struct wl_data_source *wl_data_source, uint32_t action);
+static void cb_receive(void *data, int fd);
+static void cb_send(void *data, int fd);
+
+// Wayland Listeners
+// =================
+
+static const struct wl_data_device_listener wl_data_device_listener = {
+    .data_offer = cb_wl_data_device_data_offer,
+    .enter = cb_wl_data_device_enter,
+    .leave = cb_wl_data_device_leave,
+    .motion = cb_wl_data_device_motion,
+    .drop = cb_wl_data_device_drop,
+    .selection = cb_wl_data_device_selection,
+};
+
+static const struct wl_data_offer_listener wl_data_offer_listener = {
+    .offer = cb_wl_data_offer_offer,
+    .source_actions = cb_wl_data_offer_source_actions,
+    .action = cb_wl_data_offer_action,
+};
+
+static const struct wl_data_source_listener wl_data_source_listener = {
+    .target = cb_wl_data_source_target,
+    .send = cb_wl_data_source_send,
+    .cancelled = cb_wl_data_source_cancelled,
+    .dnd_drop_performed = cb_wl_data_source_dnd_drop_performed,
+    .dnd_finished = cb_wl_data_source_dnd_finished,
+    .action = cb_wl_data_source_action,
+};
+
+// Implementation: Transfers
+// =========================
+
+static uint32_t offer_rank(struct wl_data_offer *offer) { return (uint32_t)(uintptr_t)wl_data_offer_get_user_data(offer); }
+
+// Expects the lock to be held
+static int start_receive(struct twl_clipboard *cb, struct wl_data_offer *offer, struct twl_window *win, twl_paste_fn fn, void *data) {
+  uint32_t rank = offer_rank(offer);
+  if (rank == 0)
+    return -1;
+
+  struct twl_transfer *t = calloc(1, sizeof(struct twl_transfer));
+  if (t == NULL)
+    return -1;
+
+  // The memfd is the append region: pages move into it from the pipe and are mapped as they are
+  t->paste.fd = memfd_create("twl-paste", MFD_CLOEXEC);
+  int fds[2];
+  if (t->paste.fd < 0 || pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+    if (t->paste.fd >= 0)
+      close(t->paste.fd);
+    free(t);
+    return -1;
+  }
+  fcntl(fds[0], F_SETPIPE_SZ, PIPE_SIZE);
+
+  wl_data_offer_receive(offer, text_mime_types[rank - 1], fds[1]);
+  close(fds[1]);
+
+  t->cb = cb;
+  t->fd = fds[0];
+  t->offer = win ? offer : NULL;
+  t->paste.win = win;
+  t->fn = fn;
+  t->data = data;
+  wl_list_insert(&cb->transfers, &t->link);
+  twl_watch_fd(cb->ctx, t->fd, POLLIN, cb_receive, t);
+  return 0;
+}
+
+static void finish_receive(struct twl_transfer *t, int ok) {
+  struct twl_clipboard *cb = t->cb;
+
+  pthread_mutex_lock(&cb->lock);
+  wl_list_remove(&t->link);
+  pthread_mutex_unlock(&cb->lock);
+
+  twl_unwatch_fd(cb->ctx, t->fd);
+  close(t->fd);
+
+  if (t->offer) {
+    if (ok && wl_data_offer_get_version(t->offer) >= 3)
+      wl_data_offer_finish(t->offer);
+    wl_data_offer_destroy(t->offer);
+  }
+
+  if (ok && t->size > 0) {
+    fzn_mmap_config config = {.size = t->size, .prot = PROT_READ, .flags = MAP_SHARED, .fd = t->paste.fd};
+    ok = fzn_mmap_new(&t->paste.mmap, &config) == FZN_SUCCESS;
+  }
+  if (!ok) {
+    close(t->paste.fd);
+    t->paste.fd = -1;
+  }
+
+  t->fn(t->data, &t->paste);
+  free(t);
+}
+
+// For files splice() can't write to; copies through a small buffer instead
+static ssize_t copy_chunk(int from, int to, off_t offset) {
+  char buf[1 << 16];
+  ssize_t n = read(from, buf, sizeof(buf));
+  for (ssize_t done = 0; done < n;) {
+    ssize_t written = pwrite(to, buf + done, n - done, offset + done);
+    if (written < 0 && errno != EINTR)
+      return -1;
+    done += written > 0 ? written : 0;
+  }
+  return n;
+}
+
+static void cb_receive(void *data, int fd) {
+  struct twl_transfer *t = data;
+
+  for (size_t budget = TRANSFER_BUDGET; budget > 0;) {
+    off64_t offset = t->size;
+    ssize_t n = splice(fd, NULL, t->paste.fd, &offset, MIN(budget, PIPE_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINVAL)
+      n = copy_chunk(fd, t->paste.fd, t->size);
+
+    if (n > 0) {
+      t->size += n;
+      budget -= MIN(budget, (size_t)n);
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && errno == EAGAIN) {
+      return;
+    } else {
+      // EOF: the source closed its end
+      finish_receive(t, n == 0);
+      return;
+    }
+  }
+}
+
+// Expects the lock to be held, returns 1 if the source has to be finished
+static int unref_source_locked(struct twl_copy_source *source) { return --source->refs == 0; }
+
+static void finish_source(struct twl_copy_source *source) {
+  if (source->done_fn)
+    source->done_fn(source->data);
+  free(source->pieces);
+  free(source);
+}
+
+// Skips the written bytes and the empty pieces after them
+static void advance(struct twl_transfer *t, size_t written) {
+  const struct iovec *pieces = t->source->pieces;
+  while (t->piece < t->source->num_pieces && written >= pieces[t->piece].iov_len - t->offset) {
+    written -= pieces[t->piece].iov_len - t->offset;
+    t->piece++;
+    t->offset = 0;
+  }
+  t->offset += written;
+}
+
+static void finish_send(struct twl_transfer *t) {
+  struct twl_clipboard *cb = t->cb;
+  struct twl_copy_source *source = t->source;
+
+  twl_unwatch_fd(cb->ctx, t->fd);
+  close(t->fd);
+
+  pthread_mutex_lock(&cb->lock);
+  wl_list_remove(&t->link);
+  int done = unref_source_locked(source);
+  pthread_mutex_unlock(&cb->lock);
+
+  if (done)
+    finish_source(source);
+  free(t);
+}
+
+// A receiver that closes its pipe early must not take the process down with it. It's a pipe, so
+// send(MSG_NOSIGNAL) is out: SIGPIPE is blocked for the call and consumed if the call raised it,
+// leaving the application's own disposition alone.
+static ssize_t writev_nosigpipe(int fd, const struct iovec *iov, int n) {
+  sigset_t pipe_set, old_set, pending;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+  sigpending(&pending);
+  int was_pending = sigismember(&pending, SIGPIPE);
+
+  ssize_t written = writev(fd, iov, n);
+  if (written < 0 && errno == EPIPE && !was_pending) {
+    int saved_errno = errno;
+    struct timespec zero = {0};
+    while (sigtimedwait(&pipe_set, NULL, &zero) < 0 && errno == EINTR)
+      ;
+    errno = saved_errno;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+  return written;
+}
+
+static void cb_send(void *data, int fd) {
+  struct twl_transfer *t = data;
+  struct twl_copy_source *source = t->source;
+
+  for (size_t budget = TRANSFER_BUDGET; budget > 0 && t->piece < source->num_pieces;) {
+    // The pieces are written as they are, without gathering them into a buffer first
+    struct iovec iov[SEND_IOV_MAX];
+    uint32_t n = 0;
+    size_t len = 0;
+    for (uint32_t i = t->piece; i < source->num_pieces && n < SEND_IOV_MAX && len < budget; ++i) {
+      size_t skip = i == t->piece ? t->offset : 0;
+      iov[n].iov_base = (char *)source->pieces[i].iov_base + skip;
+      iov[n].iov_len = source->pieces[i].iov_len - skip;
+      len += iov[n++].iov_len;
+    }
+
+    ssize_t written = writev_nosigpipe(fd, iov, n);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0 && errno == EAGAIN)
+      return;
+    if (written < 0) {
+      // The receiver went away
+      finish_send(t);
+      return;
+    }
+    budget -= MIN(budget, (size_t)written);
+    advance(t, written);
+  }
+
+  if (t->piece == source->num_pieces)
+    finish_send(t);
+}
+
+// Implementation: Wayland Callbacks
+// =================================
+
+static void cb_wl_data_device_data_offer(void *data, struct wl_data_device *wl_data_device, struct wl_data_offer *offer) {
+  // The mime types follow right away, before the offer is used in enter or selection
+  wl_data_offer_add_listener(offer, &wl_data_offer_listener, NULL);
+}
+
+static void cb_wl_data_offer_offer(void *data, struct wl_data_offer *offer, const char *mime_type) {
+  uint32_t rank = offer_rank(offer);
+  for (uint32_t i = 0; i < NUM_TEXT_MIME_TYPES; ++i) {
+    if (strcmp(mime_type, text_mime_types[i]) == 0 && (rank == 0 || i + 1 < rank)) {
+      wl_data_offer_set_user_data(offer, (void *)(uintptr_t)(i + 1));
+      return;
+    }
+  }
+}
+
+static void cb_wl_data_offer_source_actions(void *data, struct wl_data_offer *offer, uint32_t actions) {}
+
+static void cb_wl_data_offer_action(void *data, struct wl_data_offer *offer, uint32_t action) {}
+
+static void cb_wl_data_device_enter(void *data, struct wl_data_device *wl_data_device, uint32_t serial, struct wl_surface *surface, wl_fixed_t x,
+                                    wl_fixed_t y, struct wl_data_offer *offer) {
+  struct twl_clipboard *cb = data;
+
+  pthread_mutex_lock(&cb->lock);
+  if (cb->dnd_offer)
+    wl_data_offer_destroy(cb->dnd_offer);
+  cb->dnd_offer = offer;
+  // Layer surfaces carry their window too
+  cb->dnd_window = surface ? wl_surface_get_user_data(surface) : NULL;
+  uint32_t rank = offer && cb->drop_fn ? offer_rank(offer) : 0;
+  pthread_mutex_unlock(&cb->lock);
+
+  if (offer == NULL)
+    return;
+  wl_data_offer_accept(offer, serial, rank ? text_mime_types[rank - 1] : NULL);
+  if (wl_data_offer_get_version(offer) >= 3) {
+    uint32_t action = rank ? WL_DATA_DEVICE_MANAGER_DND_ACTION_COPY : WL_DATA_DEVICE_MANAGER_DND_ACTION_NONE;
+    wl_data_offer_set_actions(offer, action, action);
+  }
+}
+
+static void cb_wl_data_device_leave(void *data, struct wl_data_device *wl_data_device) {
+  struct twl_clipboard *cb = data;
+
+  pthread_mutex_lock(&cb->lock);
+  if (cb->dnd_offer)
+    wl_data_offer_destroy(cb->dnd_offer);
+  cb->dnd_offer = NULL;
+  cb->dnd_window = NULL;
+  pthread_mutex_unlock(&cb->lock);
+}
+
+static void cb_wl_data_device_motion(void *data, struct wl_data_device *wl_data_device, uint32_t time, wl_fixed_t x, wl_fixed_t y) {}
+
+static void cb_wl_data_device_drop(void *data, struct wl_data_device *wl_data_device) {
+  struct twl_clipboard *cb = data;
+
+  pthread_mutex_lock(&cb->lock);
+  struct wl_data_offer *offer = cb->dnd_offer;
+  cb->dnd_offer = NULL;
+  // The transfer owns the offer from here on and finishes it once everything is read
+  if (offer && (cb->drop_fn == NULL || cb->dnd_window == NULL ||
+                start_receive(cb, offer, cb->dnd_window, cb->drop_fn, cb->drop_data) != 0))
+    wl_data_offer_destroy(offer);
+  cb->dnd_window = NULL;
+  pthread_mutex_unlock(&cb->lock);
+}
+
+static void cb_wl_data_device_selection(void *data, struct wl_data_device *wl_data_device, struct wl_data_offer *offer) {
+  struct twl_clipboard *cb = data;
+
+  pthread_mutex_lock(&cb->lock);
+  if (cb->selection)
+    wl_data_offer_destroy(cb->selection);
+  cb->selection = offer;
+  pthread_mutex_unlock(&cb->lock);
+}
+
+static void cb_wl_data_source_target(void *data, struct wl_data_source *wl_data_source, const char *mime_type) {}
+
+static void cb_wl_data_source_send(void *data, struct wl_data_source *wl_data_source, const char *mime_type, int32_t fd) {
+  struct twl_copy_source *source = data;
+  struct twl_clipboard *cb = source->cb;
+
+  // Every offered type is the same text
+  struct twl_transfer *t = calloc(1, sizeof(struct twl_transfer));
+  if (t == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+    free(t);
+    close(fd);
+    return;
+  }
+  t->cb = cb;
+  t->fd = fd;
+  t->source = source;
+  advance(t, 0);
+
+  pthread_mutex_lock(&cb->lock);
+  source->refs++;
+  wl_list_insert(&cb->transfers, &t->link);
+  pthread_mutex_unlock(&cb->lock);
+
+  twl_watch_fd(cb->ctx, fd, POLLOUT, cb_send, t);
+}
+
+static void cb_wl_data_source_cancelled(void *data, struct wl_data_source *wl_data_source) {
+  struct twl_copy_source *source = data;
+  struct twl_clipboard *cb = source->cb;
+
+  wl_data_source_destroy(wl_data_source);
+
+  // Sends in flight keep the pieces alive
+  pthread_mutex_lock(&cb->lock);
+  if (cb->source == source)
+    cb->source = NULL;
+  source->wl_data_source = NULL;
+  int done = unref_source_locked(source);
+  pthread_mutex_unlock(&cb->lock);
+
+  if (done)
+    finish_source(source);
+}
+
+static void cb_wl_data_source_dnd_drop_performed(void *data, struct wl_data_source *wl_data_source) {}
+
+static void cb_wl_data_source_dnd_finished(void *data, struct wl_data_source *wl_data_source) {}
+
+static void cb_wl_data_source_action(void *data, struct wl_data_source *wl_data_source, uint32_t action) {}
+
+// Implementation: Library
+// =======================
+
+void twl_clipboard_init(struct twl_clipboard *cb, struct twl_context *ctx) {
+  zero_init(cb, struct twl_clipboard);
+  cb->ctx = ctx;
+  pthread_mutex_init(&cb->lock, NULL);
+  wl_list_init(&cb->transfers);
+
+  if (ctx->wl_data_device_manager == NULL || ctx->wl_seat == NULL)
+    return;
+
+  cb->wl_data_device = wl_data_device_manager_get_data_device(ctx->wl_data_device_manager, ctx->wl_seat);
+  wl_data_device_add_listener(cb->wl_data_device, &wl_data_device_listener, cb);
+}
+
+void twl_clipboard_destroy(struct twl_clipboard *cb) {
+  struct twl_transfer *t, *tmp;
+  wl_list_for_each_safe(t, tmp, &cb->transfers, link) {
+    twl_unwatch_fd(cb->ctx, t->fd);
+    close(t->fd);
+    if (t->source && unref_source_locked(t->source))
+      finish_source(t->source);
+    if (t->offer)
+      wl_data_offer_destroy(t->offer);
+    if (t->paste.fd >= 0 && t->source == NULL)
+      close(t->paste.fd);
+    free(t);
+  }
+
+  if (cb->source) {
+    wl_data_source_destroy(cb->source->wl_data_source);
+    if (unref_source_locked(cb->source))
+      finish_source(cb->source);
+  }
+  if (cb->selection)
+    wl_data_offer_destroy(cb->selection);
+  if (cb->dnd_offer)
+    wl_data_offer_destroy(cb->dnd_offer);
+  if (cb->wl_data_device) {
+    if (wl_data_device_get_version(cb->wl_data_device) >= 2)
+      wl_data_device_release(cb->wl_data_device);
+    else
+      wl_data_device_destroy(cb->wl_data_device);
+  }
+
+  pthread_mutex_destroy(&cb->lock);
+  zero_init(cb, struct twl_clipboard);
+}
+
+int twl_clipboard_paste(struct twl_clipboard *cb, twl_paste_fn fn, void *data) {
+  pthread_mutex_lock(&cb->lock);
+  int res = cb->selection ? start_receive(cb, cb->selection, NULL, fn, data) : -1;
+  pthread_mutex_unlock(&cb->lock);
+
+  // Render threads don't wait for the loop to send the request
+  if (res == 0)
+    wl_display_flush(cb->ctx->wl_display);
+  return res;
+}
+
+int twl_clipboard_copy(struct twl_clipboard *cb, const struct iovec *pieces, uint32_t num_pieces, twl_copy_done_fn done_fn, void *data) {
+  if (cb->wl_data_device == NULL)
+    return -1;
+
+  struct twl_copy_source *source = calloc(1, sizeof(struct twl_copy_source));
+  if (source == NULL)
+    return -1;
+  // Only the piece list is copied, never the text (+1: there may be no pieces)
+  source->pieces = malloc(num_pieces * sizeof(struct iovec) + 1);
+  if (source->pieces == NULL) {
+    free(source);
+    return -1;
+  }
+  memcpy(source->pieces, pieces, num_pieces * sizeof(struct iovec));
+  source->num_pieces = num_pieces;
+  source->cb = cb;
+  source->refs = 1;
+  source->done_fn = done_fn;
+  source->data = data;
+
+  source->wl_data_source = wl_data_device_manager_create_data_source(cb->ctx->wl_data_device_manager);
+  wl_data_source_add_listener(source->wl_data_source, &wl_data_source_listener, source);
+  for (uint32_t i = 0; i < NUM_TEXT_MIME_TYPES; ++i) {
+    wl_data_source_offer(source->wl_data_source, text_mime_types[i]);
+  }
+
+  // The previous source is cancelled by the compositor
+  pthread_mutex_lock(&cb->lock);
+  cb->source = source;
+  pthread_mutex_unlock(&cb->lock);
+
+  wl_data_device_set_selection(cb->wl_data_device, source->wl_data_source, cb->ctx->input_serial);
+  wl_display_flush(cb->ctx->wl_display);
+  return 0;
+}
+
+void twl_paste_release(struct twl_paste *paste) {
+  fzn_mmap_unmap(&paste->mmap);
+  if (paste->fd >= 0)
+    close(paste->fd);
+  paste->fd = -1;
+}
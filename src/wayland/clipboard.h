@@ -0,0 +1,55 @@
+#ifndef __TWL_CLIPBOARD_H__
+#define __TWL_CLIPBOARD_H__
+
+#include "./utils/fzn_std.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <wayland-client.h>
+
+struct twl_context;
+struct twl_window;
+struct twl_copy_source;
+
+// Text received from the selection or a drop. The bytes live in a memfd that is filled
+// with splice() and mapped read-only once complete, so they are never held twice.
+struct twl_paste {
+  struct twl_window *win; // window the text was dropped on, NULL for the selection
+  int fd;                 // memfd, -1 if the transfer failed
+  fzn_mmap mmap;          // addr is NULL when nothing was received
+};
+
+// Called on the event loop's thread. The paste belongs to the callee: copy it and
+// release it with twl_paste_release() once the text is no longer needed.
+typedef void (*twl_paste_fn)(void *data, const struct twl_paste *paste);
+// The pieces handed to twl_clipboard_copy() are not referenced anymore
+typedef void (*twl_copy_done_fn)(void *data);
+
+struct twl_clipboard {
+  struct twl_context *ctx;
+  struct wl_data_device *wl_data_device;
+  // Guards everything below, the loop's thread and render threads both use it
+  pthread_mutex_t lock;
+  struct wl_data_offer *selection;
+  struct wl_data_offer *dnd_offer;
+  struct twl_window *dnd_window;
+  struct twl_copy_source *source; // our selection, if we own it
+  // Pipes being read or written by the event loop (struct twl_transfer.link)
+  struct wl_list transfers;
+  // Called with every text dropped on a window. Set it directly.
+  twl_paste_fn drop_fn;
+  void *drop_data;
+};
+
+// Needs wl_data_device_manager and a seat, the clipboard stays inert without them.
+void twl_clipboard_init(struct twl_clipboard *cb, struct twl_context *ctx);
+void twl_clipboard_destroy(struct twl_clipboard *cb);
+// Reads the selection without blocking; fn runs once everything has arrived.
+// Returns -1 if there is no selection or it has no text.
+int twl_clipboard_paste(struct twl_clipboard *cb, twl_paste_fn fn, void *data);
+// Takes the selection with the concatenation of the pieces, which are written straight
+// to the requesting clients with writev(). They must stay valid until done_fn is called.
+int twl_clipboard_copy(struct twl_clipboard *cb, const struct iovec *pieces, uint32_t num_pieces, twl_copy_done_fn done_fn, void *data);
+void twl_paste_release(struct twl_paste *paste);
+
+#endif
@@ -0,0 +1,750 @@
+#include "io.h"
+#include "wayland.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+enum op_type {
+  OP_READ,
+  OP_WRITE,
+  OP_FSYNC,
+  OP_OPENAT,
+  OP_CLOSE,
+  OP_RENAMEAT,
+  OP_UNLINKAT,
+  OP_CALL, // a blocking call io_uring has no op for, always run by the pool
+};
+
+struct twl_io_op {
+  enum op_type type;
+  int fd;
+  void *buf;
+  uint32_t len;
+  uint64_t offset;
+  const char *path;
+  const char *new_path; // renameat
+  int flags;            // openat
+  mode_t mode;          // openat with O_CREAT, less the umask
+  int64_t (*call)(void *data); // OP_CALL, on a pool thread
+  twl_io_fn fn;
+  void *data;
+  int64_t result;
+  struct twl_io_op *next;
+};
+
+// The io_uring opcode of every op, all of them have to be supported
+static const uint8_t uring_opcodes[] = {
+    [OP_READ] = IORING_OP_READ,         [OP_WRITE] = IORING_OP_WRITE,       [OP_FSYNC] = IORING_OP_FSYNC,
+    [OP_OPENAT] = IORING_OP_OPENAT,     [OP_CLOSE] = IORING_OP_CLOSE,       [OP_RENAMEAT] = IORING_OP_RENAMEAT,
+    [OP_UNLINKAT] = IORING_OP_UNLINKAT,
+};
+
+static void complete(struct twl_io *io, struct twl_io_op *op, int64_t result) {
+  io->in_flight--;
+  if (op->fn)
+    op->fn(op->data, result);
+  free(op);
+}
+
+// io_uring
+// ========
+
+// No liburing: the three syscalls and the ring layout are all there is to it
+static int uring_setup(uint32_t entries, struct io_uring_params *params) { return syscall(__NR_io_uring_setup, entries, params); }
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, uint32_t opcode, void *arg, uint32_t num_args) { return syscall(__NR_io_uring_register, fd, opcode, arg, num_args); }
+
+static int uring_supports_ops(int fd) {
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  if (probe == NULL)
+    return 0;
+
+  int supported = uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (uint32_t i = 0; supported && i < sizeof(uring_opcodes); ++i) {
+    uint8_t opcode = uring_opcodes[i];
+    supported = opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+static int uring_init(struct twl_io_uring *uring, int event_fd) {
+  struct io_uring_params params;
+  zero_init(&params, struct io_uring_params);
+  uring->fd = uring_setup(TWL_IO_QUEUE_DEPTH, &params);
+  if (uring->fd < 0)
+    return -1;
+
+  // Both rings in one mapping is 5.4, the probe needs 5.6: nothing older is worth supporting
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  fzn_mmap_config rings_config = {
+      .size = sq_size > cq_size ? sq_size : cq_size,
+      .prot = PROT_READ | PROT_WRITE,
+      .flags = MAP_SHARED | MAP_POPULATE,
+      .fd = uring->fd,
+      .offset = IORING_OFF_SQ_RING,
+  };
+  fzn_mmap_config sqes_config = {
+      .size = params.sq_entries * sizeof(struct io_uring_sqe),
+      .prot = PROT_READ | PROT_WRITE,
+      .flags = MAP_SHARED | MAP_POPULATE,
+      .fd = uring->fd,
+      .offset = IORING_OFF_SQES,
+  };
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_supports_ops(uring->fd) ||
+      fzn_mmap_new(&uring->rings, &rings_config) != FZN_SUCCESS) {
+    close(uring->fd);
+    return -1;
+  }
+  if (fzn_mmap_new(&uring->sqes, &sqes_config) != FZN_SUCCESS) {
+    fzn_mmap_unmap(&uring->rings);
+    close(uring->fd);
+    return -1;
+  }
+
+  uint8_t *rings = uring->rings.addr;
+  uring->sq_head = (_Atomic uint32_t *)(rings + params.sq_off.head);
+  uring->sq_tail = (_Atomic uint32_t *)(rings + params.sq_off.tail);
+  uring->sq_mask = *(uint32_t *)(rings + params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  uring->sq_queued_tail = atomic_load(uring->sq_tail);
+  uring->cq_head = (_Atomic uint32_t *)(rings + params.cq_off.head);
+  uring->cq_tail = (_Atomic uint32_t *)(rings + params.cq_off.tail);
+  uring->cq_mask = *(uint32_t *)(rings + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+  // Entries are always used in ring order
+  uint32_t *array = (uint32_t *)(rings + params.sq_off.array);
+  for (uint32_t i = 0; i < params.sq_entries; ++i) {
+    array[i] = i;
+  }
+
+  if (uring_register(uring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) != 0) {
+    fzn_mmap_unmap(&uring->sqes);
+    fzn_mmap_unmap(&uring->rings);
+    close(uring->fd);
+    return -1;
+  }
+  return 0;
+}
+
+static int uring_submit(struct twl_io_uring *uring) {
+  atomic_store_explicit(uring->sq_tail, uring->sq_queued_tail, memory_order_release);
+  for (;;) {
+    uint32_t to_submit = uring->sq_queued_tail - atomic_load_explicit(uring->sq_head, memory_order_acquire);
+    if (to_submit == 0)
+      return 0;
+    if (uring_enter(uring->fd, to_submit, 0, 0) < 0 && errno != EINTR)
+      return errno == EAGAIN || errno == EBUSY ? 0 : -1; // the rest goes with the next batch
+  }
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, const struct twl_io_op *op) {
+  zero_init(sqe, struct io_uring_sqe);
+  sqe->opcode = uring_opcodes[op->type];
+  sqe->fd = op->fd;
+  sqe->user_data = (uintptr_t)op;
+
+  switch (op->type) {
+  case OP_READ:
+  case OP_WRITE:
+    sqe->addr = (uintptr_t)op->buf;
+    sqe->len = op->len;
+    sqe->off = op->offset;
+    break;
+  case OP_FSYNC:
+  case OP_CLOSE:
+    break;
+  case OP_OPENAT:
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)op->path;
+    sqe->len = op->mode;
+    sqe->open_flags = op->flags;
+    break;
+  case OP_RENAMEAT:
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)op->path;
+    sqe->len = AT_FDCWD;
+    sqe->addr2 = (uintptr_t)op->new_path;
+    break;
+  case OP_UNLINKAT:
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)op->path;
+    break;
+  case OP_CALL:
+    break;
+  }
+}
+
+static int uring_queue(struct twl_io_uring *uring, const struct twl_io_op *op) {
+  // A full ring is handed over first
+  if (uring->sq_queued_tail - atomic_load_explicit(uring->sq_head, memory_order_acquire) >= uring->sq_entries) {
+    if (uring_submit(uring) != 0 || uring->sq_queued_tail - atomic_load(uring->sq_head) >= uring->sq_entries)
+      return -1;
+  }
+  struct io_uring_sqe *sqes = uring->sqes.addr;
+  uring_prep(&sqes[uring->sq_queued_tail & uring->sq_mask], op);
+  uring->sq_queued_tail++;
+  return 0;
+}
+
+static void uring_reap(struct twl_io *io) {
+  struct twl_io_uring *uring = &io->uring;
+  uint32_t head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+  while (head != atomic_load_explicit(uring->cq_tail, memory_order_acquire)) {
+    struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+    struct twl_io_op *op = (struct twl_io_op *)(uintptr_t)cqe->user_data;
+    int64_t result = cqe->res;
+    // Give the slot back before the callback queues more
+    atomic_store_explicit(uring->cq_head, ++head, memory_order_release);
+    complete(io, op, result);
+  }
+}
+
+static void uring_destroy(struct twl_io *io) {
+  struct twl_io_uring *uring = &io->uring;
+  // The kernel may still write to the buffers: wait for everything, without the callbacks
+  uring_submit(uring);
+  while (io->in_flight) {
+    uint32_t head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(uring->cq_tail, memory_order_acquire)) {
+      if (uring_enter(uring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        break;
+      continue;
+    }
+    free((struct twl_io_op *)(uintptr_t)uring->cqes[head & uring->cq_mask].user_data);
+    atomic_store_explicit(uring->cq_head, head + 1, memory_order_release);
+    io->in_flight--;
+  }
+  fzn_mmap_unmap(&uring->sqes);
+  fzn_mmap_unmap(&uring->rings);
+  close(uring->fd);
+}
+
+// Thread pool
+// ===========
+
+static int64_t run_op(const struct twl_io_op *op) {
+  int64_t res;
+  do {
+    switch (op->type) {
+    case OP_READ:
+      res = pread(op->fd, op->buf, op->len, op->offset);
+      break;
+    case OP_WRITE:
+      res = pwrite(op->fd, op->buf, op->len, op->offset);
+      break;
+    case OP_FSYNC:
+      res = fsync(op->fd);
+      break;
+    case OP_OPENAT:
+      res = openat(AT_FDCWD, op->path, op->flags, op->mode);
+      break;
+    case OP_CLOSE:
+      // Never retried, the fd is gone either way
+      return close(op->fd) == 0 ? 0 : -errno;
+    case OP_RENAMEAT:
+      res = renameat(AT_FDCWD, op->path, AT_FDCWD, op->new_path);
+      break;
+    case OP_UNLINKAT:
+      res = unlinkat(AT_FDCWD, op->path, 0);
+      break;
+    case OP_CALL:
+      return op->call(op->data);
+    default:
+      return -EINVAL;
+    }
+  } while (res < 0 && errno == EINTR);
+  return res < 0 ? -errno : res;
+}
+
+static void *pool_thread_main(void *data) {
+  struct twl_io *io = data;
+  struct twl_io_pool *pool = &io->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->queue == NULL && !pool->stop) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    // Stopping drains the queue first
+    struct twl_io_op *op = pool->queue;
+    if (op == NULL)
+      break;
+    pool->queue = op->next;
+    pthread_mutex_unlock(&pool->lock);
+
+    op->result = run_op(op);
+
+    pthread_mutex_lock(&pool->lock);
+    op->next = pool->done;
+    pool->done = op;
+    uint64_t one = 1;
+    if (write(io->event_fd, &one, sizeof(one)) < 0) {
+      // Only fails when the counter is saturated, which wakes the loop just the same
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static int pool_init(struct twl_io *io) {
+  struct twl_io_pool *pool = &io->pool;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  while (pool->num_threads < TWL_IO_THREADS && pthread_create(&pool->threads[pool->num_threads], NULL, pool_thread_main, io) == 0) {
+    pool->num_threads++;
+  }
+  if (pool->num_threads == 0) {
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    return -1;
+  }
+  return 0;
+}
+
+static void pool_reap(struct twl_io *io) {
+  struct twl_io_pool *pool = &io->pool;
+  pthread_mutex_lock(&pool->lock);
+  struct twl_io_op *done = pool->done;
+  pool->done = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  // Newest first, completions are reported in the order they happened
+  struct twl_io_op *ordered = NULL;
+  while (done) {
+    struct twl_io_op *next = done->next;
+    done->next = ordered;
+    ordered = done;
+    done = next;
+  }
+  while (ordered) {
+    struct twl_io_op *next = ordered->next;
+    complete(io, ordered, ordered->result);
+    ordered = next;
+  }
+}
+
+static uint32_t free_ops(struct twl_io_op *op) {
+  uint32_t n = 0;
+  for (; op; ++n) {
+    struct twl_io_op *next = op->next;
+    free(op);
+    op = next;
+  }
+  return n;
+}
+
+static void pool_destroy(struct twl_io *io) {
+  struct twl_io_pool *pool = &io->pool;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 0; i < pool->num_threads; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  io->in_flight -= free_ops(pool->done);
+  io->in_flight -= free_ops(io->pending);
+  io->pending = io->pending_tail = NULL;
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+// I/O
+// ===
+
+static void cb_io_event(void *data, int fd) {
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    return;
+  twl_io_dispatch(data);
+}
+
+int twl_io_init(struct twl_io *io, struct twl_context *ctx) {
+  zero_init(io, struct twl_io);
+  io->ctx = ctx;
+  io->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (io->event_fd < 0)
+    return -1;
+
+  if (uring_init(&io->uring, io->event_fd) == 0) {
+    io->backend = TWL_IO_BACKEND_URING;
+  } else if (pool_init(io) == 0) {
+    io->backend = TWL_IO_BACKEND_THREADS;
+  } else {
+    close(io->event_fd);
+    return -1;
+  }
+
+  if (ctx)
+    twl_watch_fd(ctx, io->event_fd, POLLIN, cb_io_event, io);
+  return 0;
+}
+
+void twl_io_destroy(struct twl_io *io) {
+  if (io->ctx)
+    twl_unwatch_fd(io->ctx, io->event_fd);
+  // The pool first: io_uring waits for every op still in flight
+  if (io->pool.num_threads)
+    pool_destroy(io);
+  if (io->backend == TWL_IO_BACKEND_URING)
+    uring_destroy(io);
+  close(io->event_fd);
+  zero_init(io, struct twl_io);
+}
+
+void twl_io_dispatch(struct twl_io *io) {
+  if (io->backend == TWL_IO_BACKEND_URING)
+    uring_reap(io);
+  if (io->pool.num_threads)
+    pool_reap(io);
+}
+
+static int queue_op(struct twl_io *io, const struct twl_io_op *template) {
+  struct twl_io_op *op = malloc(sizeof(struct twl_io_op));
+  if (op == NULL)
+    return -1;
+  *op = *template;
+  op->next = NULL;
+
+  if (io->backend == TWL_IO_BACKEND_URING && op->type != OP_CALL) {
+    if (uring_queue(&io->uring, op) != 0) {
+      free(op);
+      return -1;
+    }
+  } else {
+    // Next to io_uring the pool is only started by the first call
+    if (io->pool.num_threads == 0 && pool_init(io) != 0) {
+      free(op);
+      return -1;
+    }
+    if (io->pending_tail)
+      io->pending_tail->next = op;
+    else
+      io->pending = op;
+    io->pending_tail = op;
+  }
+  io->in_flight++;
+  return 0;
+}
+
+int twl_io_read(struct twl_io *io, int fd, void *buf, uint32_t len, uint64_t offset, twl_io_fn fn, void *data) {
+  struct twl_io_op op = {.type = OP_READ, .fd = fd, .buf = buf, .len = len, .offset = offset, .fn = fn, .data = data};
+  return queue_op(io, &op);
+}
+
+int twl_io_write(struct twl_io *io, int fd, const void *buf, uint32_t len, uint64_t offset, twl_io_fn fn, void *data) {
+  struct twl_io_op op = {.type = OP_WRITE, .fd = fd, .buf = (void *)buf, .len = len, .offset = offset, .fn = fn, .data = data};
+  return queue_op(io, &op);
+}
+
+int twl_io_fsync(struct twl_io *io, int fd, twl_io_fn fn, void *data) {
+  struct twl_io_op op = {.type = OP_FSYNC, .fd = fd, .fn = fn, .data = data};
+  return queue_op(io, &op);
+}
+
+static void pool_submit(struct twl_io *io) {
+  if (io->pending == NULL)
+    return;
+  struct twl_io_pool *pool = &io->pool;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->queue_tail && pool->queue)
+    pool->queue_tail->next = io->pending;
+  else
+    pool->queue = io->pending;
+  pool->queue_tail = io->pending_tail;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  io->pending = io->pending_tail = NULL;
+}
+
+int twl_io_submit(struct twl_io *io) {
+  pool_submit(io);
+  if (io->backend == TWL_IO_BACKEND_URING)
+    return uring_submit(&io->uring);
+  return 0;
+}
+
+// Saving
+// ======
+
+enum save_step {
+  SAVE_RESOLVE,
+  SAVE_OPEN,
+  SAVE_COPY_ATTRIBUTES,
+  SAVE_WRITE,
+  SAVE_FSYNC,
+  SAVE_CLOSE,
+  SAVE_RENAME,
+  SAVE_OPEN_DIR,
+  SAVE_FSYNC_DIR,
+  SAVE_CLOSE_DIR,
+  SAVE_UNLINK, // after a failure, the temporary file goes
+};
+
+// One op at a time, each completion queues the next
+struct save {
+  struct twl_io *io;
+  enum save_step step;
+  char *path;
+  char *tmp_path;
+  char *dir_path;
+  const struct iovec *pieces;
+  uint32_t num_pieces;
+  uint32_t piece;
+  size_t piece_offset;
+  uint64_t written;
+  int fd;
+  int64_t error;
+  twl_io_fn fn;
+  void *data;
+  // Of the file replaced, given to the new one
+  int has_target;
+  struct stat target;
+  uint32_t num_attempts;
+};
+
+// Temporary names are made unique across saves in flight, stale ones from a crash are skipped
+#define SAVE_MAX_ATTEMPTS 64
+static atomic_uint save_counter;
+
+static void save_step(void *data, int64_t result);
+
+static void save_free(struct save *save) {
+  free(save->path);
+  free(save->tmp_path);
+  free(save->dir_path);
+  free(save);
+}
+
+static void save_finish(struct save *save, int64_t result) {
+  save->fn(save->data, result);
+  save_free(save);
+}
+
+static void save_issue(struct save *save, enum save_step step, const struct twl_io_op *template) {
+  struct twl_io_op op = *template;
+  op.fn = save_step;
+  op.data = save;
+  save->step = step;
+  if (queue_op(save->io, &op) != 0) {
+    // Out of memory: the temporary file stays behind
+    if (save->fd >= 0)
+      close(save->fd);
+    save_finish(save, save->error ? save->error : -ENOMEM);
+    return;
+  }
+  // If the submission fails the op stays queued for the next one
+  twl_io_submit(save->io);
+}
+
+// Under the next name, never over an existing file
+static struct twl_io_op save_open_op(struct save *save) {
+  snprintf(save->tmp_path, strlen(save->path) + 32, "%s.%d.%u.tmp", save->path, (int)getpid(), atomic_fetch_add(&save_counter, 1));
+  save->num_attempts++;
+  // With the target's mode, so it is never more open than the file even before the fchmod()
+  mode_t mode = save->has_target ? save->target.st_mode & 0777 : 0666;
+  return (struct twl_io_op){.type = OP_OPENAT, .path = save->tmp_path, .flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, .mode = mode};
+}
+
+// A symlink is followed, the file it points to is replaced and the link stays.
+// Anything else is a new file. On a pool thread, like every call that may hit the disk.
+static int64_t save_resolve(void *data) {
+  struct save *save = data;
+  char *resolved = realpath(save->path, NULL);
+  if (resolved) {
+    free(save->path);
+    save->path = resolved;
+  }
+  save->has_target = stat(save->path, &save->target) == 0;
+
+  // Next to the file, renaming doesn't work across filesystems
+  const char *slash = strrchr(save->path, '/');
+  save->dir_path = slash ? strndup(save->path, slash == save->path ? 1 : slash - save->path) : strdup(".");
+  save->tmp_path = malloc(strlen(save->path) + 32);
+  if (save->dir_path == NULL || save->tmp_path == NULL)
+    return -ENOMEM;
+  return 0;
+}
+
+// Ownership, mode and ACL of the file replaced: the rename would drop them otherwise.
+// On a pool thread. Ownership needs privileges and is best effort.
+static int64_t save_copy_attributes(void *data) {
+  struct save *save = data;
+  if (!save->has_target)
+    return 0;
+  if (fchown(save->fd, save->target.st_uid, save->target.st_gid) != 0 && fchown(save->fd, -1, save->target.st_gid) != 0) {
+    // Owned by whoever saves, as with any new file
+  }
+  // After fchown(), which clears the setuid and setgid bits; the umask doesn't apply here
+  if (fchmod(save->fd, save->target.st_mode & 07777) != 0)
+    return -errno;
+  char acl[4096];
+  ssize_t len = getxattr(save->path, "system.posix_acl_access", acl, sizeof(acl));
+  if (len > 0 && fsetxattr(save->fd, "system.posix_acl_access", acl, len, 0) != 0 && errno != ENOTSUP && errno != EOPNOTSUPP)
+    return -errno;
+  return 0;
+}
+
+static void save_write_next(struct save *save) {
+  while (save->piece < save->num_pieces && save->piece_offset == save->pieces[save->piece].iov_len) {
+    save->piece++;
+    save->piece_offset = 0;
+  }
+  if (save->piece == save->num_pieces) {
+    save_issue(save, SAVE_FSYNC, &(struct twl_io_op){.type = OP_FSYNC, .fd = save->fd});
+    return;
+  }
+
+  const struct iovec *piece = &save->pieces[save->piece];
+  struct twl_io_op op = {
+      .type = OP_WRITE,
+      .fd = save->fd,
+      .buf = (uint8_t *)piece->iov_base + save->piece_offset,
+      .len = MIN(piece->iov_len - save->piece_offset, 1u << 30),
+      .offset = save->written,
+  };
+  save_issue(save, SAVE_WRITE, &op);
+}
+
+static void save_fail(struct save *save, int64_t error) {
+  if (save->error == 0)
+    save->error = error;
+  if (save->fd >= 0)
+    save_issue(save, SAVE_CLOSE, &(struct twl_io_op){.type = OP_CLOSE, .fd = save->fd});
+  else
+    save_issue(save, SAVE_UNLINK, &(struct twl_io_op){.type = OP_UNLINKAT, .path = save->tmp_path});
+}
+
+static void save_step(void *data, int64_t result) {
+  struct save *save = data;
+
+  switch (save->step) {
+  case SAVE_RESOLVE:
+    if (result < 0) {
+      save_finish(save, result);
+      return;
+    }
+    struct twl_io_op open_op = save_open_op(save);
+    save_issue(save, SAVE_OPEN, &open_op);
+    break;
+  case SAVE_OPEN:
+    if (result == -EEXIST && save->num_attempts < SAVE_MAX_ATTEMPTS) {
+      struct twl_io_op op = save_open_op(save);
+      save_issue(save, SAVE_OPEN, &op);
+      return;
+    }
+    if (result < 0) {
+      save_finish(save, result);
+      return;
+    }
+    save->fd = result;
+    save_issue(save, SAVE_COPY_ATTRIBUTES, &(struct twl_io_op){.type = OP_CALL, .call = save_copy_attributes});
+    break;
+  case SAVE_COPY_ATTRIBUTES:
+    if (result < 0) {
+      save_fail(save, result);
+      return;
+    }
+    save_write_next(save);
+    break;
+  case SAVE_WRITE:
+    if (result <= 0) {
+      save_fail(save, result < 0 ? result : -EIO);
+      return;
+    }
+    save->piece_offset += result;
+    save->written += result;
+    save_write_next(save);
+    break;
+  case SAVE_FSYNC:
+    if (result < 0) {
+      save_fail(save, result);
+      return;
+    }
+    save_issue(save, SAVE_CLOSE, &(struct twl_io_op){.type = OP_CLOSE, .fd = save->fd});
+    break;
+  case SAVE_CLOSE:
+    save->fd = -1;
+    if (save->error == 0 && result < 0)
+      save->error = result;
+    if (save->error) {
+      save_fail(save, save->error);
+      return;
+    }
+    save_issue(save, SAVE_RENAME, &(struct twl_io_op){.type = OP_RENAMEAT, .path = save->tmp_path, .new_path = save->path});
+    break;
+  case SAVE_RENAME:
+    if (result < 0) {
+      save_fail(save, result);
+      return;
+    }
+    save_issue(save, SAVE_OPEN_DIR, &(struct twl_io_op){.type = OP_OPENAT, .path = save->dir_path, .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC});
+    break;
+  case SAVE_OPEN_DIR:
+    // The new content is in place; syncing the directory only makes the rename itself durable
+    if (result < 0) {
+      save_finish(save, save->written);
+      return;
+    }
+    save->fd = result;
+    save_issue(save, SAVE_FSYNC_DIR, &(struct twl_io_op){.type = OP_FSYNC, .fd = save->fd});
+    break;
+  case SAVE_FSYNC_DIR:
+    save_issue(save, SAVE_CLOSE_DIR, &(struct twl_io_op){.type = OP_CLOSE, .fd = save->fd});
+    break;
+  case SAVE_CLOSE_DIR:
+    save->fd = -1;
+    save_finish(save, save->written);
+    break;
+  case SAVE_UNLINK:
+    save_finish(save, save->error);
+    break;
+  }
+}
+
+int twl_io_save(struct twl_io *io, const char *path, const struct iovec *pieces, uint32_t num_pieces, twl_io_fn fn, void *data) {
+  struct save *save = calloc(1, sizeof(struct save));
+  if (save == NULL)
+    return -1;
+  save->io = io;
+  save->pieces = pieces;
+  save->num_pieces = num_pieces;
+  save->fd = -1;
+  save->fn = fn;
+  save->data = data;
+  save->path = strdup(path);
+  if (save->path == NULL) {
+    save_free(save);
+    return -1;
+  }
+
+  struct twl_io_op op = {.type = OP_CALL, .call = save_resolve, .fn = save_step, .data = save};
+  save->step = SAVE_RESOLVE;
+  if (queue_op(io, &op) != 0) {
+    save_free(save);
+    return -1;
+  }
+  twl_io_submit(io);
+  return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef __TWL_IO_H__
+#define __TWL_IO_H__
+
+#include "./utils/fzn_std.h"
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define TWL_IO_QUEUE_DEPTH 64
+#define TWL_IO_THREADS 4
+
+struct twl_context;
+struct twl_io_op;
+
+enum twl_io_backend {
+  TWL_IO_BACKEND_URING,
+  TWL_IO_BACKEND_THREADS, // kernels without io_uring, or without an op used here
+};
+
+// Called on the event loop's thread with the bytes transferred, or -errno
+typedef void (*twl_io_fn)(void *data, int64_t result);
+
+struct twl_io_uring {
+  int fd;
+  fzn_mmap rings; // submission and completion rings share one mapping
+  fzn_mmap sqes;
+  _Atomic uint32_t *sq_head;
+  _Atomic uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t sq_queued_tail; // published to sq_tail by twl_io_submit()
+  _Atomic uint32_t *cq_head;
+  _Atomic uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+struct twl_io_pool {
+  pthread_t threads[TWL_IO_THREADS];
+  uint32_t num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Guarded by lock: submitted ops waiting for a thread, and finished ones waiting to be reaped
+  struct twl_io_op *queue;
+  struct twl_io_op *queue_tail;
+  struct twl_io_op *done;
+  uint32_t stop;
+};
+
+// Asynchronous file I/O for the event loop: reads and writes are queued, handed over in
+// batches and complete through an eventfd the loop watches, so slow disks never stall it.
+// Only use it from the loop's thread.
+struct twl_io {
+  struct twl_context *ctx;
+  enum twl_io_backend backend;
+  int event_fd; // signalled by io_uring or the pool threads on completions
+  struct twl_io_uring uring;
+  struct twl_io_pool pool;
+  // Queued for the pool until the next twl_io_submit()
+  struct twl_io_op *pending;
+  struct twl_io_op *pending_tail;
+  uint32_t in_flight;
+};
+
+// io_uring if the kernel supports every op used here, a thread pool otherwise. Blocking calls
+// io_uring has no op for, like the metadata twl_io_save() copies, start the pool next to it.
+// With a context the completions are dispatched by its loop, otherwise poll event_fd
+// and call twl_io_dispatch().
+int twl_io_init(struct twl_io *io, struct twl_context *ctx);
+// Waits for the ops in flight, their callbacks aren't called
+void twl_io_destroy(struct twl_io *io);
+void twl_io_dispatch(struct twl_io *io);
+
+// Queued until twl_io_submit(), which hands the whole batch over in one call: queue the reads
+// of every chunk of a file, then submit once. Buffers must stay valid until fn is called.
+int twl_io_read(struct twl_io *io, int fd, void *buf, uint32_t len, uint64_t offset, twl_io_fn fn, void *data);
+int twl_io_write(struct twl_io *io, int fd, const void *buf, uint32_t len, uint64_t offset, twl_io_fn fn, void *data);
+int twl_io_fsync(struct twl_io *io, int fd, twl_io_fn fn, void *data);
+int twl_io_submit(struct twl_io *io);
+// Replaces the file with the pieces without ever leaving it half written: they go to a temporary
+// file that is synced and renamed over `path`, then the directory is synced. Submitted right away.
+// The new file keeps the mode, ownership and ACL of the old one; a symlink is followed, not replaced.
+// The pieces must stay valid until fn is called with the size written, or -errno.
+int twl_io_save(struct twl_io *io, const char *path, const struct iovec *pieces, uint32_t num_pieces, twl_io_fn fn, void *data);
+
+#endif
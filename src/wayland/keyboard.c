@@ -0,0 +1,152 @@
+#include "keyboard.h"
+#include "utils/fzn_std.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+
+static const char *mod_names[4] = {XKB_MOD_NAME_SHIFT, XKB_MOD_NAME_CTRL, XKB_MOD_NAME_ALT, XKB_MOD_NAME_LOGO};
+
+int twl_keyboard_init(struct twl_keyboard *kb) {
+  zero_init(kb, struct twl_keyboard);
+
+  kb->xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  if (kb->xkb_context == NULL) {
+    return -1;
+  }
+
+  // Timers instead of sleeping: repeats are just another fd in the event loop.
+  kb->repeat_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (kb->repeat_fd < 0) {
+    xkb_context_unref(kb->xkb_context);
+    kb->xkb_context = NULL;
+    return -1;
+  }
+
+  // Until the compositor says otherwise
+  kb->repeat_rate = 25;
+  kb->repeat_delay = 600;
+  return 0;
+}
+
+void twl_keyboard_destroy(struct twl_keyboard *kb) {
+  if (kb->xkb_state)
+    xkb_state_unref(kb->xkb_state);
+  if (kb->xkb_keymap)
+    xkb_keymap_unref(kb->xkb_keymap);
+  if (kb->xkb_context)
+    xkb_context_unref(kb->xkb_context);
+  if (kb->repeat_fd >= 0)
+    close(kb->repeat_fd);
+  zero_init(kb, struct twl_keyboard);
+  kb->repeat_fd = -1;
+}
+
+int twl_keyboard_set_keymap(struct twl_keyboard *kb, int fd, uint32_t size) {
+  // Private: from wl_seat v7 on the compositor may hand out a read-only, shared fd
+  const fzn_mmap_config config = {
+      .size = size,
+      .prot = PROT_READ,
+      .flags = MAP_PRIVATE,
+      .fd = fd,
+      .offset = 0,
+  };
+  fzn_mmap map = {0};
+  fzn_mmap_new(&map, &config);
+  close(fd);
+  if (map.addr == NULL) {
+    perror("mmap keymap");
+    return -1;
+  }
+
+  // The keymap is NUL-terminated, xkbcommon parses it in place.
+  const char *text = map.addr;
+  size_t length = strnlen(text, size);
+  struct xkb_keymap *keymap = xkb_keymap_new_from_buffer(kb->xkb_context, text, length, XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+  fzn_mmap_unmap(&map);
+  if (keymap == NULL) {
+    return -1;
+  }
+
+  struct xkb_state *state = xkb_state_new(keymap);
+  if (state == NULL) {
+    xkb_keymap_unref(keymap);
+    return -1;
+  }
+
+  if (kb->xkb_state)
+    xkb_state_unref(kb->xkb_state);
+  if (kb->xkb_keymap)
+    xkb_keymap_unref(kb->xkb_keymap);
+  kb->xkb_keymap = keymap;
+  kb->xkb_state = state;
+
+  for (int i = 0; i < 4; ++i) {
+    kb->mod_index[i] = xkb_keymap_mod_get_index(keymap, mod_names[i]);
+  }
+
+  twl_keyboard_stop_repeat(kb);
+  return 0;
+}
+
+void twl_keyboard_set_modifiers(struct twl_keyboard *kb, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group) {
+  if (kb->xkb_state == NULL)
+    return;
+  xkb_state_update_mask(kb->xkb_state, depressed, latched, locked, 0, 0, group);
+}
+
+void twl_keyboard_translate(struct twl_keyboard *kb, uint32_t keycode, enum twl_key_state state, struct twl_key_event *event) {
+  zero_init(event, struct twl_key_event);
+  event->keycode = keycode;
+  event->state = state;
+
+  if (kb->xkb_state == NULL)
+    return;
+
+  // evdev codes are offset by 8 in xkb
+  xkb_keycode_t xkb_key = keycode + 8;
+  event->keysym = xkb_state_key_get_one_sym(kb->xkb_state, xkb_key);
+  event->utf32 = xkb_state_key_get_utf32(kb->xkb_state, xkb_key);
+  xkb_state_key_get_utf8(kb->xkb_state, xkb_key, event->utf8, sizeof(event->utf8));
+
+  for (int i = 0; i < 4; ++i) {
+    if (kb->mod_index[i] != XKB_MOD_INVALID && xkb_state_mod_index_is_active(kb->xkb_state, kb->mod_index[i], XKB_STATE_MODS_EFFECTIVE) > 0)
+      event->modifiers |= 1u << i;
+  }
+}
+
+void twl_keyboard_start_repeat(struct twl_keyboard *kb, uint32_t keycode) {
+  if (kb->repeat_rate <= 0 || kb->xkb_keymap == NULL || !xkb_keymap_key_repeats(kb->xkb_keymap, keycode + 8)) {
+    twl_keyboard_stop_repeat(kb);
+    return;
+  }
+
+  kb->repeat_key = keycode;
+
+  // Periodic: a late wakeup reports the missed repeats instead of pushing the later ones back
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = kb->repeat_delay / 1000;
+  spec.it_value.tv_nsec = (kb->repeat_delay % 1000) * 1000000l;
+  spec.it_interval.tv_sec = kb->repeat_rate == 1 ? 1 : 0;
+  spec.it_interval.tv_nsec = kb->repeat_rate == 1 ? 0 : 1000000000l / kb->repeat_rate;
+  timerfd_settime(kb->repeat_fd, 0, &spec, NULL);
+}
+
+void twl_keyboard_stop_repeat(struct twl_keyboard *kb) {
+  struct itimerspec spec = {0};
+  kb->repeat_key = 0;
+  timerfd_settime(kb->repeat_fd, 0, &spec, NULL);
+}
+
+uint64_t twl_keyboard_read_repeat(struct twl_keyboard *kb) {
+  uint64_t expirations = 0;
+  if (read(kb->repeat_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return 0;
+  // Stopped while the expiration was pending
+  if (kb->repeat_key == 0)
+    return 0;
+  return expirations;
+}
@@ -0,0 +1,57 @@
+#ifndef __TWL_KEYBOARD_H__
+#define __TWL_KEYBOARD_H__
+
+#include <stdint.h>
+#include <xkbcommon/xkbcommon.h>
+
+enum twl_key_state {
+  TWL_KEY_RELEASED,
+  TWL_KEY_PRESSED,
+  TWL_KEY_REPEATED,
+};
+
+enum twl_modifier {
+  TWL_MOD_SHIFT = 1 << 0,
+  TWL_MOD_CTRL = 1 << 1,
+  TWL_MOD_ALT = 1 << 2,
+  TWL_MOD_LOGO = 1 << 3,
+};
+
+struct twl_key_event {
+  // CLOCK_MONOTONIC time the event was read from the compositor (or the repeat fired),
+  // compare with now to measure keystroke-to-frame latency.
+  uint64_t time_ns;
+  uint32_t keycode; // evdev
+  xkb_keysym_t keysym;
+  uint32_t utf32; // 0 if the key doesn't produce text
+  char utf8[8];
+  enum twl_key_state state;
+  uint32_t modifiers; // enum twl_modifier
+};
+
+// xkbcommon state of a wl_keyboard and its key repeat timer.
+struct twl_keyboard {
+  struct xkb_context *xkb_context;
+  struct xkb_keymap *xkb_keymap;
+  struct xkb_state *xkb_state;
+  xkb_mod_index_t mod_index[4]; // by bit of enum twl_modifier
+  // Key repeat: rate in keys/s (0 disables), delay in ms
+  int32_t repeat_rate;
+  int32_t repeat_delay;
+  int repeat_fd; // timerfd
+  uint32_t repeat_key;
+};
+
+int twl_keyboard_init(struct twl_keyboard *kb);
+void twl_keyboard_destroy(struct twl_keyboard *kb);
+// Compiles the keymap straight from the compositor's fd, which is mapped read-only and not copied.
+int twl_keyboard_set_keymap(struct twl_keyboard *kb, int fd, uint32_t size);
+void twl_keyboard_set_modifiers(struct twl_keyboard *kb, uint32_t depressed, uint32_t latched, uint32_t locked, uint32_t group);
+void twl_keyboard_translate(struct twl_keyboard *kb, uint32_t keycode, enum twl_key_state state, struct twl_key_event *event);
+// Arms the repeat timer if the key repeats; twl_keyboard_stop_repeat() disarms it.
+void twl_keyboard_start_repeat(struct twl_keyboard *kb, uint32_t keycode);
+void twl_keyboard_stop_repeat(struct twl_keyboard *kb);
+// Called when repeat_fd is readable, returns the number of repeats that are due.
+uint64_t twl_keyboard_read_repeat(struct twl_keyboard *kb);
+
+#endif
@@ -0,0 +1,51 @@
+#include "latency.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+void twl_latency_record(struct twl_latency_stats *stats, uint32_t latency_us) {
+  stats->samples[stats->count % TWL_LATENCY_SAMPLES] = latency_us;
+  stats->count++;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+uint32_t twl_latency_percentile(const struct twl_latency_stats *stats, uint32_t percent) {
+  uint32_t n = MIN(stats->count, TWL_LATENCY_SAMPLES);
+  if (n == 0)
+    return 0;
+
+  // Only called for reports, sorting a copy is cheap enough
+  uint32_t sorted[TWL_LATENCY_SAMPLES];
+  memcpy(sorted, stats->samples, n * sizeof(uint32_t));
+  qsort(sorted, n, sizeof(uint32_t), compare_u32);
+
+  // Nearest rank
+  uint32_t rank = (percent * n + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+void twl_latency_print(const struct twl_latency_stats *stats, const char *label, FILE *f) {
+  fprintf(f, "%s latency: %u frames, %u discarded, p50 %u us, p90 %u us, p99 %u us, max %u us\n", label, stats->count, stats->discarded,
+          twl_latency_percentile(stats, 50), twl_latency_percentile(stats, 90), twl_latency_percentile(stats, 99),
+          twl_latency_percentile(stats, 100));
+}
+
+int twl_startup_mark(_Atomic uint64_t *milestone, uint64_t time_ns) {
+  uint64_t unset = 0;
+  return atomic_compare_exchange_strong(milestone, &unset, time_ns);
+}
+
+static double since_start_ms(const struct twl_startup_trace *trace, uint64_t time_ns) {
+  return time_ns ? (double)(int64_t)(time_ns - trace->start_ns) / 1e6 : 0;
+}
+
+void twl_startup_print(const struct twl_startup_trace *trace, FILE *f) {
+  fprintf(f, "Startup: connect %.1f ms, first configure %.1f ms, first commit %.1f ms, first present %.1f ms\n",
+          since_start_ms(trace, trace->connect_ns), since_start_ms(trace, trace->configure_ns), since_start_ms(trace, trace->commit_ns),
+          since_start_ms(trace, trace->present_ns));
+}
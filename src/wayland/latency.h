@@ -0,0 +1,35 @@
+#ifndef __TWL_LATENCY_H__
+#define __TWL_LATENCY_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TWL_LATENCY_SAMPLES 1024
+
+// Input-to-present latencies of the last TWL_LATENCY_SAMPLES frames that showed input
+struct twl_latency_stats {
+  uint32_t samples[TWL_LATENCY_SAMPLES]; // microseconds, ring buffer
+  uint32_t count; // total recorded, the ring holds the last TWL_LATENCY_SAMPLES
+  uint32_t discarded; // frames with input that were never shown
+};
+
+void twl_latency_record(struct twl_latency_stats *stats, uint32_t latency_us);
+// percent in 0..100, returns 0 without samples
+uint32_t twl_latency_percentile(const struct twl_latency_stats *stats, uint32_t percent);
+void twl_latency_print(const struct twl_latency_stats *stats, const char *label, FILE *f);
+
+// Milestones of the first frame, CLOCK_MONOTONIC ns and 0 until reached
+struct twl_startup_trace {
+  uint64_t start_ns; // twl_init()
+  _Atomic uint64_t connect_ns;
+  _Atomic uint64_t configure_ns; // first configure received
+  _Atomic uint64_t commit_ns; // first buffer committed
+  _Atomic uint64_t present_ns; // first frame on screen, or its frame callback without wp_presentation
+};
+
+// Only the first mark of a milestone counts, returns whether this was it
+int twl_startup_mark(_Atomic uint64_t *milestone, uint64_t time_ns);
+void twl_startup_print(const struct twl_startup_trace *trace, FILE *f);
+
+#endif
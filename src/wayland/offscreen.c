@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "offscreen.h"
+#include "../render/raster.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+
+static size_t align_to_pagesize(size_t size) {
+  size_t page_size = getpagesize();
+  size = (size + page_size - 1) & ~(page_size - 1); // Round up to page boundary
+  return size;
+}
+
+static int map_frame(struct twl_offscreen *off, uint32_t width, uint32_t height) {
+  uint32_t stride = width * twl_format_bpp(off->win.buffer->format);
+  size_t size = align_to_pagesize((size_t)stride * height);
+
+  fzn_mmap_config config = {
+      .size = size,
+      .prot = PROT_READ | PROT_WRITE,
+      .flags = MAP_SHARED,
+      .fd = off->fd,
+      .offset = 0,
+  };
+
+  if (off->fd >= 0) {
+    if (ftruncate(off->fd, size) != 0) {
+      perror("ftruncate in twl_offscreen");
+      return -1;
+    }
+  } else {
+    config.flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  }
+
+  if (fzn_mmap_new(&off->win.buffer->mmap, &config) != FZN_SUCCESS) {
+    perror("mmap in twl_offscreen");
+    return -1;
+  }
+
+  off->win.config.width = width;
+  off->win.config.height = height;
+  off->win.buffer->width = width;
+  off->win.buffer->height = height;
+  off->win.buffer->stride = stride;
+  return 0;
+}
+
+int twl_offscreen_init(struct twl_offscreen *off, uint32_t width, uint32_t height, enum twl_format format, draw_fn draw, void *user_data) {
+  zero_init(off, struct twl_offscreen);
+
+  off->win.draw_fn = draw;
+  off->win.user_data = user_data;
+  off->win.constraints.default_width = width;
+  off->win.constraints.default_height = height;
+  off->win.config.is_activated = 1;
+  off->win.render_scale = 100;
+  off->win.scale120 = 120;
+  off->win.buffer = &off->win.buffers[0];
+  // No compositor to negotiate with, every format is available
+  off->win.constraints.format = format;
+  off->win.buffer->format = format;
+
+  // memfd lets the frame be handed to another process (or a real wl_shm pool) later.
+  off->fd = memfd_create("twl-offscreen", MFD_CLOEXEC);
+
+  return map_frame(off, width, height);
+}
+
+int twl_offscreen_resize(struct twl_offscreen *off, uint32_t width, uint32_t height) {
+  if (width == off->win.config.width && height == off->win.config.height)
+    return 0;
+
+  if (fzn_mmap_unmap(&off->win.buffer->mmap) != FZN_SUCCESS)
+    return -1;
+
+  return map_frame(off, width, height);
+}
+
+int twl_offscreen_render(struct twl_offscreen *off) {
+  struct twl_window *win = &off->win;
+  if (win->buffer->mmap.addr == NULL)
+    return -1;
+
+  (win->draw_fn)(win, win->buffer->mmap.addr);
+  return 0;
+}
+
+int twl_offscreen_dump_ppm(struct twl_offscreen *off, const char *path) {
+  uint32_t width = off->win.config.width;
+  uint32_t height = off->win.config.height;
+  struct twl_raster raster;
+  twl_raster_from_buffer(&raster, off->win.buffer);
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    perror("fopen in twl_offscreen_dump_ppm");
+    return -1;
+  }
+
+  fprintf(f, "P6\n%u %u\n255\n", width, height);
+
+  // Convert one row at a time, buffer format -> XRGB8888 -> RGB888
+  uint8_t *row = malloc((size_t)width * 3);
+  uint32_t *src = malloc((size_t)width * 4);
+  if (row == NULL || src == NULL) {
+    free(row);
+    free(src);
+    fclose(f);
+    return -1;
+  }
+
+  for (uint32_t y = 0; y < height; ++y) {
+    twl_raster_read_row(&raster, y, src);
+    for (uint32_t x = 0; x < width; ++x) {
+      row[x * 3 + 0] = (src[x] >> 16) & 0xFF;
+      row[x * 3 + 1] = (src[x] >> 8) & 0xFF;
+      row[x * 3 + 2] = src[x] & 0xFF;
+    }
+    fwrite(row, 3, width, f);
+  }
+
+  free(row);
+  free(src);
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+int twl_offscreen_dump_raw(struct twl_offscreen *off, const char *path) {
+  size_t size = (size_t)off->win.buffer->stride * off->win.config.height;
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    perror("fopen in twl_offscreen_dump_raw");
+    return -1;
+  }
+
+  size_t written = fwrite(off->win.buffer->mmap.addr, 1, size, f);
+  if (fclose(f) != 0 || written != size)
+    return -1;
+
+  return 0;
+}
+
+void twl_offscreen_destroy(struct twl_offscreen *off) {
+  fzn_mmap_unmap(&off->win.buffer->mmap);
+  if (off->fd >= 0)
+    close(off->fd);
+  off->fd = -1;
+}
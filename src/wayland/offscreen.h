@@ -0,0 +1,22 @@
+#ifndef __TWL_OFFSCREEN_H__
+#define __TWL_OFFSCREEN_H__
+
+#include "wayland.h"
+
+// Offscreen render target.
+// Wraps a struct twl_window that is never connected to a compositor, so the
+// same draw_fn can be used for batch rendering, screenshots and benchmarks.
+struct twl_offscreen {
+  struct twl_window win;
+  // memfd backing the frame, -1 if we fell back to an anonymous mapping.
+  int fd;
+};
+
+int twl_offscreen_init(struct twl_offscreen *off, uint32_t width, uint32_t height, enum twl_format format, draw_fn draw, void *user_data);
+int twl_offscreen_resize(struct twl_offscreen *off, uint32_t width, uint32_t height);
+int twl_offscreen_render(struct twl_offscreen *off);
+int twl_offscreen_dump_ppm(struct twl_offscreen *off, const char *path);
+int twl_offscreen_dump_raw(struct twl_offscreen *off, const char *path);
+void twl_offscreen_destroy(struct twl_offscreen *off);
+
+#endif
@@ -0,0 +1,66 @@
+#include "pointer.h"
+#include <string.h>
+
+#define zero_init(var, type) memset(var, 0, sizeof(type))
+
+void twl_pointer_batch_init(struct twl_pointer_batch *batch) {
+  zero_init(batch, struct twl_pointer_batch);
+  wl_array_init(&batch->motion);
+  wl_array_init(&batch->buttons);
+}
+
+void twl_pointer_batch_add(struct twl_pointer_batch *batch, const struct twl_pointer_event *event) {
+  if (batch->changes == 0)
+    batch->time_ns = event->time_ns;
+  batch->changes |= event->changes;
+
+  if (event->changes & TWL_POINTER_ENTER)
+    batch->inside = 1;
+  if (event->changes & TWL_POINTER_LEAVE)
+    batch->inside = 0;
+
+  if (event->changes & (TWL_POINTER_ENTER | TWL_POINTER_MOTION)) {
+    batch->x = event->x;
+    batch->y = event->y;
+
+    struct twl_pointer_sample *sample = wl_array_add(&batch->motion, sizeof(struct twl_pointer_sample));
+    if (sample) {
+      sample->x = event->x;
+      sample->y = event->y;
+      sample->time_ns = event->time_ns;
+    }
+  }
+
+  if (event->changes & TWL_POINTER_BUTTON) {
+    struct twl_pointer_button *button = wl_array_add(&batch->buttons, sizeof(struct twl_pointer_button));
+    if (button) {
+      button->button = event->button;
+      button->state = event->button_state;
+      button->x = batch->x;
+      button->y = batch->y;
+      button->time_ns = event->time_ns;
+    }
+  }
+
+  if (event->changes & TWL_POINTER_AXIS) {
+    for (int i = 0; i < 2; ++i) {
+      batch->scroll[i] += event->axis[i];
+      batch->scroll_discrete[i] += event->axis_discrete[i];
+    }
+  }
+}
+
+void twl_pointer_batch_reset(struct twl_pointer_batch *batch) {
+  batch->changes = 0;
+  batch->time_ns = 0;
+  batch->motion.size = 0;
+  batch->buttons.size = 0;
+  batch->scroll[0] = batch->scroll[1] = 0;
+  batch->scroll_discrete[0] = batch->scroll_discrete[1] = 0;
+}
+
+void twl_pointer_batch_destroy(struct twl_pointer_batch *batch) {
+  wl_array_release(&batch->motion);
+  wl_array_release(&batch->buttons);
+  zero_init(batch, struct twl_pointer_batch);
+}
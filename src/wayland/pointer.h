@@ -0,0 +1,66 @@
+#ifndef __TWL_POINTER_H__
+#define __TWL_POINTER_H__
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+// Cap on the motion history of a batch; a window that doesn't draw gets its batch early instead.
+// In threaded mode the I/O thread drops the older half of it.
+#define TWL_POINTER_HISTORY_MAX 1024
+
+enum twl_pointer_change {
+  TWL_POINTER_ENTER = 1 << 0,
+  TWL_POINTER_LEAVE = 1 << 1,
+  TWL_POINTER_MOTION = 1 << 2,
+  TWL_POINTER_BUTTON = 1 << 3,
+  TWL_POINTER_AXIS = 1 << 4,
+};
+
+// Everything the compositor sent in one wl_pointer.frame
+struct twl_pointer_event {
+  uint32_t changes; // enum twl_pointer_change
+  uint64_t time_ns; // CLOCK_MONOTONIC, when the frame was read
+  // Surface-local position in window coordinates
+  double x;
+  double y;
+  uint32_t button; // linux/input-event-codes.h
+  uint32_t button_state; // enum wl_pointer_button_state
+  double axis[2]; // by enum wl_pointer_axis
+  int32_t axis_discrete[2];
+};
+
+struct twl_pointer_sample {
+  double x;
+  double y;
+  uint64_t time_ns;
+};
+
+struct twl_pointer_button {
+  uint32_t button;
+  uint32_t state; // enum wl_pointer_button_state
+  double x;
+  double y;
+  uint64_t time_ns;
+};
+
+// Pointer input since the last frame, handed to the application once per frame.
+// Motion is coalesced into the latest position; the samples are kept for apps that want them.
+struct twl_pointer_batch {
+  uint32_t changes; // enum twl_pointer_change, or-ed over the batch
+  uint64_t time_ns; // of the oldest event
+  uint32_t inside; // the pointer is over the window
+  double x;
+  double y;
+  struct wl_array motion; // struct twl_pointer_sample, oldest first
+  struct wl_array buttons; // struct twl_pointer_button, in order
+  double scroll[2]; // summed, by enum wl_pointer_axis
+  int32_t scroll_discrete[2];
+};
+
+void twl_pointer_batch_init(struct twl_pointer_batch *batch);
+void twl_pointer_batch_add(struct twl_pointer_batch *batch, const struct twl_pointer_event *event);
+// Empties the batch, keeping the position and the allocations
+void twl_pointer_batch_reset(struct twl_pointer_batch *batch);
+void twl_pointer_batch_destroy(struct twl_pointer_batch *batch);
+
+#endif
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include "pool.h"
+#include "utils/shm.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+static uint64_t align_to_pagesize(uint64_t size) {
+  uint64_t page_size = getpagesize();
+  size = (size + page_size - 1) & ~(page_size - 1); // Round up to page boundary
+  return size;
+}
+
+// wl_shm takes pool sizes as int32
+static uint64_t max_pool_size() { return INT32_MAX & ~(uint64_t)(getpagesize() - 1); }
+
+static uint32_t num_ranges(struct twl_shm_pool *shm_pool) { return shm_pool->free_ranges.size / sizeof(struct twl_pool_range); }
+
+static uint32_t num_pools(struct twl_buffer_pool *pool) { return pool->pools.size / sizeof(struct twl_shm_pool *); }
+
+static void insert_range(struct twl_shm_pool *shm_pool, uint32_t index, uint32_t offset, uint32_t size) {
+  if (wl_array_add(&shm_pool->free_ranges, sizeof(struct twl_pool_range)) == NULL) {
+    // Leaks the range, but the pool stays consistent.
+    return;
+  }
+  struct twl_pool_range *ranges = shm_pool->free_ranges.data;
+  uint32_t n = num_ranges(shm_pool);
+  memmove(&ranges[index + 1], &ranges[index], (n - 1 - index) * sizeof(struct twl_pool_range));
+  ranges[index].offset = offset;
+  ranges[index].size = size;
+}
+
+static void remove_range(struct twl_shm_pool *shm_pool, uint32_t index) {
+  struct twl_pool_range *ranges = shm_pool->free_ranges.data;
+  uint32_t n = num_ranges(shm_pool);
+  memmove(&ranges[index], &ranges[index + 1], (n - 1 - index) * sizeof(struct twl_pool_range));
+  shm_pool->free_ranges.size -= sizeof(struct twl_pool_range);
+}
+
+static void free_locked(struct twl_shm_pool *shm_pool, uint32_t offset, uint32_t size);
+
+// Returns -1 if the pool can't hold min_free more bytes, it is left as it was then
+static int grow(struct twl_buffer_pool *pool, struct twl_shm_pool *shm_pool, uint32_t min_free) {
+  uint64_t size = shm_pool->size;
+  if (size + min_free > max_pool_size())
+    return -1;
+  uint64_t new_size = align_to_pagesize(MAX(size * 2, size + min_free));
+  if (new_size > max_pool_size())
+    new_size = max_pool_size();
+
+  if (shm_pool->wl_shm_pool == NULL) {
+    int fd = twl_shm_allocate(new_size);
+    if (fd < 0) {
+      return -1;
+    }
+    shm_pool->fd = fd;
+    shm_pool->wl_shm_pool = wl_shm_create_pool(pool->wl_shm, fd, new_size);
+  } else {
+    if (twl_shm_resize(shm_pool->fd, new_size) != 0) {
+      return -1;
+    }
+    wl_shm_pool_resize(shm_pool->wl_shm_pool, new_size);
+  }
+
+  // The new tail is free; it is always the last range.
+  free_locked(shm_pool, shm_pool->size, new_size - shm_pool->size);
+  shm_pool->size = new_size;
+  return 0;
+}
+
+static struct twl_shm_pool *add_pool(struct twl_buffer_pool *pool) {
+  struct twl_shm_pool *shm_pool = calloc(1, sizeof(struct twl_shm_pool));
+  struct twl_shm_pool **entry = shm_pool ? wl_array_add(&pool->pools, sizeof(struct twl_shm_pool *)) : NULL;
+  if (entry == NULL) {
+    free(shm_pool);
+    return NULL;
+  }
+  shm_pool->fd = -1;
+  wl_array_init(&shm_pool->free_ranges);
+  *entry = shm_pool;
+  return shm_pool;
+}
+
+static int alloc_from(struct twl_shm_pool *shm_pool, uint32_t size, uint32_t *offset) {
+  struct twl_pool_range *ranges = shm_pool->free_ranges.data;
+  uint32_t n = num_ranges(shm_pool);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    if (ranges[i].size < size)
+      continue;
+
+    *offset = ranges[i].offset;
+    ranges[i].offset += size;
+    ranges[i].size -= size;
+    if (ranges[i].size == 0)
+      remove_range(shm_pool, i);
+    return 0;
+  }
+  return -1;
+}
+
+void twl_pool_init(struct twl_buffer_pool *pool, struct wl_shm *wl_shm) {
+  memset(pool, 0, sizeof(struct twl_buffer_pool));
+  pool->wl_shm = wl_shm;
+  pthread_mutex_init(&pool->lock, NULL);
+  wl_array_init(&pool->pools);
+}
+
+int twl_pool_alloc(struct twl_buffer_pool *pool, uint32_t size, struct twl_shm_pool **shm_pool, uint32_t *offset) {
+  uint64_t aligned = align_to_pagesize(size);
+  if (aligned > max_pool_size())
+    return -1;
+  size = aligned;
+
+  pthread_mutex_lock(&pool->lock);
+
+  // First fit over every pool, then growing the last one, then a new one
+  struct twl_shm_pool **pools = pool->pools.data;
+  uint32_t n = num_pools(pool);
+  for (uint32_t i = 0; i < n; ++i) {
+    if (alloc_from(pools[i], size, offset) == 0) {
+      *shm_pool = pools[i];
+      pthread_mutex_unlock(&pool->lock);
+      return 0;
+    }
+  }
+
+  struct twl_shm_pool *last = n ? pools[n - 1] : NULL;
+  if (last == NULL || grow(pool, last, size) != 0) {
+    last = add_pool(pool);
+    if (last == NULL || grow(pool, last, size) != 0) {
+      pthread_mutex_unlock(&pool->lock);
+      return -1;
+    }
+  }
+
+  // The grown tail is large enough
+  alloc_from(last, size, offset);
+  *shm_pool = last;
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+static void free_locked(struct twl_shm_pool *shm_pool, uint32_t offset, uint32_t size) {
+  if (size == 0)
+    return;
+
+  struct twl_pool_range *ranges = shm_pool->free_ranges.data;
+  uint32_t n = num_ranges(shm_pool);
+
+  uint32_t i = 0;
+  while (i < n && ranges[i].offset < offset)
+    ++i;
+
+  int merge_prev = i > 0 && ranges[i - 1].offset + ranges[i - 1].size == offset;
+  int merge_next = i < n && offset + size == ranges[i].offset;
+
+  if (merge_prev && merge_next) {
+    ranges[i - 1].size += size + ranges[i].size;
+    remove_range(shm_pool, i);
+  } else if (merge_prev) {
+    ranges[i - 1].size += size;
+  } else if (merge_next) {
+    ranges[i].offset = offset;
+    ranges[i].size += size;
+  } else {
+    insert_range(shm_pool, i, offset, size);
+  }
+}
+
+void twl_pool_free(struct twl_buffer_pool *pool, struct twl_shm_pool *shm_pool, uint32_t offset, uint32_t size) {
+  if (shm_pool == NULL)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  free_locked(shm_pool, offset, size);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void twl_pool_trim(struct twl_buffer_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+
+  // Free ranges keep their pages until the kernel is told otherwise; punching a hole
+  // returns them without shrinking the pool, so offsets held by others stay valid.
+  struct twl_shm_pool **shm_pool;
+  wl_array_for_each(shm_pool, &pool->pools) {
+    struct twl_pool_range *ranges = (*shm_pool)->free_ranges.data;
+    uint32_t n = num_ranges(*shm_pool);
+    for (uint32_t i = 0; i < n && (*shm_pool)->fd >= 0; ++i) {
+      fallocate((*shm_pool)->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ranges[i].offset, ranges[i].size);
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void twl_pool_destroy(struct twl_buffer_pool *pool) {
+  struct twl_shm_pool **shm_pool;
+  wl_array_for_each(shm_pool, &pool->pools) {
+    if ((*shm_pool)->wl_shm_pool)
+      wl_shm_pool_destroy((*shm_pool)->wl_shm_pool);
+    if ((*shm_pool)->fd >= 0)
+      close((*shm_pool)->fd);
+    wl_array_release(&(*shm_pool)->free_ranges);
+    free(*shm_pool);
+  }
+  wl_array_release(&pool->pools);
+  pthread_mutex_destroy(&pool->lock);
+  memset(pool, 0, sizeof(struct twl_buffer_pool));
+}
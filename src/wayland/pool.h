@@ -0,0 +1,24 @@
+#ifndef __TWL_POOL_H__
+#define __TWL_POOL_H__
+
+#include "wayland.h"
+
+struct twl_pool_range {
+  uint32_t offset;
+  uint32_t size;
+};
+
+// Shared wl_shm_pools with a first-fit range allocator.
+// Pools only ever grow; freed ranges are merged with their neighbours. The last pool doubles
+// until the int32 limit of wl_shm, then a new one is started.
+// The shm files are created lazily by the allocations.
+// All functions are safe to call from render threads.
+void twl_pool_init(struct twl_buffer_pool *pool, struct wl_shm *wl_shm);
+// Returns -1 if the range doesn't fit a pool or the shm file can't grow
+int twl_pool_alloc(struct twl_buffer_pool *pool, uint32_t size, struct twl_shm_pool **shm_pool, uint32_t *offset);
+void twl_pool_free(struct twl_buffer_pool *pool, struct twl_shm_pool *shm_pool, uint32_t offset, uint32_t size);
+// Returns the memory of the free ranges to the kernel
+void twl_pool_trim(struct twl_buffer_pool *pool);
+void twl_pool_destroy(struct twl_buffer_pool *pool);
+
+#endif
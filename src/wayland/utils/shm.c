@@ -58,11 +58,8 @@ int twl_shm_resize(int fd, size_t size) {
     }
   } while (ret < 0 && errno == EINTR);
 
-  if (ret < 0) {
-    close(fd);
-    return -1;
-  }
-  return 0;
+  // The fd is the caller's: a pool that failed to grow keeps using it at its old size
+  return ret < 0 ? -1 : 0;
 }
 
 int twl_shm_close(int fd) { return close(fd); }
@@ -2,4 +2,5 @@
 
 // returns fd
 int twl_shm_allocate(size_t size);
+// fd stays open when it fails
 int twl_shm_resize(int fd, size_t size);
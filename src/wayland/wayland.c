@@ -1,17 +1,54 @@
 #include "wayland.h"
 #include "../wayland-protocols/xdg-shell-protocol.h"
-#include "utils/shm.h"
-#include <assert.h>
+#include "../render/raster.h"
+#include "pool.h"
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 #include <wayland-client.h>
 
 #define panic(text) { printf(text); exit(-1); }
 #define try_or_panic(val, text) { if((val) != 0) panic(text) }
 #define zero_init(var, type) memset(var, 0, sizeof(type))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+// Adaptive resolution
+#define RENDER_SCALE_MIN 50
+#define RENDER_SCALE_STEP 25
+#define OVER_BUDGET_FRAMES 3
+#define UNDER_BUDGET_FRAMES 60
+#define IDLE_RESTORE_NS 250000000ull
+
+// A frame callback that doesn't fire for this long means the window isn't being repainted
+#define OCCLUDED_NS 1000000000ull
+
+// Pool space a window reserves for growing up to its bounds, shared by its buffers
+#define MAX_RESERVE_SIZE (256u << 20)
+
+// Keys and feedback waiting for a render thread, keys past it are dropped
+#define MAX_PENDING_EVENTS 1024
+
+// wl_shm format of every enum twl_format
+static const uint32_t shm_formats[TWL_FORMAT_COUNT] = {
+    [TWL_FORMAT_XRGB8888] = WL_SHM_FORMAT_XRGB8888,
+    [TWL_FORMAT_RGB565] = WL_SHM_FORMAT_RGB565,
+    [TWL_FORMAT_ARGB8888] = WL_SHM_FORMAT_ARGB8888,
+};
+
+// A frame that showed input (or the first frame, for the startup trace), waiting for its presentation feedback
+struct twl_feedback {
+  struct twl_window *win;
+  struct wp_presentation_feedback *wp_feedback;
+  uint64_t input_ns;
+  struct wl_list link; // twl_window.feedbacks
+};
 
 // Functions
 // =========
@@ -20,16 +57,82 @@
 static void cb_wl_registry_global_add(void *data, struct wl_registry *wl_registry, uint32_t name, const char *interface, uint32_t version);
 static void cb_wl_registry_global_remove(void *data, struct wl_registry *wl_registry, uint32_t name);
 static void cb_xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial);
+static void cb_wl_shm_format(void *data, struct wl_shm *wl_shm, uint32_t format);
 static void cb_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial);
 static void cb_wl_buffer_release(void *data, struct wl_buffer *wl_buffer);
+static void cb_wl_callback_frame_done(void *data, struct wl_callback *wl_callback, uint32_t time);
 static void cb_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states);
 static void cb_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel);
 static void cb_xdg_toplevel_configure_bounds(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height);
 static void cb_xdg_toplevel_wm_capabilities(void *data, struct xdg_toplevel *xdg_toplevel, struct wl_array *capabilities);
+static void cb_wl_surface_enter(void *data, struct wl_surface *wl_surface, struct wl_output *wl_output);
+static void cb_wl_surface_leave(void *data, struct wl_surface *wl_surface, struct wl_output *wl_output);
+static void cb_wl_output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y, int32_t physical_width, int32_t physical_height,
+                                  int32_t subpixel, const char *make, const char *model, int32_t transform);
+static void cb_wl_output_mode(void *data, struct wl_output *wl_output, uint32_t flags, int32_t width, int32_t height, int32_t refresh);
+static void cb_wl_output_done(void *data, struct wl_output *wl_output);
+static void cb_wl_output_scale(void *data, struct wl_output *wl_output, int32_t factor);
+static void cb_wp_fractional_scale_preferred_scale(void *data, struct wp_fractional_scale_v1 *wp_fractional_scale_v1, uint32_t scale);
+static void cb_wl_seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t capabilities);
+static void cb_wl_seat_name(void *data, struct wl_seat *wl_seat, const char *name);
+static void cb_wl_keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard, uint32_t format, int32_t fd, uint32_t size);
+static void cb_wl_keyboard_enter(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface, struct wl_array *keys);
+static void cb_wl_keyboard_leave(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface);
+static void cb_wl_keyboard_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, uint32_t time, uint32_t key, uint32_t state);
+static void cb_wl_keyboard_modifiers(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, uint32_t depressed, uint32_t latched,
+                                     uint32_t locked, uint32_t group);
+static void cb_wl_keyboard_repeat_info(void *data, struct wl_keyboard *wl_keyboard, int32_t rate, int32_t delay);
+static void cb_key_repeat(void *data, int fd);
+static void cb_wake(void *data, int fd);
+static void cb_wp_presentation_clock_id(void *data, struct wp_presentation *wp_presentation, uint32_t clk_id);
+static void cb_wp_presentation_feedback_sync_output(void *data, struct wp_presentation_feedback *feedback, struct wl_output *output);
+static void cb_wp_presentation_feedback_presented(void *data, struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                                                  uint32_t tv_nsec, uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags);
+static void cb_wp_presentation_feedback_discarded(void *data, struct wp_presentation_feedback *feedback);
+static void cb_wl_pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y);
+static void cb_wl_pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface);
+static void cb_wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t x, wl_fixed_t y);
+static void cb_wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state);
+static void cb_wl_pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value);
+static void cb_wl_pointer_frame(void *data, struct wl_pointer *wl_pointer);
+static void cb_wl_pointer_axis_source(void *data, struct wl_pointer *wl_pointer, uint32_t axis_source);
+static void cb_wl_pointer_axis_stop(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis);
+static void cb_wl_pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer, uint32_t axis, int32_t discrete);
 
 // Library
 static void configure_buffers(struct twl_window *win);
+static void preallocate_buffers(struct twl_window *win);
+static void configure_layer_buffers(struct twl_layer *layer);
+static void draw_layer(struct twl_layer *layer);
 static void draw_frame(struct twl_window *win);
+static void apply_configure(struct twl_window *win);
+static void handle_configure(struct twl_window *win, uint32_t serial, const struct twl_window_config *config);
+static void handle_buffer_release(struct twl_window *win, struct wl_buffer *wl_buffer);
+static void handle_frame_done(struct twl_window *win, struct wl_callback *wl_callback);
+static void handle_scale(struct twl_window *win, uint32_t scale120);
+static void handle_subpixel(struct twl_window *win, enum twl_subpixel subpixel);
+static void handle_key(struct twl_window *win, const struct twl_key_event *event);
+static void handle_pointer(struct twl_window *win, const struct twl_pointer_event *event);
+static void handle_pointer_batched(struct twl_window *win, uint64_t time_ns);
+static void handle_presented(struct twl_window *win, struct twl_feedback *feedback, uint64_t present_ns);
+static void set_scale(struct twl_window *win, uint32_t scale120);
+static void update_outputs(struct twl_window *win);
+static uint64_t now_ns();
+static void hide_window(struct twl_window *win);
+static void show_window(struct twl_window *win);
+static int occlusion_timeout(struct twl_window *win);
+static void check_occlusion(struct twl_window *win);
+static void trace_presented(struct twl_window *win, uint64_t present_ns);
+
+// Threading
+static void push_proxy(struct wl_array *array, void *proxy);
+static void post_event(struct twl_window *win, const struct twl_event *event);
+static void post_pointer(struct twl_window *win, const struct twl_pointer_event *event);
+static void take_pointer_batch(struct twl_mailbox *mailbox, struct twl_pointer_batch *batch);
+static int start_render_thread(struct twl_window *win);
+static void stop_render_thread(struct twl_window *win);
+static int start_prepare_thread(twl_prepare_fn prepare_fn, void *user_data, pthread_t *thread);
+static void finish_prepare(struct twl_window *win);
 
 // Wayland Listeners
 // =================
@@ -43,10 +146,18 @@ static const struct xdg_wm_base_listener xdg_wm_base_listener = {
     .ping = cb_xdg_wm_base_ping,
 };
 
+static const struct wl_shm_listener wl_shm_listener = {
+    .format = cb_wl_shm_format,
+};
+
 static const struct wl_buffer_listener wl_buffer_listener = {
     .release = cb_wl_buffer_release,
 };
 
+static const struct wl_callback_listener wl_callback_frame_listener = {
+    .done = cb_wl_callback_frame_done,
+};
+
 static const struct xdg_surface_listener xdg_surface_listener = {
     .configure = cb_xdg_surface_configure,
 };
@@ -58,6 +169,60 @@ static const struct xdg_toplevel_listener xdg_toplevel_listener = {
     .wm_capabilities = cb_xdg_toplevel_wm_capabilities,
 };
 
+static const struct wl_surface_listener wl_surface_listener = {
+    .enter = cb_wl_surface_enter,
+    .leave = cb_wl_surface_leave,
+};
+
+// Bound at version 2, name and description are never sent
+static const struct wl_output_listener wl_output_listener = {
+    .geometry = cb_wl_output_geometry,
+    .mode = cb_wl_output_mode,
+    .done = cb_wl_output_done,
+    .scale = cb_wl_output_scale,
+};
+
+static const struct wp_fractional_scale_v1_listener wp_fractional_scale_listener = {
+    .preferred_scale = cb_wp_fractional_scale_preferred_scale,
+};
+
+static const struct wp_presentation_listener wp_presentation_listener = {
+    .clock_id = cb_wp_presentation_clock_id,
+};
+
+static const struct wp_presentation_feedback_listener wp_presentation_feedback_listener = {
+    .sync_output = cb_wp_presentation_feedback_sync_output,
+    .presented = cb_wp_presentation_feedback_presented,
+    .discarded = cb_wp_presentation_feedback_discarded,
+};
+
+static const struct wl_seat_listener wl_seat_listener = {
+    .capabilities = cb_wl_seat_capabilities,
+    .name = cb_wl_seat_name,
+};
+
+static const struct wl_keyboard_listener wl_keyboard_listener = {
+    .keymap = cb_wl_keyboard_keymap,
+    .enter = cb_wl_keyboard_enter,
+    .leave = cb_wl_keyboard_leave,
+    .key = cb_wl_keyboard_key,
+    .modifiers = cb_wl_keyboard_modifiers,
+    .repeat_info = cb_wl_keyboard_repeat_info,
+};
+
+// Bound at version 7 at most, value120 and later events are never sent
+static const struct wl_pointer_listener wl_pointer_listener = {
+    .enter = cb_wl_pointer_enter,
+    .leave = cb_wl_pointer_leave,
+    .motion = cb_wl_pointer_motion,
+    .button = cb_wl_pointer_button,
+    .axis = cb_wl_pointer_axis,
+    .frame = cb_wl_pointer_frame,
+    .axis_source = cb_wl_pointer_axis_source,
+    .axis_stop = cb_wl_pointer_axis_stop,
+    .axis_discrete = cb_wl_pointer_axis_discrete,
+};
+
 // Implementation: Wayland Callbacks
 // =================================
 
@@ -65,34 +230,120 @@ static void cb_wl_registry_global_add(void *data, struct wl_registry *wl_registr
   struct twl_context *ctx = data;
 
   if (strcmp(interface, wl_shm_interface.name) == 0) {
-    ctx->wl_shm = wl_registry_bind(wl_registry, name, &wl_shm_interface, version);
+    ctx->wl_shm = wl_registry_bind(wl_registry, name, &wl_shm_interface, MIN(version, 1));
+    wl_shm_add_listener(ctx->wl_shm, &wl_shm_listener, ctx);
   } else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
-    ctx->xdg_wm_base = wl_registry_bind(wl_registry, name, &xdg_wm_base_interface, version);
+    // v6 adds the suspended state
+    ctx->xdg_wm_base = wl_registry_bind(wl_registry, name, &xdg_wm_base_interface, MIN(version, 6));
   } else if (strcmp(interface, wl_compositor_interface.name) == 0) {
-    ctx->wl_compositor = wl_registry_bind(wl_registry, name, &wl_compositor_interface, version);
+    // v5+ surfaces send events our wl_surface_listener doesn't know about
+    ctx->wl_compositor = wl_registry_bind(wl_registry, name, &wl_compositor_interface, MIN(version, 4));
+  } else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+    ctx->wl_subcompositor = wl_registry_bind(wl_registry, name, &wl_subcompositor_interface, 1);
+  } else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+    ctx->wp_single_pixel_buffer_manager = wl_registry_bind(wl_registry, name, &wp_single_pixel_buffer_manager_v1_interface, 1);
+  } else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+    ctx->wp_presentation = wl_registry_bind(wl_registry, name, &wp_presentation_interface, 1);
+    wp_presentation_add_listener(ctx->wp_presentation, &wp_presentation_listener, ctx);
+  } else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+    ctx->wp_viewporter = wl_registry_bind(wl_registry, name, &wp_viewporter_interface, 1);
+  } else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+    ctx->wp_fractional_scale_manager = wl_registry_bind(wl_registry, name, &wp_fractional_scale_manager_v1_interface, 1);
+  } else if (strcmp(interface, wl_data_device_manager_interface.name) == 0) {
+    // v3 adds drag-and-drop actions and wl_data_offer.finish
+    ctx->wl_data_device_manager = wl_registry_bind(wl_registry, name, &wl_data_device_manager_interface, MIN(version, 3));
+  } else if (strcmp(interface, wl_seat_interface.name) == 0 && ctx->wl_seat == NULL) {
+    // v7 keymaps must be mapped private
+    ctx->wl_seat = wl_registry_bind(wl_registry, name, &wl_seat_interface, MIN(version, 7));
+    wl_seat_add_listener(ctx->wl_seat, &wl_seat_listener, ctx);
+  } else if (strcmp(interface, wl_output_interface.name) == 0 && version >= 2) {
+    struct twl_output *output = calloc(1, sizeof(struct twl_output));
+    if (output == NULL)
+      return;
+    output->ctx = ctx;
+    output->name = name;
+    output->scale = 1;
+    output->wl_output = wl_registry_bind(wl_registry, name, &wl_output_interface, 2);
+    wl_output_add_listener(output->wl_output, &wl_output_listener, output);
+    wl_list_insert(&ctx->outputs, &output->link);
+  }
+}
+
+static void remove_window_output(struct twl_window *win, struct twl_output *output) {
+  struct twl_output **entry;
+  wl_array_for_each(entry, &win->outputs) {
+    if (*entry == output) {
+      // Swap with the last entry, order doesn't matter
+      struct twl_output **last = (struct twl_output **)((char *)win->outputs.data + win->outputs.size) - 1;
+      *entry = *last;
+      win->outputs.size -= sizeof(struct twl_output *);
+      update_outputs(win);
+      return;
+    }
   }
 }
 
-static void cb_wl_registry_global_remove(void *data, struct wl_registry *wl_registry, uint32_t name) { /* todo */ }
+static void cb_wl_registry_global_remove(void *data, struct wl_registry *wl_registry, uint32_t name) {
+  struct twl_context *ctx = data;
+
+  // Only outputs come and go in practice
+  struct twl_output *output, *tmp;
+  wl_list_for_each_safe(output, tmp, &ctx->outputs, link) {
+    if (output->name != name)
+      continue;
+
+    struct twl_window *win;
+    wl_list_for_each(win, &ctx->windows, link) { remove_window_output(win, output); }
+
+    wl_output_destroy(output->wl_output);
+    wl_list_remove(&output->link);
+    free(output);
+  }
+}
 
 static void cb_xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial) {
   xdg_wm_base_pong(xdg_wm_base, serial); //
 }
 
+static void cb_wl_shm_format(void *data, struct wl_shm *wl_shm, uint32_t format) {
+  struct twl_context *ctx = data;
+  for (uint32_t i = 0; i < TWL_FORMAT_COUNT; ++i) {
+    if (shm_formats[i] == format)
+      ctx->shm_formats |= 1u << i;
+  }
+}
+
 static void cb_wl_buffer_release(void *data, struct wl_buffer *wl_buffer) {
   struct twl_window *win = data;
-  win->buffer.in_use = 0;
+  if (win->ctx->threaded) {
+    struct twl_event event = {.type = TWL_EVENT_BUFFER_RELEASE, .proxy = wl_buffer};
+    post_event(win, &event);
+    return;
+  }
+  handle_buffer_release(win, wl_buffer);
 }
 
-static void cb_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+// Layers' callbacks go to their window too, handle_frame_done() finds the layer by its callback
+static void cb_wl_callback_frame_done(void *data, struct wl_callback *wl_callback, uint32_t time) {
   struct twl_window *win = data;
-  win->config = win->config_pending;
-
-  xdg_surface_ack_configure(xdg_surface, serial);
-
-  configure_buffers(win);
+  if (win->ctx->threaded) {
+    struct twl_event event = {.type = TWL_EVENT_FRAME_DONE, .proxy = wl_callback};
+    post_event(win, &event);
+    return;
+  }
+  handle_frame_done(win, wl_callback);
+}
 
-  draw_frame(win);
+static void cb_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+  struct twl_window *win = data;
+  twl_startup_mark(&win->ctx->startup.configure_ns, now_ns());
+  if (win->ctx->threaded) {
+    // Acked by the render thread, right before it commits the matching buffer
+    struct twl_event event = {.type = TWL_EVENT_CONFIGURE, .serial = serial, .config = win->config_pending};
+    post_event(win, &event);
+    return;
+  }
+  handle_configure(win, serial, &win->config_pending);
 }
 
 static void cb_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states) {
@@ -106,6 +357,8 @@ static void cb_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_tople
 
   win->config_pending.width = width;
   win->config_pending.height = height;
+  win->config_pending.bounds_width = win->bounds_width;
+  win->config_pending.bounds_height = win->bounds_height;
 
   uint32_t *state;
   wl_array_for_each(state, states) {
@@ -122,7 +375,9 @@ static void cb_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_tople
     case XDG_TOPLEVEL_STATE_FULLSCREEN:
       win->config_pending.is_fullscreen = 1;
       break;
-      // TODO: Suspended
+    case XDG_TOPLEVEL_STATE_SUSPENDED:
+      win->config_pending.is_suspended = 1;
+      break;
     }
   }
 }
@@ -133,13 +388,367 @@ static void cb_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
 }
 
 static void cb_xdg_toplevel_configure_bounds(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height) {
-  // TODO
+  struct twl_window *win = data;
+  // Sent ahead of the configure it belongs to, latched until the compositor changes it.
+  win->bounds_width = width;
+  win->bounds_height = height;
 }
 
 static void cb_xdg_toplevel_wm_capabilities(void *data, struct xdg_toplevel *xdg_toplevel, struct wl_array *capabilities) {
   // TODO
 }
 
+static void cb_wl_surface_enter(void *data, struct wl_surface *wl_surface, struct wl_output *wl_output) {
+  struct twl_window *win = data;
+  struct twl_output *output = wl_output_get_user_data(wl_output);
+  if (output == NULL)
+    return;
+
+  struct twl_output **entry = wl_array_add(&win->outputs, sizeof(struct twl_output *));
+  if (entry == NULL)
+    return;
+  *entry = output;
+  update_outputs(win);
+}
+
+static void cb_wl_surface_leave(void *data, struct wl_surface *wl_surface, struct wl_output *wl_output) {
+  struct twl_window *win = data;
+  struct twl_output *output = wl_output_get_user_data(wl_output);
+  remove_window_output(win, output);
+}
+
+static void cb_wl_output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y, int32_t physical_width, int32_t physical_height,
+                                  int32_t subpixel, const char *make, const char *model, int32_t transform) {
+  struct twl_output *output = data;
+
+  // Quarter turns make the subpixels vertical, a half turn or a mirror reverses their order
+  int flipped = transform == WL_OUTPUT_TRANSFORM_180 || transform == WL_OUTPUT_TRANSFORM_FLIPPED;
+  if (transform != WL_OUTPUT_TRANSFORM_NORMAL && transform != WL_OUTPUT_TRANSFORM_FLIPPED_180 && !flipped)
+    output->subpixel = TWL_SUBPIXEL_NONE;
+  else if (subpixel == WL_OUTPUT_SUBPIXEL_HORIZONTAL_RGB)
+    output->subpixel = flipped ? TWL_SUBPIXEL_BGR : TWL_SUBPIXEL_RGB;
+  else if (subpixel == WL_OUTPUT_SUBPIXEL_HORIZONTAL_BGR)
+    output->subpixel = flipped ? TWL_SUBPIXEL_RGB : TWL_SUBPIXEL_BGR;
+  else
+    output->subpixel = TWL_SUBPIXEL_NONE;
+}
+
+static void cb_wl_output_mode(void *data, struct wl_output *wl_output, uint32_t flags, int32_t width, int32_t height, int32_t refresh) {}
+
+static void cb_wl_output_done(void *data, struct wl_output *wl_output) {
+  struct twl_output *output = data;
+
+  struct twl_window *win;
+  wl_list_for_each(win, &output->ctx->windows, link) {
+    struct twl_output **entry;
+    wl_array_for_each(entry, &win->outputs) {
+      if (*entry == output)
+        update_outputs(win);
+    }
+  }
+}
+
+static void cb_wl_output_scale(void *data, struct wl_output *wl_output, int32_t factor) {
+  struct twl_output *output = data;
+  output->scale = factor;
+}
+
+static void cb_wp_fractional_scale_preferred_scale(void *data, struct wp_fractional_scale_v1 *wp_fractional_scale_v1, uint32_t scale) {
+  struct twl_window *win = data;
+  set_scale(win, scale);
+}
+
+static void cb_wp_presentation_clock_id(void *data, struct wp_presentation *wp_presentation, uint32_t clk_id) {
+  struct twl_context *ctx = data;
+  ctx->presentation_clock = clk_id;
+}
+
+static void cb_wp_presentation_feedback_sync_output(void *data, struct wp_presentation_feedback *feedback, struct wl_output *output) {}
+
+static void post_presented(struct twl_feedback *feedback, uint64_t present_ns) {
+  struct twl_window *win = feedback->win;
+  if (win->ctx->threaded) {
+    // The feedback belongs to the render thread, which also frees it
+    struct twl_event event = {.type = TWL_EVENT_PRESENTED, .proxy = feedback, .time_ns = present_ns};
+    post_event(win, &event);
+    return;
+  }
+  handle_presented(win, feedback, present_ns);
+}
+
+static void cb_wp_presentation_feedback_presented(void *data, struct wp_presentation_feedback *wp_feedback, uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                                                  uint32_t tv_nsec, uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+  struct twl_feedback *feedback = data;
+  struct twl_context *ctx = feedback->win->ctx;
+
+  uint64_t present_ns = (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ull + tv_nsec;
+
+  // Input times are CLOCK_MONOTONIC, move the timestamp over if the compositor uses another clock
+  if (ctx->presentation_clock != CLOCK_MONOTONIC) {
+    struct timespec ts;
+    clock_gettime(ctx->presentation_clock, &ts);
+    uint64_t clock_now = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    present_ns = present_ns - clock_now + now_ns();
+  }
+
+  post_presented(feedback, present_ns);
+}
+
+static void cb_wp_presentation_feedback_discarded(void *data, struct wp_presentation_feedback *wp_feedback) {
+  post_presented(data, 0); //
+}
+
+static void release_keyboard(struct twl_context *ctx) {
+  if (ctx->wl_keyboard == NULL)
+    return;
+
+  twl_unwatch_fd(ctx, ctx->keyboard.repeat_fd);
+  twl_keyboard_destroy(&ctx->keyboard);
+  if (wl_keyboard_get_version(ctx->wl_keyboard) >= 3)
+    wl_keyboard_release(ctx->wl_keyboard);
+  else
+    wl_keyboard_destroy(ctx->wl_keyboard);
+  ctx->wl_keyboard = NULL;
+  ctx->keyboard_focus = NULL;
+}
+
+static void release_pointer(struct twl_context *ctx) {
+  if (ctx->wl_pointer == NULL)
+    return;
+
+  if (wl_pointer_get_version(ctx->wl_pointer) >= 3)
+    wl_pointer_release(ctx->wl_pointer);
+  else
+    wl_pointer_destroy(ctx->wl_pointer);
+  ctx->wl_pointer = NULL;
+  ctx->pointer_focus = NULL;
+  zero_init(&ctx->pointer_event, struct twl_pointer_event);
+}
+
+static void cb_wl_seat_capabilities(void *data, struct wl_seat *wl_seat, uint32_t capabilities) {
+  struct twl_context *ctx = data;
+
+  if ((capabilities & WL_SEAT_CAPABILITY_KEYBOARD) && ctx->wl_keyboard == NULL) {
+    if (twl_keyboard_init(&ctx->keyboard) != 0) {
+      return;
+    }
+    ctx->wl_keyboard = wl_seat_get_keyboard(wl_seat);
+    wl_keyboard_add_listener(ctx->wl_keyboard, &wl_keyboard_listener, ctx);
+    twl_watch_fd(ctx, ctx->keyboard.repeat_fd, POLLIN, cb_key_repeat, ctx);
+  } else if (!(capabilities & WL_SEAT_CAPABILITY_KEYBOARD)) {
+    release_keyboard(ctx);
+  }
+
+  if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && ctx->wl_pointer == NULL) {
+    ctx->wl_pointer = wl_seat_get_pointer(wl_seat);
+    wl_pointer_add_listener(ctx->wl_pointer, &wl_pointer_listener, ctx);
+  } else if (!(capabilities & WL_SEAT_CAPABILITY_POINTER)) {
+    release_pointer(ctx);
+  }
+}
+
+static void cb_wl_seat_name(void *data, struct wl_seat *wl_seat, const char *name) {}
+
+static void cb_wl_keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard, uint32_t format, int32_t fd, uint32_t size) {
+  struct twl_context *ctx = data;
+
+  if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
+    close(fd);
+    return;
+  }
+
+  if (twl_keyboard_set_keymap(&ctx->keyboard, fd, size) != 0) {
+    printf("Failed to compile the keymap\n");
+  }
+}
+
+static void cb_wl_keyboard_enter(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface, struct wl_array *keys) {
+  struct twl_context *ctx = data;
+  ctx->input_serial = serial;
+  // Only toplevel surfaces take the focus, their user data is the window
+  ctx->keyboard_focus = surface ? wl_surface_get_user_data(surface) : NULL;
+}
+
+static void cb_wl_keyboard_leave(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, struct wl_surface *surface) {
+  struct twl_context *ctx = data;
+  ctx->keyboard_focus = NULL;
+  twl_keyboard_stop_repeat(&ctx->keyboard);
+}
+
+// Input is read on the loop's thread and handed to the thread that draws the window
+static void deliver_key(struct twl_window *win, const struct twl_key_event *event) {
+  if (win->ctx->threaded) {
+    struct twl_event twl_event = {.type = TWL_EVENT_KEY, .key = *event};
+    post_event(win, &twl_event);
+    return;
+  }
+  handle_key(win, event);
+}
+
+static void cb_wl_keyboard_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, uint32_t time, uint32_t key, uint32_t state) {
+  struct twl_context *ctx = data;
+  struct twl_keyboard *kb = &ctx->keyboard;
+  ctx->input_serial = serial;
+
+  // The compositor's timestamps have no defined base, ours are comparable with the frame times.
+  struct twl_key_event event;
+  int pressed = state == WL_KEYBOARD_KEY_STATE_PRESSED;
+  twl_keyboard_translate(kb, key, pressed ? TWL_KEY_PRESSED : TWL_KEY_RELEASED, &event);
+  event.time_ns = now_ns();
+
+  if (pressed)
+    twl_keyboard_start_repeat(kb, key);
+  else if (key == kb->repeat_key)
+    twl_keyboard_stop_repeat(kb);
+
+  if (ctx->keyboard_focus)
+    deliver_key(ctx->keyboard_focus, &event);
+}
+
+static void cb_wl_keyboard_modifiers(void *data, struct wl_keyboard *wl_keyboard, uint32_t serial, uint32_t depressed, uint32_t latched,
+                                     uint32_t locked, uint32_t group) {
+  struct twl_context *ctx = data;
+  twl_keyboard_set_modifiers(&ctx->keyboard, depressed, latched, locked, group);
+}
+
+static void cb_wl_keyboard_repeat_info(void *data, struct wl_keyboard *wl_keyboard, int32_t rate, int32_t delay) {
+  struct twl_context *ctx = data;
+  ctx->keyboard.repeat_rate = rate;
+  ctx->keyboard.repeat_delay = delay;
+}
+
+static void deliver_pointer(struct twl_window *win, const struct twl_pointer_event *event) {
+  if (win->ctx->threaded) {
+    post_pointer(win, event);
+    return;
+  }
+  handle_pointer(win, event);
+}
+
+// Hands the events collected since the last wl_pointer.frame to the focused window
+static void flush_pointer_event(struct twl_context *ctx) {
+  struct twl_pointer_event *event = &ctx->pointer_event;
+  if (event->changes && ctx->pointer_focus) {
+    event->time_ns = now_ns();
+    deliver_pointer(ctx->pointer_focus, event);
+  }
+  zero_init(event, struct twl_pointer_event);
+}
+
+// Before v5 there is no wl_pointer.frame, every event stands alone
+static void end_pointer_event(struct twl_context *ctx) {
+  if (wl_pointer_get_version(ctx->wl_pointer) < 5)
+    flush_pointer_event(ctx);
+}
+
+static void cb_wl_pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y) {
+  struct twl_context *ctx = data;
+  struct twl_window *win = surface ? wl_surface_get_user_data(surface) : NULL;
+
+  ctx->pointer_focus = win;
+  ctx->pointer_offset_x = 0;
+  ctx->pointer_offset_y = 0;
+  if (win == NULL)
+    return;
+
+  // Layers report layer-local positions. They belong to the render thread in threaded mode.
+  struct twl_layer *layer;
+  pthread_mutex_lock(&win->layer_lock);
+  wl_list_for_each(layer, &win->layers, link) {
+    if (layer->wl_surface == surface) {
+      ctx->pointer_offset_x = layer->x;
+      ctx->pointer_offset_y = layer->y;
+    }
+  }
+  pthread_mutex_unlock(&win->layer_lock);
+
+  ctx->pointer_event.changes |= TWL_POINTER_ENTER;
+  ctx->pointer_event.x = wl_fixed_to_double(x) + ctx->pointer_offset_x;
+  ctx->pointer_event.y = wl_fixed_to_double(y) + ctx->pointer_offset_y;
+  end_pointer_event(ctx);
+}
+
+static void cb_wl_pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface) {
+  struct twl_context *ctx = data;
+
+  // Moving between a window and its layers is a leave and an enter in one frame: the
+  // leave goes to the old focus now, the enter opens the next event.
+  ctx->pointer_event.changes |= TWL_POINTER_LEAVE;
+  flush_pointer_event(ctx);
+  ctx->pointer_focus = NULL;
+}
+
+static void cb_wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t x, wl_fixed_t y) {
+  struct twl_context *ctx = data;
+  ctx->pointer_event.changes |= TWL_POINTER_MOTION;
+  ctx->pointer_event.x = wl_fixed_to_double(x) + ctx->pointer_offset_x;
+  ctx->pointer_event.y = wl_fixed_to_double(y) + ctx->pointer_offset_y;
+  end_pointer_event(ctx);
+}
+
+static void cb_wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
+  struct twl_context *ctx = data;
+  ctx->input_serial = serial;
+
+  // One button per event, a second one in the same frame starts a new event
+  if (ctx->pointer_event.changes & TWL_POINTER_BUTTON)
+    flush_pointer_event(ctx);
+
+  ctx->pointer_event.changes |= TWL_POINTER_BUTTON;
+  ctx->pointer_event.button = button;
+  ctx->pointer_event.button_state = state;
+  end_pointer_event(ctx);
+}
+
+static void cb_wl_pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value) {
+  struct twl_context *ctx = data;
+  if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+    return;
+  ctx->pointer_event.changes |= TWL_POINTER_AXIS;
+  ctx->pointer_event.axis[axis] += wl_fixed_to_double(value);
+  end_pointer_event(ctx);
+}
+
+static void cb_wl_pointer_frame(void *data, struct wl_pointer *wl_pointer) {
+  struct twl_context *ctx = data;
+  flush_pointer_event(ctx);
+}
+
+static void cb_wl_pointer_axis_source(void *data, struct wl_pointer *wl_pointer, uint32_t axis_source) {}
+
+static void cb_wl_pointer_axis_stop(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis) {}
+
+static void cb_wl_pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer, uint32_t axis, int32_t discrete) {
+  struct twl_context *ctx = data;
+  if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+    return;
+  ctx->pointer_event.changes |= TWL_POINTER_AXIS;
+  ctx->pointer_event.axis_discrete[axis] += discrete;
+}
+
+static void cb_key_repeat(void *data, int fd) {
+  struct twl_context *ctx = data;
+  struct twl_keyboard *kb = &ctx->keyboard;
+
+  uint64_t count = twl_keyboard_read_repeat(kb);
+  if (count == 0 || ctx->keyboard_focus == NULL)
+    return;
+
+  struct twl_key_event event;
+  twl_keyboard_translate(kb, kb->repeat_key, TWL_KEY_REPEATED, &event);
+  event.time_ns = now_ns();
+
+  // Repeats missed by a stalled loop are still delivered, text input mustn't lose keys
+  for (uint64_t i = 0; i < count; ++i) {
+    deliver_key(ctx->keyboard_focus, &event);
+  }
+}
+
+static void cb_wake(void *data, int fd) {
+  uint64_t count;
+  read(fd, &count, sizeof(count)); // the poll is rebuilt with the new watches either way
+}
+
 // Implementation: Library
 // =======================
 
@@ -149,98 +758,311 @@ static size_t align_to_pagesize(size_t size) {
   return size;
 }
 
-static void configure_buffers(struct twl_window *win) {
-  uint32_t width = win->config.width;
-  uint32_t height = win->config.height;
-  uint32_t stride = width * 4;
-  uint32_t format = WL_SHM_FORMAT_XRGB8888;
+// The pool range and its mapping outlive the wl_buffer, resizes within the capacity reuse them.
+static void destroy_buffer(struct twl_context *ctx, struct twl_buffer *buffer) {
+  if (buffer->wl_buffer)
+    wl_buffer_destroy(buffer->wl_buffer);
+  buffer->wl_buffer = NULL;
+  buffer->in_use = 0;
+}
+
+static void release_buffer(struct twl_context *ctx, struct twl_buffer *buffer) {
+  destroy_buffer(ctx, buffer);
+  try_or_panic(fzn_mmap_unmap(&buffer->mmap), "munmap back buffer");
+  twl_pool_free(&ctx->pool, buffer->shm_pool, buffer->offset, buffer->capacity);
+  buffer->shm_pool = NULL;
+  buffer->capacity = 0;
+}
+
+// A buffer the compositor hasn't released may still be read: its range can't be reused before.
+// Left to the window until then, `buffer` is empty after.
+static void retire_buffer(struct twl_window *win, struct twl_buffer *buffer) {
+  struct twl_buffer *retired = buffer->in_use ? wl_array_add(&win->retired_buffers, sizeof(struct twl_buffer)) : NULL;
+  if (retired == NULL) {
+    release_buffer(win->ctx, buffer);
+    return;
+  }
+  *retired = *buffer;
+  zero_init(buffer, struct twl_buffer);
+}
+
+// Frees a retired buffer once it is released, returns 0 if it wasn't one
+static int remove_retired_buffer(struct twl_window *win, struct wl_buffer *wl_buffer) {
+  struct twl_buffer *retired;
+  wl_array_for_each(retired, &win->retired_buffers) {
+    if (retired->wl_buffer != wl_buffer)
+      continue;
+    release_buffer(win->ctx, retired);
+    *retired = *((struct twl_buffer *)((char *)win->retired_buffers.data + win->retired_buffers.size) - 1);
+    win->retired_buffers.size -= sizeof(struct twl_buffer);
+    return 1;
+  }
+  return 0;
+}
+
+static uint32_t scale_size(uint32_t size, uint64_t scale) {
+  // Rounded halfway away from zero, as the compositor does for toplevels
+  uint32_t scaled = ((uint64_t)size * scale + 6000) / 12000;
+  return scaled ? scaled : 1;
+}
 
-  uint32_t buffer_size = stride * height;
-  uint32_t num_buffers = 2;
+static enum twl_format buffer_format(struct twl_window *win) {
+  enum twl_format format = win->constraints.format;
+  if (!(win->ctx->shm_formats & (1u << format)))
+    format = TWL_FORMAT_XRGB8888;
+  return format;
+}
 
-  buffer_size = align_to_pagesize(buffer_size);
+// (Re)creates the wl_buffer, the pool range is only replaced when it is too small.
+// Release events of every buffer, layers included, go to the window.
+static void create_buffer(struct twl_window *win, struct twl_buffer *buffer, uint32_t width, uint32_t height, enum twl_format format,
+                          uint32_t reserve_size) {
+  struct twl_context *ctx = win->ctx;
+  uint32_t stride = width * twl_format_bpp(format);
+  uint32_t buffer_size = align_to_pagesize(stride * height);
+  reserve_size = MAX(buffer_size, align_to_pagesize(reserve_size));
 
-  uint32_t pool_size = buffer_size * num_buffers;
+  if (buffer->in_use)
+    retire_buffer(win, buffer);
+  else
+    destroy_buffer(ctx, buffer);
 
-  if (!win->pool.fd) {
-    int fd = twl_shm_allocate(pool_size);
-    if (fd < 0) {
-      panic("SHM allocate failed\n");
-    }
-    win->pool.fd = fd;
-    win->pool.size = pool_size;
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(win->ctx.wl_shm, fd, pool_size);
-    win->pool.wl_shm_pool = pool;
-  } else if (pool_size > win->pool.size) {
-    int ok = twl_shm_resize(win->pool.fd, pool_size);
-    if (ok != 0) {
+  // Ranges are kept when shrinking so that resizing back and forth doesn't churn the pool,
+  // and replaced to take a reservation made once the bounds are known.
+  if (reserve_size > buffer->capacity) {
+    release_buffer(ctx, buffer);
+    if (twl_pool_alloc(&ctx->pool, reserve_size, &buffer->shm_pool, &buffer->offset) != 0) {
       panic("SHM resize failed\n");
     }
-    win->pool.size = pool_size;
-    wl_shm_pool_resize(win->pool.wl_shm_pool, pool_size);
-  }
-
-  if (win->buffer.wl_buffer)
-    wl_buffer_destroy(win->buffer.wl_buffer);
-  try_or_panic(fzn_mmap_unmap(&win->buffer.mmap), "munmap back buffer");
-
-  int fd = win->pool.fd;
-  const fzn_mmap_config buffer_mmap_config = {
-      .size = buffer_size,
-      .prot = PROT_READ | PROT_WRITE,
-      .flags = MAP_SHARED,
-      .fd = fd,
-      .offset = 0,
-  };
-  fzn_mmap buffer_mmap;
-  fzn_mmap_new(&buffer_mmap, &buffer_mmap_config);
-  if (buffer_mmap.addr == NULL) {
-    panic("Failed to mmap buffer\n");
-  }
-  win->buffer.mmap = buffer_mmap;
-
-  struct wl_buffer *wl_buffer = wl_shm_pool_create_buffer(win->pool.wl_shm_pool, 0, width, height, stride, format);
+    buffer->capacity = reserve_size;
+
+    const fzn_mmap_config buffer_mmap_config = {
+        .size = reserve_size,
+        .prot = PROT_READ | PROT_WRITE,
+        .flags = MAP_SHARED,
+        .fd = buffer->shm_pool->fd,
+        .offset = buffer->offset,
+    };
+    fzn_mmap buffer_mmap = {0};
+    fzn_mmap_new(&buffer_mmap, &buffer_mmap_config);
+    if (buffer_mmap.addr == NULL) {
+      panic("Failed to mmap buffer\n");
+    }
+    buffer->mmap = buffer_mmap;
+  }
+
+  buffer->width = width;
+  buffer->height = height;
+  buffer->stride = stride;
+  buffer->format = format;
+  buffer->serial = atomic_fetch_add(&ctx->pool.buffer_serial, 1) + 1;
+
+  // New buffers must be on our queue from the start: the I/O thread may dispatch it at any time.
+  struct wl_shm_pool *pool_wrapper = wl_proxy_create_wrapper(buffer->shm_pool->wl_shm_pool);
+  wl_proxy_set_queue((struct wl_proxy *)pool_wrapper, win->queue);
+  struct wl_buffer *wl_buffer = wl_shm_pool_create_buffer(pool_wrapper, buffer->offset, width, height, stride, shm_formats[format]);
+  wl_proxy_wrapper_destroy(pool_wrapper);
   wl_buffer_add_listener(wl_buffer, &wl_buffer_listener, win);
-  win->buffer.wl_buffer = wl_buffer;
-  win->buffer.in_use = 0;
+  buffer->wl_buffer = wl_buffer;
+}
+
+static int buffers_match(struct twl_buffer *buffers, uint32_t width, uint32_t height, uint64_t reserve_size) {
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    if (!buffers[i].wl_buffer || buffers[i].width != width || buffers[i].height != height || buffers[i].capacity < reserve_size)
+      return 0;
+  }
+  return 1;
+}
+
+static void configure_buffers(struct twl_window *win) {
+  // With a viewport any scale works and the buffer scale stays 1,
+  // otherwise only the integer part of the preferred scale is usable.
+  uint64_t scale = (uint64_t)win->scale120 * win->render_scale;
+  if (!win->wp_viewport)
+    scale = (uint64_t)(win->scale120 / 120) * 120 * 100;
+
+  enum twl_format format = buffer_format(win);
+  uint32_t width = scale_size(win->config.width, scale);
+  uint32_t height = scale_size(win->config.height, scale);
+
+  win->buffers_dirty = 0;
+
+  // The compositor scales the buffer to the window size
+  if (win->wp_viewport)
+    wp_viewport_set_destination(win->wp_viewport, win->config.width, win->config.height);
+  else
+    wl_surface_set_buffer_scale(win->wl_surface, win->scale120 / 120);
+
+  // Reserve enough for a window filling the bounds, so maximizing and resizing up to them
+  // needs neither a pool resize nor a remap. Pages are only committed once they are drawn to.
+  // Every buffer may be drawn to next, they all reserve; the cap is for the window as a whole.
+  uint64_t reserve_size = 0;
+  if (win->config.bounds_width && win->config.bounds_height) {
+    uint64_t full_scale = win->wp_viewport ? (uint64_t)win->scale120 * 100 : scale;
+    reserve_size = (uint64_t)scale_size(win->config.bounds_width, full_scale) * twl_format_bpp(format) *
+                   scale_size(win->config.bounds_height, full_scale);
+    reserve_size = align_to_pagesize(MIN(reserve_size, MAX_RESERVE_SIZE / TWL_NUM_BUFFERS));
+  }
+
+  // States-only configures and scale flips that round to the same size keep their buffers, unless
+  // they were preallocated before the bounds came and lack the reservation
+  if (buffers_match(win->buffers, width, height, reserve_size) && win->buffers[0].format == format)
+    return;
+
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    create_buffer(win, &win->buffers[i], width, height, format, reserve_size);
+  }
+
+  win->buffer = &win->buffers[0];
+}
+
+// Buffers at the default size, for a first configure that leaves the size to the client or picks the same one
+static void preallocate_buffers(struct twl_window *win) {
+  if (!win->constraints.default_width || !win->constraints.default_height)
+    return;
+
+  win->config.width = win->constraints.default_width;
+  win->config.height = win->constraints.default_height;
+  configure_buffers(win);
+
+#ifdef MADV_POPULATE_WRITE
+  // Fault the first buffer's pages in now instead of in the first draw_fn
+  struct twl_buffer *buffer = &win->buffers[0];
+  madvise(buffer->mmap.addr, (size_t)buffer->stride * buffer->height, MADV_POPULATE_WRITE);
+#endif
 }
 
 int twl_init(struct twl_context *ctx) {
   zero_init(ctx, struct twl_context);
+  wl_list_init(&ctx->windows);
+  wl_list_init(&ctx->outputs);
+  wl_array_init(&ctx->watches);
+  pthread_mutex_init(&ctx->watch_lock, NULL);
+  ctx->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  ctx->shm_formats = (1u << TWL_FORMAT_XRGB8888) | (1u << TWL_FORMAT_ARGB8888);
+  ctx->startup.start_ns = now_ns();
 
   struct wl_display *display = wl_display_connect(NULL);
 
   if (!display) {
-    panic("Failed to connect to the display\n");
+    fprintf(stderr, "Failed to connect to the display\n");
+    twl_destroy(ctx);
+    return -1;
   }
+  twl_startup_mark(&ctx->startup.connect_ns, now_ns());
 
   ctx->wl_display = display;
   struct wl_registry *registry = wl_display_get_registry(display);
+  ctx->wl_registry = registry;
 
+  // One roundtrip binds the globals. What they announce in turn (shm formats, output scales,
+  // seat capabilities) arrives while the first configure is on its way: the server sends it
+  // first and the default queue is dispatched before the windows', so it is in place by then.
   wl_registry_add_listener(registry, &wl_registry_listener, ctx);
   wl_display_roundtrip(display);
 
-  assert(ctx->wl_compositor);
-  assert(ctx->wl_shm);
-  assert(ctx->xdg_wm_base);
+  if (!ctx->wl_compositor || !ctx->wl_shm || !ctx->xdg_wm_base) {
+    fprintf(stderr, "The compositor lacks wl_compositor, wl_shm or xdg_wm_base\n");
+    twl_destroy(ctx);
+    return -1;
+  }
 
   xdg_wm_base_add_listener(ctx->xdg_wm_base, &xdg_wm_base_listener, NULL);
 
+  twl_pool_init(&ctx->pool, ctx->wl_shm);
+  twl_clipboard_init(&ctx->clipboard, ctx);
+  if (ctx->wake_fd >= 0)
+    twl_watch_fd(ctx, ctx->wake_fd, POLLIN, cb_wake, ctx);
+
   return 0;
 }
 
-int twl_window_init(struct twl_context *ctx, struct twl_window *win, const char *title, draw_fn draw_fn, void *user_data) {
-  zero_init(win, struct twl_window);
+// Also unwinds a twl_init() that failed part way
+void twl_destroy(struct twl_context *ctx) {
+  struct twl_window *win, *tmp;
+  wl_list_for_each_safe(win, tmp, &ctx->windows, link) { twl_window_destroy(win); }
+
+  // Both are set up once the globals are known to be there
+  int is_initialized = ctx->pool.wl_shm != NULL;
+  if (is_initialized)
+    twl_pool_destroy(&ctx->pool);
+  if (ctx->xdg_wm_base)
+    xdg_wm_base_destroy(ctx->xdg_wm_base);
+  struct twl_output *output, *output_tmp;
+  wl_list_for_each_safe(output, output_tmp, &ctx->outputs, link) {
+    wl_output_destroy(output->wl_output);
+    free(output);
+  }
+
+  if (ctx->wp_fractional_scale_manager)
+    wp_fractional_scale_manager_v1_destroy(ctx->wp_fractional_scale_manager);
+  if (ctx->wp_viewporter)
+    wp_viewporter_destroy(ctx->wp_viewporter);
+  if (ctx->wl_subcompositor)
+    wl_subcompositor_destroy(ctx->wl_subcompositor);
+  if (is_initialized)
+    twl_clipboard_destroy(&ctx->clipboard);
+  if (ctx->wl_data_device_manager)
+    wl_data_device_manager_destroy(ctx->wl_data_device_manager);
+  release_keyboard(ctx);
+  release_pointer(ctx);
+  if (ctx->wl_seat)
+    wl_seat_destroy(ctx->wl_seat);
+  wl_array_release(&ctx->watches);
+  pthread_mutex_destroy(&ctx->watch_lock);
+  if (ctx->wake_fd >= 0)
+    close(ctx->wake_fd);
+  if (ctx->wp_single_pixel_buffer_manager)
+    wp_single_pixel_buffer_manager_v1_destroy(ctx->wp_single_pixel_buffer_manager);
+  if (ctx->wp_presentation)
+    wp_presentation_destroy(ctx->wp_presentation);
+  if (ctx->wl_shm)
+    wl_shm_destroy(ctx->wl_shm);
+  if (ctx->wl_compositor)
+    wl_compositor_destroy(ctx->wl_compositor);
+  if (ctx->wl_registry)
+    wl_registry_destroy(ctx->wl_registry);
+
+  if (ctx->wl_display)
+    wl_display_disconnect(ctx->wl_display);
+  zero_init(ctx, struct twl_context);
+}
+
+struct twl_window *twl_window_create(struct twl_context *ctx, const char *title, const struct twl_window_constraints *constraints, draw_fn draw_fn,
+                                     void *user_data) {
+  struct twl_window *win = calloc(1, sizeof(struct twl_window));
+  if (win == NULL) {
+    return NULL;
+  }
 
-  win->ctx = *ctx;
+  win->ctx = ctx;
+  win->constraints = *constraints;
   win->draw_fn = draw_fn;
   win->user_data = user_data;
+  win->queue = wl_display_create_queue(ctx->wl_display);
 
+  if (constraints->prepare_fn) {
+    if (start_prepare_thread(constraints->prepare_fn, user_data, &win->prepare_thread) == 0)
+      win->is_preparing = 1;
+    else
+      constraints->prepare_fn(user_data);
+  }
+
+  // Objects created from a proxy inherit its queue, so only the roots need to be moved.
   struct wl_surface *wl_surface = wl_compositor_create_surface(ctx->wl_compositor);
+  wl_proxy_set_queue((struct wl_proxy *)wl_surface, win->queue);
+  wl_surface_add_listener(wl_surface, &wl_surface_listener, win);
   win->wl_surface = wl_surface;
+  wl_array_init(&win->outputs);
+  wl_list_init(&win->layers);
+  pthread_mutex_init(&win->layer_lock, NULL);
+  wl_array_init(&win->stale_frames);
+  wl_array_init(&win->retired_buffers);
+  twl_pointer_batch_init(&win->pointer);
+  wl_list_init(&win->feedbacks);
 
   struct xdg_surface *xdg_surface = xdg_wm_base_get_xdg_surface(ctx->xdg_wm_base, wl_surface);
+  wl_proxy_set_queue((struct wl_proxy *)xdg_surface, win->queue);
   win->xdg_surface = xdg_surface;
   xdg_surface_add_listener(xdg_surface, &xdg_surface_listener, win);
 
@@ -249,41 +1071,1248 @@ int twl_window_init(struct twl_context *ctx, struct twl_window *win, const char
   xdg_toplevel_set_title(xdg_toplevel, title);
   xdg_toplevel_add_listener(xdg_toplevel, &xdg_toplevel_listener, win);
 
+  win->render_scale = 100;
+  win->scale120 = 120;
+  if (ctx->wp_viewporter && (constraints->frame_budget_us || ctx->wp_fractional_scale_manager))
+    win->wp_viewport = wp_viewporter_get_viewport(ctx->wp_viewporter, wl_surface);
+
+  // Fractional scales need the viewport to map the buffer back to the window size
+  if (win->wp_viewport && ctx->wp_fractional_scale_manager) {
+    win->wp_fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(ctx->wp_fractional_scale_manager, wl_surface);
+    wl_proxy_set_queue((struct wl_proxy *)win->wp_fractional_scale, win->queue);
+    wp_fractional_scale_v1_add_listener(win->wp_fractional_scale, &wp_fractional_scale_listener, win);
+  }
+
   win->should_close = 0;
+  win->event_fd = -1;
+  wl_list_insert(ctx->windows.prev, &win->link);
 
-  return 0;
+  wl_surface_commit(win->wl_surface);
+  // The initial commit goes out now, the buffers are allocated while the compositor answers it
+  wl_display_flush(ctx->wl_display);
+  preallocate_buffers(win);
+
+  if (ctx->threaded && start_render_thread(win) != 0) {
+    twl_window_destroy(win);
+    return NULL;
+  }
+
+  return win;
 }
 
-int twl_main(char *title, struct twl_window_constraints *constraints, draw_fn draw, void *data) {
-  struct twl_context ctx;
-  struct twl_window win;
+void twl_window_destroy(struct twl_window *win) {
+  struct twl_context *ctx = win->ctx;
 
-  if (twl_init(&ctx) != 0) {
-    return -1;
-  }
-  if (twl_window_init(&ctx, &win, title, draw, data) != 0) {
-    return -1;
-  }
-  win.constraints = *constraints;
+  stop_render_thread(win);
+  finish_prepare(win);
 
-  wl_surface_commit(win.wl_surface);
+  if (ctx->keyboard_focus == win)
+    ctx->keyboard_focus = NULL;
+  if (ctx->pointer_focus == win)
+    ctx->pointer_focus = NULL;
 
-  while (wl_display_dispatch(ctx.wl_display) != -1 && !win.should_close) {
-    usleep(160);
-    draw_frame(&win);
+  if (win->constraints.measure_latency)
+    twl_latency_print(&win->latency, ctx->wp_presentation ? "Input-to-present" : "Input-to-commit", stderr);
+
+  struct twl_feedback *feedback, *feedback_tmp;
+  wl_list_for_each_safe(feedback, feedback_tmp, &win->feedbacks, link) {
+    wp_presentation_feedback_destroy(feedback->wp_feedback);
+    wl_list_remove(&feedback->link);
+    free(feedback);
   }
+  if (win->presentation_wrapper)
+    wl_proxy_wrapper_destroy(win->presentation_wrapper);
 
-  wl_display_disconnect(ctx.wl_display);
-  return 0;
-}
+  struct twl_layer *layer, *layer_tmp;
+  wl_list_for_each_safe(layer, layer_tmp, &win->layers, link) { twl_layer_destroy(layer); }
 
-static void draw_frame(struct twl_window *win) {
-  void *buffer_data = win->buffer.mmap.addr;
+  if (win->frame_callback)
+    wl_callback_destroy(win->frame_callback);
+  struct wl_callback **stale;
+  wl_array_for_each(stale, &win->stale_frames) { wl_callback_destroy(*stale); }
+  wl_array_release(&win->stale_frames);
 
-  (win->draw_fn)(win, buffer_data);
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    release_buffer(ctx, &win->buffers[i]);
+  }
+  struct twl_buffer *retired;
+  wl_array_for_each(retired, &win->retired_buffers) { release_buffer(ctx, retired); }
+  wl_array_release(&win->retired_buffers);
+
+  if (win->wp_fractional_scale)
+    wp_fractional_scale_v1_destroy(win->wp_fractional_scale);
+  if (win->wp_viewport)
+    wp_viewport_destroy(win->wp_viewport);
+  wl_array_release(&win->outputs);
+  pthread_mutex_destroy(&win->layer_lock);
+  twl_pointer_batch_destroy(&win->pointer);
+  xdg_toplevel_destroy(win->xdg_toplevel);
+  xdg_surface_destroy(win->xdg_surface);
+  wl_surface_destroy(win->wl_surface);
+
+  // All proxies on the queue are gone, pending events can be dropped with it.
+  wl_event_queue_destroy(win->queue);
+
+  wl_list_remove(&win->link);
+  free(win);
+}
+
+enum twl_subpixel twl_window_subpixel(const struct twl_window *win) {
+  // Scaled buffers smear the subpixels over their neighbours
+  if (win->render_scale != 100 || win->scale120 % 120 != 0)
+    return TWL_SUBPIXEL_NONE;
+  return win->subpixel;
+}
+
+void twl_window_damage(struct twl_window *win, int32_t x, int32_t y, int32_t width, int32_t height) {
+  if (win->num_damage < 0)
+    win->num_damage = 0;
+  if (width <= 0 || height <= 0)
+    return;
+
+  int32_t *rect = win->damage[MIN(win->num_damage, TWL_MAX_DAMAGE - 1)];
+  if (win->num_damage == TWL_MAX_DAMAGE) {
+    // Out of rects: the last one grows to cover this one too
+    int32_t right = MAX(rect[0] + rect[2], x + width);
+    int32_t bottom = MAX(rect[1] + rect[3], y + height);
+    x = MIN(rect[0], x);
+    y = MIN(rect[1], y);
+    width = right - x;
+    height = bottom - y;
+  } else {
+    win->num_damage++;
+  }
+  rect[0] = x;
+  rect[1] = y;
+  rect[2] = width;
+  rect[3] = height;
+}
+
+static void push_proxy(struct wl_array *array, void *proxy) {
+  void **entry = wl_array_add(array, sizeof(void *));
+  if (entry)
+    *entry = proxy;
+}
+
+static void post_event(struct twl_window *win, const struct twl_event *event) {
+  struct twl_mailbox *mailbox = &win->mailbox;
+
+  pthread_mutex_lock(&mailbox->lock);
+  switch (event->type) {
+  case TWL_EVENT_CONFIGURE:
+    // Only the latest configure gets acked anyway
+    mailbox->has_configure = 1;
+    mailbox->configure_serial = event->serial;
+    mailbox->config = event->config;
+    break;
+  case TWL_EVENT_SCALE:
+    mailbox->has_scale = 1;
+    mailbox->scale120 = event->value;
+    break;
+  case TWL_EVENT_SUBPIXEL:
+    mailbox->has_subpixel = 1;
+    mailbox->subpixel = event->value;
+    break;
+  case TWL_EVENT_BUFFER_RELEASE:
+    push_proxy(&mailbox->releases, event->proxy);
+    break;
+  case TWL_EVENT_FRAME_DONE:
+    push_proxy(&mailbox->frames, event->proxy);
+    break;
+  case TWL_EVENT_CLOSE:
+    mailbox->should_close = 1;
+    break;
+  default:
+    // A render thread stuck this far behind loses keys. Feedback is kept, the render thread frees it.
+    if (event->type == TWL_EVENT_PRESENTED || mailbox->events.size / sizeof(struct twl_event) < MAX_PENDING_EVENTS) {
+      struct twl_event *entry = wl_array_add(&mailbox->events, sizeof(struct twl_event));
+      if (entry)
+        *entry = *event;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&mailbox->lock);
+
+  eventfd_write(win->event_fd, 1);
+}
+
+// Batched right here: however fast the mouse, the render thread gets one batch per draw
+static void post_pointer(struct twl_window *win, const struct twl_pointer_event *event) {
+  struct twl_mailbox *mailbox = &win->mailbox;
+  struct wl_array *motion = &mailbox->pointer.motion;
+
+  pthread_mutex_lock(&mailbox->lock);
+  // A render thread that doesn't keep up loses the older half of the motion history, never
+  // the position, buttons or scrolling
+  if (motion->size / sizeof(struct twl_pointer_sample) >= TWL_POINTER_HISTORY_MAX) {
+    size_t keep = TWL_POINTER_HISTORY_MAX / 2 * sizeof(struct twl_pointer_sample);
+    memmove(motion->data, (char *)motion->data + motion->size - keep, keep);
+    motion->size = keep;
+  }
+  twl_pointer_batch_add(&mailbox->pointer, event);
+  if (mailbox->pointer_ns == 0)
+    mailbox->pointer_ns = event->time_ns;
+  pthread_mutex_unlock(&mailbox->lock);
+
+  eventfd_write(win->event_fd, 1);
+}
+
+// Swaps the batch collected by the I/O thread with `batch`, already handed out and reset.
+// The position carries over.
+static void take_pointer_batch(struct twl_mailbox *mailbox, struct twl_pointer_batch *batch) {
+  pthread_mutex_lock(&mailbox->lock);
+  struct twl_pointer_batch taken = mailbox->pointer;
+  mailbox->pointer = *batch;
+  mailbox->pointer.inside = taken.inside;
+  mailbox->pointer.x = taken.x;
+  mailbox->pointer.y = taken.y;
+  pthread_mutex_unlock(&mailbox->lock);
+  *batch = taken;
+}
+
+static void swap_arrays(struct wl_array *a, struct wl_array *b) {
+  struct wl_array tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// Moves everything posted so far into `mail`, whose arrays go back to the mailbox emptied
+static void take_mail(struct twl_mailbox *mailbox, struct twl_mailbox *mail) {
+  mail->releases.size = 0;
+  mail->frames.size = 0;
+  mail->events.size = 0;
+
+  pthread_mutex_lock(&mailbox->lock);
+  mail->has_configure = mailbox->has_configure;
+  mail->configure_serial = mailbox->configure_serial;
+  mail->config = mailbox->config;
+  mail->has_scale = mailbox->has_scale;
+  mail->scale120 = mailbox->scale120;
+  mail->has_subpixel = mailbox->has_subpixel;
+  mail->subpixel = mailbox->subpixel;
+  mail->should_close = mailbox->should_close;
+  mail->pointer_ns = mailbox->pointer_ns;
+  mailbox->has_configure = 0;
+  mailbox->has_scale = 0;
+  mailbox->has_subpixel = 0;
+  mailbox->pointer_ns = 0;
+  swap_arrays(&mail->releases, &mailbox->releases);
+  swap_arrays(&mail->frames, &mailbox->frames);
+  swap_arrays(&mail->events, &mailbox->events);
+  pthread_mutex_unlock(&mailbox->lock);
+}
+
+static void init_mailbox(struct twl_mailbox *mailbox) {
+  zero_init(mailbox, struct twl_mailbox);
+  pthread_mutex_init(&mailbox->lock, NULL);
+  wl_array_init(&mailbox->releases);
+  wl_array_init(&mailbox->frames);
+  wl_array_init(&mailbox->events);
+  twl_pointer_batch_init(&mailbox->pointer);
+}
+
+static void destroy_mailbox(struct twl_mailbox *mailbox) {
+  wl_array_release(&mailbox->releases);
+  wl_array_release(&mailbox->frames);
+  wl_array_release(&mailbox->events);
+  twl_pointer_batch_destroy(&mailbox->pointer);
+  pthread_mutex_destroy(&mailbox->lock);
+}
+
+static void handle_mail(struct twl_window *win, struct twl_mailbox *mail) {
+  // Releases first so the frames below find their buffers, a configure before the frame callback applying it
+  void **proxy;
+  wl_array_for_each(proxy, &mail->releases) { handle_buffer_release(win, *proxy); }
+  if (mail->has_scale)
+    handle_scale(win, mail->scale120);
+  if (mail->has_subpixel)
+    handle_subpixel(win, mail->subpixel);
+  if (mail->has_configure)
+    handle_configure(win, mail->configure_serial, &mail->config);
+  wl_array_for_each(proxy, &mail->frames) { handle_frame_done(win, *proxy); }
+  if (mail->pointer_ns)
+    handle_pointer_batched(win, mail->pointer_ns);
+
+  struct twl_event *event;
+  wl_array_for_each(event, &mail->events) {
+    switch (event->type) {
+    case TWL_EVENT_KEY:
+      handle_key(win, &event->key);
+      break;
+    case TWL_EVENT_PRESENTED:
+      handle_presented(win, event->proxy, event->time_ns);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void *render_thread_main(void *data) {
+  struct twl_window *win = data;
+  struct pollfd pfd = {.fd = win->event_fd, .events = POLLIN};
+  struct twl_mailbox mail;
+  init_mailbox(&mail);
+
+  for (;;) {
+    int ret = poll(&pfd, 1, occlusion_timeout(win));
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    check_occlusion(win);
+    if (ret == 0)
+      continue;
+
+    eventfd_t count;
+    eventfd_read(win->event_fd, &count);
+
+    take_mail(&win->mailbox, &mail);
+    if (mail.should_close)
+      break;
+    handle_mail(win, &mail);
+
+    // Don't wait for the I/O thread to wake up before the commit goes out.
+    wl_display_flush(win->ctx->wl_display);
+  }
+
+  destroy_mailbox(&mail);
+  return NULL;
+}
+
+static int start_render_thread(struct twl_window *win) {
+  win->event_fd = eventfd(0, EFD_CLOEXEC);
+  if (win->event_fd < 0) {
+    return -1;
+  }
+  init_mailbox(&win->mailbox);
+
+  if (pthread_create(&win->render_thread, NULL, render_thread_main, win) != 0) {
+    close(win->event_fd);
+    win->event_fd = -1;
+    destroy_mailbox(&win->mailbox);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void stop_render_thread(struct twl_window *win) {
+  if (win->event_fd < 0)
+    return;
+
+  struct twl_event event = {.type = TWL_EVENT_CLOSE};
+  post_event(win, &event);
+  pthread_join(win->render_thread, NULL);
+
+  // Feedback still in the mailbox is freed with the window's list
+  close(win->event_fd);
+  win->event_fd = -1;
+  destroy_mailbox(&win->mailbox);
+}
+
+struct prepare_job {
+  twl_prepare_fn prepare_fn;
+  void *user_data;
+};
+
+static void *prepare_thread_main(void *data) {
+  struct prepare_job job = *(struct prepare_job *)data;
+  free(data);
+  job.prepare_fn(job.user_data);
+  return NULL;
+}
+
+static int start_prepare_thread(twl_prepare_fn prepare_fn, void *user_data, pthread_t *thread) {
+  struct prepare_job *job = malloc(sizeof(struct prepare_job));
+  if (job == NULL)
+    return -1;
+  *job = (struct prepare_job){.prepare_fn = prepare_fn, .user_data = user_data};
+
+  if (pthread_create(thread, NULL, prepare_thread_main, job) != 0) {
+    free(job);
+    return -1;
+  }
+  return 0;
+}
+
+// Waited for by the first frame, or by the window's destruction if it never drew
+static void finish_prepare(struct twl_window *win) {
+  if (!win->is_preparing)
+    return;
+  pthread_join(win->prepare_thread, NULL);
+  win->is_preparing = 0;
+}
+
+static void dispatch_windows(struct twl_context *ctx) {
+  struct twl_window *win, *tmp;
+
+  wl_list_for_each(win, &ctx->windows, link) { wl_display_dispatch_queue_pending(ctx->wl_display, win->queue); }
+
+  wl_list_for_each_safe(win, tmp, &ctx->windows, link) {
+    if (win->should_close)
+      twl_window_destroy(win);
+  }
+}
+
+int twl_watch_fd(struct twl_context *ctx, int fd, short events, twl_watch_fn fn, void *data) {
+  pthread_mutex_lock(&ctx->watch_lock);
+  struct twl_watch *watch = wl_array_add(&ctx->watches, sizeof(struct twl_watch));
+  if (watch == NULL) {
+    pthread_mutex_unlock(&ctx->watch_lock);
+    return -1;
+  }
+  watch->fd = fd;
+  watch->events = events;
+  watch->fn = fn;
+  watch->data = data;
+  pthread_mutex_unlock(&ctx->watch_lock);
+
+  // The loop may be polling without this fd already
+  uint64_t one = 1;
+  if (ctx->wake_fd >= 0)
+    write(ctx->wake_fd, &one, sizeof(one));
+  return 0;
+}
+
+void twl_unwatch_fd(struct twl_context *ctx, int fd) {
+  pthread_mutex_lock(&ctx->watch_lock);
+  struct twl_watch *watch;
+  wl_array_for_each(watch, &ctx->watches) {
+    if (watch->fd == fd) {
+      struct twl_watch *last = (struct twl_watch *)((char *)ctx->watches.data + ctx->watches.size) - 1;
+      *watch = *last;
+      ctx->watches.size -= sizeof(struct twl_watch);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ctx->watch_lock);
+}
+
+// Runs the callbacks of the ready watches. Watches may be added or removed by the callbacks,
+// so each fd is looked up again instead of trusting the array the poll was built from.
+static void dispatch_watches(struct twl_context *ctx, struct pollfd *pfds, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!(pfds[i].revents & (pfds[i].events | POLLERR | POLLHUP)))
+      continue;
+
+    // Called unlocked, callbacks add and remove watches themselves
+    struct twl_watch found = {.fd = -1};
+    struct twl_watch *watch;
+    pthread_mutex_lock(&ctx->watch_lock);
+    wl_array_for_each(watch, &ctx->watches) {
+      if (watch->fd == pfds[i].fd) {
+        found = *watch;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&ctx->watch_lock);
+
+    if (found.fd >= 0)
+      found.fn(found.data, found.fd);
+  }
+}
+
+int twl_run(struct twl_context *ctx) {
+  struct wl_display *display = ctx->wl_display;
+  struct wl_array pfds;
+  wl_array_init(&pfds);
+  int res = 0;
+
+  // One loop for every window: the display fd is read once and the events are
+  // sorted into the default queue (globals) and the per-window queues.
+  while (!wl_list_empty(&ctx->windows)) {
+    while (wl_display_prepare_read(display) != 0) {
+      wl_display_dispatch_pending(display);
+    }
+
+    if (wl_display_flush(display) < 0 && errno != EAGAIN) {
+      wl_display_cancel_read(display);
+      res = -1;
+      break;
+    }
+
+    // The display first, then every watch
+    pthread_mutex_lock(&ctx->watch_lock);
+    uint32_t num_watches = ctx->watches.size / sizeof(struct twl_watch);
+    pfds.size = 0;
+    struct pollfd *pfd = wl_array_add(&pfds, (1 + num_watches) * sizeof(struct pollfd));
+    if (pfd == NULL) {
+      pthread_mutex_unlock(&ctx->watch_lock);
+      wl_display_cancel_read(display);
+      res = -1;
+      break;
+    }
+    pfd[0] = (struct pollfd){.fd = wl_display_get_fd(display), .events = POLLIN};
+    for (uint32_t i = 0; i < num_watches; ++i) {
+      struct twl_watch *watch = &((struct twl_watch *)ctx->watches.data)[i];
+      pfd[1 + i] = (struct pollfd){.fd = watch->fd, .events = watch->events};
+    }
+    pthread_mutex_unlock(&ctx->watch_lock);
+
+    // Render threads watch their own windows
+    int timeout = -1;
+    struct twl_window *win;
+    wl_list_for_each(win, &ctx->windows, link) {
+      int win_timeout = ctx->threaded ? -1 : occlusion_timeout(win);
+      if (win_timeout >= 0 && (timeout < 0 || win_timeout < timeout))
+        timeout = win_timeout;
+    }
+
+    if (poll(pfd, 1 + num_watches, timeout) < 0) {
+      wl_display_cancel_read(display);
+      if (errno == EINTR)
+        continue;
+      res = -1;
+      break;
+    }
+
+    if (wl_display_read_events(display) != 0) {
+      res = -1;
+      break;
+    }
+
+    wl_display_dispatch_pending(display);
+    dispatch_watches(ctx, pfd + 1, num_watches);
+    dispatch_windows(ctx);
+
+    if (!ctx->threaded) {
+      wl_list_for_each(win, &ctx->windows, link) { check_occlusion(win); }
+    }
+  }
+
+  wl_array_release(&pfds);
+  return res;
+}
+
+int twl_run_threaded(struct twl_context *ctx) {
+  ctx->threaded = 1;
+
+  struct twl_window *win;
+  wl_list_for_each(win, &ctx->windows, link) {
+    if (win->event_fd < 0 && start_render_thread(win) != 0) {
+      return -1;
+    }
+  }
+
+  // This thread becomes the I/O thread: it only reads, dispatches and forwards events,
+  // so pings and buffer releases are never stuck behind a slow draw_fn.
+  return twl_run(ctx);
+}
+
+int twl_main(char *title, struct twl_window_constraints *constraints, draw_fn draw, void *data) {
+  struct twl_context ctx;
+
+  // The first frame is prepared while connecting too, the window takes the thread over
+  struct twl_window_constraints window_constraints = *constraints;
+  pthread_t prepare_thread;
+  int is_preparing = constraints->prepare_fn && start_prepare_thread(constraints->prepare_fn, data, &prepare_thread) == 0;
+  if (is_preparing)
+    window_constraints.prepare_fn = NULL;
+
+  // twl_init() cleans up after itself
+  int res = twl_init(&ctx);
+  struct twl_window *win = res == 0 ? twl_window_create(&ctx, title, &window_constraints, draw, data) : NULL;
+  if (win == NULL) {
+    if (res == 0)
+      twl_destroy(&ctx);
+    if (is_preparing)
+      pthread_join(prepare_thread, NULL);
+    return -1;
+  }
+  win->prepare_thread = prepare_thread;
+  win->is_preparing = is_preparing;
+
+  res = twl_run(&ctx);
+
+  twl_destroy(&ctx);
+  return res;
+}
+
+static void apply_configure(struct twl_window *win) {
+  win->config = win->config_latched;
+  win->configure_latched = 0;
+  win->is_configured = 1;
+
+  // Acking the latest configure implicitly acks the ones it replaced
+  xdg_surface_ack_configure(win->xdg_surface, win->latched_serial);
+
+  // Even a suspended window answers with a buffer of the new size, it is hidden again right after.
+  show_window(win);
+  configure_buffers(win);
+
+  // The pending callback is dropped but not destroyed: freed, its address could come back for the
+  // next frame's callback while its done event is still on the way to the render thread.
+  if (win->frame_callback) {
+    push_proxy(&win->stale_frames, win->frame_callback);
+    win->frame_callback = NULL;
+  }
+  draw_frame(win);
+
+  if (win->config.is_suspended)
+    hide_window(win);
+}
+
+static void handle_configure(struct twl_window *win, uint32_t serial, const struct twl_window_config *config) {
+  // Interactive resizes send configures faster than we draw: only the latest one is kept
+  // and applied by the next frame callback, so a storm costs one redraw per frame.
+  win->config_latched = *config;
+  win->latched_serial = serial;
+  win->configure_latched = 1;
+
+  // Without a frame callback to wait for (first configure, hidden window) it's answered now.
+  if (!win->frame_callback || !win->is_configured || win->is_hidden)
+    apply_configure(win);
+}
+
+// Hidden windows give back every buffer the compositor doesn't hold, see hide_window()
+static int release_hidden_buffer(struct twl_window *win, struct twl_buffer *buffer, struct twl_buffer *attached) {
+  if (!win->is_hidden || win->constraints.keep_buffers_when_hidden || buffer == attached || buffer->in_use)
+    return 0;
+  release_buffer(win->ctx, buffer);
+  return 1;
+}
+
+static void handle_buffer_release(struct twl_window *win, struct wl_buffer *wl_buffer) {
+  if (remove_retired_buffer(win, wl_buffer))
+    return;
+
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    if (win->buffers[i].wl_buffer != wl_buffer)
+      continue;
+    win->buffers[i].in_use = 0;
+    if (release_hidden_buffer(win, &win->buffers[i], win->buffer)) {
+      twl_pool_trim(&win->ctx->pool);
+      return;
+    }
+  }
+
+  struct twl_layer *layer;
+  wl_list_for_each(layer, &win->layers, link) {
+    for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+      if (layer->buffers[i].wl_buffer != wl_buffer)
+        continue;
+      layer->buffers[i].in_use = 0;
+      if (release_hidden_buffer(win, &layer->buffers[i], layer->buffer))
+        twl_pool_trim(&win->ctx->pool);
+      else if (layer->needs_draw)
+        draw_layer(layer);
+      return;
+    }
+  }
+
+  // A frame was skipped because every buffer was held by the compositor
+  if (win->needs_draw)
+    draw_frame(win);
+}
+
+// Forgets a dropped frame callback once it fired, returns 0 if it wasn't one
+static int remove_stale_frame(struct twl_window *win, struct wl_callback *wl_callback) {
+  struct wl_callback **stale;
+  wl_array_for_each(stale, &win->stale_frames) {
+    if (*stale != wl_callback)
+      continue;
+    wl_callback_destroy(wl_callback);
+    *stale = *((struct wl_callback **)((char *)win->stale_frames.data + win->stale_frames.size) - 1);
+    win->stale_frames.size -= sizeof(struct wl_callback *);
+    return 1;
+  }
+  return 0;
+}
+
+static void handle_frame_done(struct twl_window *win, struct wl_callback *wl_callback) {
+  if (remove_stale_frame(win, wl_callback))
+    return;
+
+  struct twl_layer *layer;
+  wl_list_for_each(layer, &win->layers, link) {
+    if (layer->frame_callback != wl_callback)
+      continue;
+    wl_callback_destroy(wl_callback);
+    layer->frame_callback = NULL;
+    if (layer->needs_draw)
+      draw_layer(layer);
+    return;
+  }
+
+  if (win->frame_callback != wl_callback)
+    return;
+  wl_callback_destroy(wl_callback);
+  win->frame_callback = NULL;
 
-  wl_surface_attach(win->wl_surface, win->buffer.wl_buffer, 0, 0);
-  wl_surface_damage_buffer(win->wl_surface, 0, 0, win->config.width, win->config.height);
+  if (!win->ctx->wp_presentation)
+    trace_presented(win, now_ns());
+
+  if (win->configure_latched) {
+    apply_configure(win);
+    return;
+  }
+
+  // Being repainted again; suspended windows only come back with a configure.
+  if (!win->config.is_suspended)
+    show_window(win);
+  draw_frame(win);
+}
+
+static void handle_scale(struct twl_window *win, uint32_t scale120) {
+  if (scale120 == win->scale120)
+    return;
+
+  // Buffers are resized lazily by the next draw, so bursts of scale events cost one reallocation
+  win->scale120 = scale120;
+  win->buffers_dirty = 1;
+  draw_frame(win);
+
+  struct twl_layer *layer;
+  wl_list_for_each(layer, &win->layers, link) {
+    layer->buffers_dirty = 1;
+    draw_layer(layer);
+  }
+}
+
+static void handle_subpixel(struct twl_window *win, enum twl_subpixel subpixel) {
+  if (subpixel == win->subpixel)
+    return;
+  win->subpixel = subpixel;
+  draw_frame(win);
+}
+
+static void handle_key(struct twl_window *win, const struct twl_key_event *event) {
+  if (win->key_fn)
+    win->key_fn(win, event);
+
+  // The latency of a frame is measured from the oldest input it shows
+  if (win->input_ns == 0)
+    win->input_ns = event->time_ns;
+  draw_frame(win);
+}
+
+static void flush_pointer_batch(struct twl_window *win) {
+  if (win->ctx->threaded)
+    take_pointer_batch(&win->mailbox, &win->pointer);
+  if (win->pointer.changes == 0)
+    return;
+  win->pointer_fn(win, &win->pointer);
+  twl_pointer_batch_reset(&win->pointer);
+}
+
+static void handle_pointer(struct twl_window *win, const struct twl_pointer_event *event) {
+  if (win->pointer_fn == NULL)
+    return;
+
+  // Collected until the next draw, so a 1000 Hz mouse still costs one redraw per frame
+  twl_pointer_batch_add(&win->pointer, event);
+  if (win->pointer.motion.size / sizeof(struct twl_pointer_sample) >= TWL_POINTER_HISTORY_MAX)
+    flush_pointer_batch(win);
+
+  if (win->input_ns == 0)
+    win->input_ns = event->time_ns;
+  draw_frame(win);
+}
+
+// Threaded mode: the batch stays with the I/O thread until draw_frame() takes it
+static void handle_pointer_batched(struct twl_window *win, uint64_t time_ns) {
+  if (win->pointer_fn == NULL) {
+    take_pointer_batch(&win->mailbox, &win->pointer);
+    twl_pointer_batch_reset(&win->pointer);
+    return;
+  }
+
+  if (win->input_ns == 0)
+    win->input_ns = time_ns;
+  draw_frame(win);
+}
+
+static void handle_presented(struct twl_window *win, struct twl_feedback *feedback, uint64_t present_ns) {
+  if (feedback->input_ns && win->constraints.measure_latency) {
+    if (present_ns == 0)
+      win->latency.discarded++;
+    else
+      twl_latency_record(&win->latency, present_ns > feedback->input_ns ? (present_ns - feedback->input_ns) / 1000 : 0);
+  }
+  if (present_ns)
+    trace_presented(win, present_ns);
+
+  wp_presentation_feedback_destroy(feedback->wp_feedback);
+  wl_list_remove(&feedback->link);
+  free(feedback);
+}
+
+// Asks when the frame about to be committed reaches the screen
+static void request_feedback(struct twl_window *win) {
+  struct twl_context *ctx = win->ctx;
+
+  struct twl_feedback *feedback = calloc(1, sizeof(struct twl_feedback));
+  if (feedback == NULL)
+    return;
+
+  if (!win->presentation_wrapper) {
+    win->presentation_wrapper = wl_proxy_create_wrapper(ctx->wp_presentation);
+    wl_proxy_set_queue((struct wl_proxy *)win->presentation_wrapper, win->queue);
+  }
+
+  feedback->win = win;
+  feedback->input_ns = win->input_ns;
+  feedback->wp_feedback = wp_presentation_feedback(win->presentation_wrapper, win->wl_surface);
+  wp_presentation_feedback_add_listener(feedback->wp_feedback, &wp_presentation_feedback_listener, feedback);
+  wl_list_insert(&win->feedbacks, &feedback->link);
+}
+
+static void set_scale(struct twl_window *win, uint32_t scale120) {
+  if (win->ctx->threaded) {
+    struct twl_event event = {.type = TWL_EVENT_SCALE, .value = scale120};
+    post_event(win, &event);
+    return;
+  }
+  handle_scale(win, scale120);
+}
+
+static void set_subpixel(struct twl_window *win, enum twl_subpixel subpixel) {
+  if (win->ctx->threaded) {
+    struct twl_event event = {.type = TWL_EVENT_SUBPIXEL, .value = subpixel};
+    post_event(win, &event);
+    return;
+  }
+  handle_subpixel(win, subpixel);
+}
+
+// The outputs only change on the I/O thread, the render thread gets what it needs of them
+static void update_outputs(struct twl_window *win) {
+  struct twl_output **first = win->outputs.data, **entry;
+  enum twl_subpixel subpixel = win->outputs.size ? (*first)->subpixel : TWL_SUBPIXEL_NONE;
+  wl_array_for_each(entry, &win->outputs) {
+    if ((*entry)->subpixel != subpixel)
+      subpixel = TWL_SUBPIXEL_NONE;
+  }
+  set_subpixel(win, subpixel);
+
+  // wp_fractional_scale_v1 knows better than the outputs
+  if (win->wp_fractional_scale)
+    return;
+
+  int32_t scale = 1;
+  wl_array_for_each(entry, &win->outputs) {
+    if ((*entry)->scale > scale)
+      scale = (*entry)->scale;
+  }
+
+  set_scale(win, scale * 120);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void hide_window(struct twl_window *win) {
+  if (win->is_hidden)
+    return;
+  win->is_hidden = 1;
+
+  if (win->constraints.keep_buffers_when_hidden)
+    return;
+
+  // The attached buffer stays, the compositor may still show it in a thumbnail or overview.
+  // Those it still reads go once it releases them: their range can't be reused or zeroed before.
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    release_hidden_buffer(win, &win->buffers[i], win->buffer);
+  }
+
+  struct twl_layer *layer;
+  wl_list_for_each(layer, &win->layers, link) {
+    for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+      release_hidden_buffer(win, &layer->buffers[i], layer->buffer);
+    }
+  }
+  twl_pool_trim(&win->ctx->pool);
+}
+
+static void show_window(struct twl_window *win) {
+  if (!win->is_hidden)
+    return;
+  win->is_hidden = 0;
+
+  // Released buffers are recreated by the next draw
+  win->buffers_dirty = 1;
+
+  struct twl_layer *layer;
+  wl_list_for_each(layer, &win->layers, link) {
+    layer->buffers_dirty = 1;
+    if (layer->needs_draw)
+      draw_layer(layer);
+  }
+}
+
+// Milliseconds until the pending frame callback counts as starved, -1 if there is nothing to wait for.
+static int occlusion_timeout(struct twl_window *win) {
+  if (!win->frame_callback || win->is_hidden)
+    return -1;
+
+  uint64_t now = now_ns();
+  uint64_t deadline = win->frame_requested_ns + OCCLUDED_NS;
+  if (now >= deadline)
+    return 0;
+  return (deadline - now + 999999) / 1000000;
+}
+
+static void check_occlusion(struct twl_window *win) {
+  // Compositors stop sending frame callbacks to windows that aren't visible
+  if (occlusion_timeout(win) != 0)
+    return;
+
+  // The latched configure was waiting for the callback, it still needs its ack.
+  if (win->configure_latched)
+    apply_configure(win);
+  hide_window(win);
+}
+
+static void trace_presented(struct twl_window *win, uint64_t present_ns) {
+  if (twl_startup_mark(&win->ctx->startup.present_ns, present_ns) && win->constraints.trace_startup)
+    twl_startup_print(&win->ctx->startup, stderr);
+}
+
+static struct twl_buffer *acquire_buffer(struct twl_buffer *buffers) {
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    if (buffers[i].wl_buffer && !buffers[i].in_use)
+      return &buffers[i];
+  }
+  return NULL;
+}
+
+// Picks the render scale for the next frame from the cost of the last one.
+// Returns 1 if the buffers need to be reallocated.
+static int update_render_scale(struct twl_window *win, uint64_t now) {
+  uint32_t budget = win->constraints.frame_budget_us;
+  if (!win->wp_viewport || !budget)
+    return 0;
+
+  uint32_t scale = win->render_scale;
+
+  if (win->last_draw_ns && now - win->last_draw_ns > IDLE_RESTORE_NS) {
+    // Idle: the next frame can afford full resolution again
+    scale = 100;
+    win->frames_over_budget = 0;
+    win->frames_under_budget = 0;
+  } else if (win->last_draw_us > budget) {
+    win->frames_under_budget = 0;
+    if (++win->frames_over_budget >= OVER_BUDGET_FRAMES && scale > RENDER_SCALE_MIN) {
+      scale -= RENDER_SCALE_STEP;
+      win->frames_over_budget = 0;
+    }
+  } else {
+    win->frames_over_budget = 0;
+    // Draw cost grows with the area, predict it at the next step up before committing to it
+    uint32_t next = scale + RENDER_SCALE_STEP;
+    uint64_t predicted = (uint64_t)win->last_draw_us * next * next / (scale * scale);
+    if (scale < 100 && predicted < budget * 8 / 10) {
+      if (++win->frames_under_budget >= UNDER_BUDGET_FRAMES) {
+        scale = next;
+        win->frames_under_budget = 0;
+      }
+    } else {
+      win->frames_under_budget = 0;
+    }
+  }
+
+  if (scale == win->render_scale)
+    return 0;
+
+  win->render_scale = scale;
+  return 1;
+}
+
+static void draw_frame(struct twl_window *win) {
+  // Throttled by the frame callback; the next draw happens when it fires.
+  if (!win->is_configured || win->frame_callback)
+    return;
+
+  // Nothing is shown, draw once the window is visible again
+  if (win->is_hidden) {
+    win->needs_draw = 1;
+    return;
+  }
+
+  uint64_t start = now_ns();
+  if (update_render_scale(win, start) || win->buffers_dirty)
+    configure_buffers(win);
+
+  struct twl_buffer *buffer = acquire_buffer(win->buffers);
+  if (buffer == NULL) {
+    win->needs_draw = 1;
+    return;
+  }
+  win->needs_draw = 0;
+  win->buffer = buffer;
+  win->draw_hint = win->config.is_resizing ? TWL_DRAW_HINT_FAST : TWL_DRAW_HINT_FULL;
+
+  finish_prepare(win);
+  if (win->pointer_fn)
+    flush_pointer_batch(win);
+
+  win->num_damage = -1;
+  (win->draw_fn)(win, buffer->mmap.addr);
+
+  win->last_draw_ns = now_ns();
+  win->last_draw_us = (win->last_draw_ns - start) / 1000;
+
+  win->frame_callback = wl_surface_frame(win->wl_surface);
+  wl_callback_add_listener(win->frame_callback, &wl_callback_frame_listener, win);
+  win->frame_requested_ns = win->last_draw_ns;
+
+  struct twl_startup_trace *startup = &win->ctx->startup;
+  int trace_present = win->constraints.trace_startup && !startup->present_ns;
+  if (((win->input_ns && win->constraints.measure_latency) || trace_present) && win->ctx->wp_presentation)
+    request_feedback(win);
+
+  wl_surface_attach(win->wl_surface, buffer->wl_buffer, 0, 0);
+  if (win->num_damage < 0)
+    wl_surface_damage_buffer(win->wl_surface, 0, 0, buffer->width, buffer->height);
+  for (int32_t i = 0; i < win->num_damage; ++i) {
+    wl_surface_damage_buffer(win->wl_surface, win->damage[i][0], win->damage[i][1], win->damage[i][2], win->damage[i][3]);
+  }
   wl_surface_commit(win->wl_surface);
-  win->buffer.in_use = 1;
+  buffer->in_use = 1;
+  twl_startup_mark(&startup->commit_ns, now_ns());
+
+  if (win->input_ns) {
+    win->input_latency_us = (now_ns() - win->input_ns) / 1000;
+    if (win->constraints.measure_latency && !win->ctx->wp_presentation)
+      twl_latency_record(&win->latency, win->input_latency_us);
+    win->input_ns = 0;
+  }
+}
+
+// Layers
+// ======
+
+struct twl_layer *twl_layer_create(struct twl_window *win, int32_t x, int32_t y, uint32_t width, uint32_t height, twl_layer_draw_fn draw_fn,
+                                   void *user_data) {
+  struct twl_context *ctx = win->ctx;
+  if (ctx->wl_subcompositor == NULL) {
+    return NULL;
+  }
+
+  struct twl_layer *layer = calloc(1, sizeof(struct twl_layer));
+  if (layer == NULL) {
+    return NULL;
+  }
+
+  layer->win = win;
+  layer->x = x;
+  layer->y = y;
+  layer->width = width;
+  layer->height = height;
+  layer->draw_fn = draw_fn;
+  layer->user_data = user_data;
+  layer->buffers_dirty = 1;
+
+  layer->wl_surface = wl_compositor_create_surface(ctx->wl_compositor);
+  wl_proxy_set_queue((struct wl_proxy *)layer->wl_surface, win->queue);
+  // Pointer events over the layer go to its window
+  wl_surface_set_user_data(layer->wl_surface, win);
+  layer->wl_subsurface = wl_subcompositor_get_subsurface(ctx->wl_subcompositor, layer->wl_surface, win->wl_surface);
+  wl_subsurface_set_position(layer->wl_subsurface, x, y);
+  // Desync by default: the layer's commits show up without redrawing the window
+  wl_subsurface_set_desync(layer->wl_subsurface);
+
+  // Fractional scales need a viewport, same as the window
+  if (win->wp_viewport)
+    layer->wp_viewport = wp_viewporter_get_viewport(ctx->wp_viewporter, layer->wl_surface);
+
+  // Stacked in creation order, the newest layer on top
+  pthread_mutex_lock(&win->layer_lock);
+  wl_list_insert(win->layers.prev, &layer->link);
+  pthread_mutex_unlock(&win->layer_lock);
+
+  return layer;
+}
+
+static void draw_solid(struct twl_layer *layer, void *buffer) {
+  struct twl_raster raster;
+  twl_raster_from_buffer(&raster, layer->buffer);
+  twl_raster_fill_rect(&raster, 0, 0, raster.width, raster.height, layer->color);
+}
+
+struct twl_layer *twl_layer_create_solid(struct twl_window *win, int32_t x, int32_t y, uint32_t width, uint32_t height, uint32_t color) {
+  struct twl_layer *layer = twl_layer_create(win, x, y, width, height, draw_solid, NULL);
+  if (layer == NULL) {
+    return NULL;
+  }
+
+  layer->is_solid = 1;
+  layer->color = color;
+
+  // Stretching one pixel needs a viewport, whatever the window's scale
+  if (!layer->wp_viewport && win->ctx->wp_viewporter)
+    layer->wp_viewport = wp_viewporter_get_viewport(win->ctx->wp_viewporter, layer->wl_surface);
+
+  draw_layer(layer);
+  return layer;
+}
+
+void twl_layer_set_color(struct twl_layer *layer, uint32_t color) {
+  if (color == layer->color)
+    return;
+
+  // Switching between opaque and translucent colors changes the shm format
+  if ((color >> 24 == 0xFF) != (layer->color >> 24 == 0xFF))
+    layer->buffers_dirty = 1;
+  layer->color = color;
+  draw_layer(layer);
+}
+
+void twl_layer_destroy(struct twl_layer *layer) {
+  struct twl_window *win = layer->win;
+
+  // Left to its window until it fires, like a callback dropped by a configure
+  if (layer->frame_callback)
+    push_proxy(&layer->win->stale_frames, layer->frame_callback);
+
+  if (layer->solid_buffer)
+    wl_buffer_destroy(layer->solid_buffer);
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    retire_buffer(win, &layer->buffers[i]);
+  }
+
+  if (layer->wp_viewport)
+    wp_viewport_destroy(layer->wp_viewport);
+  wl_subsurface_destroy(layer->wl_subsurface);
+  wl_surface_destroy(layer->wl_surface);
+
+  pthread_mutex_lock(&layer->win->layer_lock);
+  wl_list_remove(&layer->link);
+  pthread_mutex_unlock(&layer->win->layer_lock);
+  free(layer);
+}
+
+void twl_layer_set_position(struct twl_layer *layer, int32_t x, int32_t y) {
+  // Double-buffered on the window: applied by its next commit
+  pthread_mutex_lock(&layer->win->layer_lock);
+  layer->x = x;
+  layer->y = y;
+  pthread_mutex_unlock(&layer->win->layer_lock);
+  wl_subsurface_set_position(layer->wl_subsurface, x, y);
+}
+
+void twl_layer_set_sync(struct twl_layer *layer, uint32_t is_sync) {
+  layer->is_sync = is_sync;
+  if (is_sync)
+    wl_subsurface_set_sync(layer->wl_subsurface);
+  else
+    wl_subsurface_set_desync(layer->wl_subsurface);
+}
+
+void twl_layer_resize(struct twl_layer *layer, uint32_t width, uint32_t height) {
+  if (width == layer->width && height == layer->height)
+    return;
+
+  layer->width = width;
+  layer->height = height;
+  layer->buffers_dirty = 1;
+  draw_layer(layer);
+}
+
+void twl_layer_damage(struct twl_layer *layer) {
+  draw_layer(layer); //
+}
+
+static void configure_layer_buffers(struct twl_layer *layer) {
+  struct twl_window *win = layer->win;
+
+  // Layers follow the window's preferred scale, but always render at 100%
+  uint64_t scale = (uint64_t)win->scale120 * 100;
+  if (!layer->wp_viewport)
+    scale = (uint64_t)(win->scale120 / 120) * 120 * 100;
+
+  uint32_t width = scale_size(layer->width, scale);
+  uint32_t height = scale_size(layer->height, scale);
+  enum twl_format format = buffer_format(win);
+
+  // Solid layers are stretched by the compositor; translucent colors need alpha.
+  if (layer->is_solid && layer->wp_viewport)
+    width = height = 1;
+  if (layer->is_solid && (layer->color >> 24) != 0xFF)
+    format = TWL_FORMAT_ARGB8888;
+
+  layer->buffers_dirty = 0;
+
+  if (layer->wp_viewport)
+    wp_viewport_set_destination(layer->wp_viewport, layer->width, layer->height);
+  else
+    wl_surface_set_buffer_scale(layer->wl_surface, win->scale120 / 120);
+
+  if (buffers_match(layer->buffers, width, height, 0) && layer->buffers[0].format == format)
+    return;
+
+  for (int i = 0; i < TWL_NUM_BUFFERS; ++i) {
+    create_buffer(win, &layer->buffers[i], width, height, format, 0);
+  }
+
+  layer->buffer = &layer->buffers[0];
+}
+
+static uint32_t expand_channel(uint32_t color, uint32_t shift) {
+  return ((color >> shift) & 0xFF) * (UINT32_MAX / 0xFF); //
+}
+
+static void draw_single_pixel(struct twl_layer *layer) {
+  struct twl_context *ctx = layer->win->ctx;
+  uint32_t color = layer->color;
+
+  // The pixel lives on the compositor side: no fill, no shm
+  struct wl_buffer *wl_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+      ctx->wp_single_pixel_buffer_manager, expand_channel(color, 16), expand_channel(color, 8), expand_channel(color, 0), expand_channel(color, 24));
+
+  layer->buffers_dirty = 0;
+  wp_viewport_set_destination(layer->wp_viewport, layer->width, layer->height);
+
+  layer->frame_callback = wl_surface_frame(layer->wl_surface);
+  wl_callback_add_listener(layer->frame_callback, &wl_callback_frame_listener, layer->win);
+
+  wl_surface_attach(layer->wl_surface, wl_buffer, 0, 0);
+  wl_surface_damage_buffer(layer->wl_surface, 0, 0, 1, 1);
+  wl_surface_commit(layer->wl_surface);
+  layer->needs_draw = 0;
+
+  // The committed state keeps its own reference, the old buffer can go
+  if (layer->solid_buffer)
+    wl_buffer_destroy(layer->solid_buffer);
+  layer->solid_buffer = wl_buffer;
+}
+
+static void draw_layer(struct twl_layer *layer) {
+  // Throttled like the window; hidden windows draw their layers once visible again.
+  if (layer->frame_callback || layer->win->is_hidden) {
+    layer->needs_draw = 1;
+    return;
+  }
+
+  if (layer->is_solid && layer->wp_viewport && layer->win->ctx->wp_single_pixel_buffer_manager) {
+    draw_single_pixel(layer);
+    return;
+  }
+
+  if (layer->buffers_dirty)
+    configure_layer_buffers(layer);
+
+  struct twl_buffer *buffer = acquire_buffer(layer->buffers);
+  if (buffer == NULL) {
+    layer->needs_draw = 1;
+    return;
+  }
+  layer->needs_draw = 0;
+  layer->buffer = buffer;
+
+  (layer->draw_fn)(layer, buffer->mmap.addr);
+
+  layer->frame_callback = wl_surface_frame(layer->wl_surface);
+  wl_callback_add_listener(layer->frame_callback, &wl_callback_frame_listener, layer->win);
+
+  wl_surface_attach(layer->wl_surface, buffer->wl_buffer, 0, 0);
+  wl_surface_damage_buffer(layer->wl_surface, 0, 0, buffer->width, buffer->height);
+  wl_surface_commit(layer->wl_surface);
+  buffer->in_use = 1;
 }
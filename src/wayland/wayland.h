@@ -1,19 +1,132 @@
+#ifndef __TWL_WAYLAND_H__
+#define __TWL_WAYLAND_H__
+
+#include "../wayland-protocols/fractional-scale-v1-protocol.h"
+#include "../wayland-protocols/presentation-time-protocol.h"
+#include "../wayland-protocols/single-pixel-buffer-v1-protocol.h"
+#include "../wayland-protocols/viewporter-protocol.h"
 #include "../wayland-protocols/xdg-shell-protocol.h"
+#include "./clipboard.h"
+#include "./keyboard.h"
+#include "./latency.h"
+#include "./pointer.h"
 #include "./utils/fzn_std.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <wayland-client.h>
 
+// Rects per frame, more are merged into the last one
+#define TWL_MAX_DAMAGE 8
+#define TWL_NUM_BUFFERS 2
+
+// Pixel formats of the buffers handed to draw_fn, see render/raster.h for kernels
+enum twl_format {
+  TWL_FORMAT_XRGB8888, // always supported
+  TWL_FORMAT_RGB565,   // half the bandwidth, for memory-bound targets
+  TWL_FORMAT_ARGB8888, // premultiplied, always supported
+  TWL_FORMAT_COUNT,
+};
+
+// Horizontal order of an output's subpixels, text can be rendered per subpixel for them
+enum twl_subpixel {
+  TWL_SUBPIXEL_NONE, // unknown, vertical or scaled: grayscale only
+  TWL_SUBPIXEL_RGB,
+  TWL_SUBPIXEL_BGR,
+};
+
+// One wl_shm_pool, at most INT32_MAX bytes: wl_shm takes its size as an int32
+struct twl_shm_pool {
+  int fd;
+  uint32_t size;
+  struct wl_shm_pool *wl_shm_pool;
+  // Free ranges of the pool (struct twl_pool_range), sorted by offset
+  struct wl_array free_ranges;
+};
+
+struct twl_buffer_pool {
+  struct wl_shm *wl_shm;
+  pthread_mutex_t lock;
+  // struct twl_shm_pool *, another one is started once the last can't grow any more
+  struct wl_array pools;
+  _Atomic uint64_t buffer_serial; // of the last buffer (re)created
+};
+
+struct twl_context;
+
+typedef void (*twl_watch_fn)(void *data, int fd);
+
+// Extra fd polled by the event loop, the callback runs on the loop's thread when it is ready
+struct twl_watch {
+  int fd;
+  short events; // POLLIN or POLLOUT
+  twl_watch_fn fn;
+  void *data;
+};
+
+struct twl_output {
+  struct twl_context *ctx;
+  struct wl_output *wl_output;
+  uint32_t name; // registry name
+  int32_t scale;
+  enum twl_subpixel subpixel; // after the output's transform
+  struct wl_list link;
+};
+
 struct twl_context {
   // Wayland Display
   struct wl_display *wl_display;
+  struct wl_registry *wl_registry;
   // Registry Objects
   struct wl_compositor *wl_compositor;
   struct wl_shm *wl_shm;
   struct xdg_wm_base *xdg_wm_base;
+  struct wl_subcompositor *wl_subcompositor; // optional, needed for layers
+  struct wp_viewporter *wp_viewporter; // optional
+  struct wp_fractional_scale_manager_v1 *wp_fractional_scale_manager; // optional
+  struct wp_single_pixel_buffer_manager_v1 *wp_single_pixel_buffer_manager; // optional
+  struct wp_presentation *wp_presentation; // optional
+  uint32_t presentation_clock; // clockid_t of the presentation timestamps
+  struct wl_data_device_manager *wl_data_device_manager; // optional, needed for the clipboard
+  // Outputs (struct twl_output.link)
+  struct wl_list outputs;
+  // Input, only the first seat is used
+  struct wl_seat *wl_seat;
+  struct wl_keyboard *wl_keyboard;
+  struct twl_keyboard keyboard;
+  struct twl_window *keyboard_focus;
+  struct wl_pointer *wl_pointer;
+  struct twl_window *pointer_focus;
+  struct twl_pointer_event pointer_event; // collected until wl_pointer.frame
+  double pointer_offset_x; // of the layer the pointer is over
+  double pointer_offset_y;
+  // Serial of the latest key or button press, taking the selection requires one
+  _Atomic uint32_t input_serial;
+  // Selection and drag-and-drop of the seat
+  struct twl_clipboard clipboard;
+  // Fds polled along with the display (struct twl_watch), render threads may add some too
+  struct wl_array watches;
+  pthread_mutex_t watch_lock;
+  int wake_fd; // eventfd, interrupts the poll when a watch is added
+  // Formats advertised by wl_shm, bitmask of 1 << enum twl_format
+  uint32_t shm_formats;
+  // Shared shm pool, windows sub-allocate their buffers from it
+  struct twl_buffer_pool pool;
+  // Windows (struct twl_window.link)
+  struct wl_list windows;
+  // Set by twl_run_threaded(): every window draws on its own render thread
+  uint32_t threaded;
+  // Printed with constraints.trace_startup once the first frame is presented
+  struct twl_startup_trace startup;
 };
 
 struct twl_window;
+struct twl_layer;
 
 typedef void (*draw_fn)(struct twl_window *win, void *buffer);
+typedef void (*twl_layer_draw_fn)(struct twl_layer *layer, void *buffer);
+typedef void (*twl_key_fn)(struct twl_window *win, const struct twl_key_event *event);
+typedef void (*twl_pointer_fn)(struct twl_window *win, const struct twl_pointer_batch *batch);
+typedef void (*twl_prepare_fn)(void *user_data);
 
 struct twl_window_config {
   uint32_t width;
@@ -22,45 +135,246 @@ struct twl_window_config {
   uint32_t is_fullscreen;
   uint32_t is_resizing;
   uint32_t is_activated;
+  uint32_t is_suspended;
+  // Largest size the window can get without leaving the output, 0 if unknown
+  uint32_t bounds_width;
+  uint32_t bounds_height;
+};
+
+// How much effort draw_fn should spend on the frame
+enum twl_draw_hint {
+  TWL_DRAW_HINT_FULL,
+  // The window is being resized interactively and redrawn every frame, cut corners.
+  // A full frame follows once the resize ends.
+  TWL_DRAW_HINT_FAST,
 };
 
 struct twl_window_constraints {
   uint32_t default_width;
   uint32_t default_height;
-};
-
-struct twl_buffer_pool {
-  int fd;
-  uint32_t size;
-  struct wl_shm_pool *wl_shm_pool;
+  // Adaptive resolution: when non-zero and wp_viewporter is available, frames whose
+  // draw_fn takes longer than this are rendered at a lower scale and upscaled by the compositor.
+  uint32_t frame_budget_us;
+  // By default a suspended or occluded window releases all but its attached buffer.
+  uint32_t keep_buffers_when_hidden;
+  // Preferred buffer format; XRGB8888 is used if the compositor doesn't support it.
+  enum twl_format format;
+  // Record the latency from input to the frame showing it on screen (wp_presentation),
+  // or to its commit without it. The percentiles are printed when the window is destroyed.
+  uint32_t measure_latency;
+  // Work the first frame needs (loading fonts, layout), run on its own thread while the
+  // compositor maps the window. twl_main() starts it before connecting. draw_fn waits for it.
+  twl_prepare_fn prepare_fn;
+  // Print the time to connect, to the first configure, commit and presented frame
+  uint32_t trace_startup;
 };
 
 struct twl_buffer {
   fzn_mmap mmap;
+  // Pixel size of the buffer; differs from the window size when the render scale isn't 100%
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  enum twl_format format;
   struct wl_buffer *wl_buffer;
   int in_use;
+  // Range of the shared pool backing this buffer, shm_pool is NULL without one
+  struct twl_shm_pool *shm_pool;
+  uint32_t offset;
+  uint32_t capacity;
+  // Changes whenever the buffer is (re)created. Otherwise it still holds what was drawn in it
+  // last, content kept from frame to frame can be keyed by it.
+  uint64_t serial;
+};
+
+enum twl_event_type {
+  TWL_EVENT_CONFIGURE,
+  TWL_EVENT_BUFFER_RELEASE,
+  TWL_EVENT_FRAME_DONE,
+  TWL_EVENT_SCALE,
+  TWL_EVENT_SUBPIXEL,
+  TWL_EVENT_KEY,
+  TWL_EVENT_PRESENTED,
+  TWL_EVENT_CLOSE,
+};
+
+// Handed from the I/O thread to a window's render thread
+struct twl_event {
+  enum twl_event_type type;
+  uint32_t serial;
+  uint32_t value;
+  uint64_t time_ns;
+  struct twl_window_config config;
+  struct twl_key_event key;
+  // wl_buffer or wl_callback the event was sent to, or the frame's presentation feedback
+  void *proxy;
+};
+
+// Events of a window, merged by the I/O thread until its render thread takes them. The I/O
+// thread never waits for a render thread: a configure or scale replaces the one before it,
+// releases and frame callbacks are lists of proxies, pointer frames are batched and keys past
+// a cap are dropped.
+struct twl_mailbox {
+  pthread_mutex_t lock;
+  uint32_t has_configure;
+  uint32_t configure_serial;
+  struct twl_window_config config;
+  uint32_t has_scale;
+  uint32_t scale120;
+  uint32_t has_subpixel;
+  enum twl_subpixel subpixel;
+  struct wl_array releases; // struct wl_buffer *
+  struct wl_array frames; // struct wl_callback *
+  struct wl_array events; // struct twl_event: keys and presentation feedback, in order
+  // Pointer input since the render thread's last draw, taken by draw_frame()
+  struct twl_pointer_batch pointer;
+  uint64_t pointer_ns; // of the oldest pointer frame the render thread hasn't seen, 0 if none
+  uint32_t should_close;
 };
 
 struct twl_window {
   // Parent context
-  struct twl_context ctx;
+  struct twl_context *ctx;
+  struct wl_list link;
+  // Events of this window's objects are queued here
+  struct wl_event_queue *queue;
   // Wayland objects
   struct wl_surface *wl_surface;
   struct xdg_surface *xdg_surface;
   struct xdg_toplevel *xdg_toplevel;
+  struct wl_callback *frame_callback;
+  // Callbacks dropped before they fired (struct wl_callback *), destroyed once they do
+  struct wl_array stale_frames;
+  struct wp_viewport *wp_viewport;
+  struct wp_fractional_scale_v1 *wp_fractional_scale;
+  // Outputs the surface is on (struct twl_output *)
+  struct wl_array outputs;
   // Buffers
-  struct twl_buffer_pool pool;
-  struct twl_buffer buffer;
+  struct twl_buffer buffers[TWL_NUM_BUFFERS];
+  struct twl_buffer *buffer; // buffer handed to draw_fn
+  // Buffers of the window or its layers dropped while the compositor held them (struct twl_buffer),
+  // their ranges are freed once it releases them
+  struct wl_array retired_buffers;
+  uint32_t needs_draw;
+  // Rects passed to twl_window_damage() by draw_fn (x, y, width, height), -1 for the whole buffer
+  int32_t damage[TWL_MAX_DAMAGE][4];
+  int32_t num_damage;
+  // Layers stacked above the window's surface (struct twl_layer.link)
+  struct wl_list layers;
+  // Taken to change the list or a layer's position, and by the I/O thread to read them
+  pthread_mutex_t layer_lock;
+  uint32_t buffers_dirty;
+  // Preferred scale in 1/120ths, from wp_fractional_scale_v1 or the outputs' integer scale.
+  // Anything cached in buffer pixels (e.g. glyphs) should be keyed by it.
+  uint32_t scale120;
+  // Of the outputs the surface is on if they agree, kept by the render thread like scale120
+  enum twl_subpixel subpixel;
   // Config
   struct twl_window_constraints constraints;
   struct twl_window_config config;
   struct twl_window_config config_pending;
+  // Latest configure not yet acked, applied on the next frame callback
+  struct twl_window_config config_latched;
+  uint32_t latched_serial;
+  uint32_t configure_latched;
+  uint32_t bounds_width; // from xdg_toplevel.configure_bounds
+  uint32_t bounds_height;
+  uint32_t is_configured;
   uint32_t should_close;
+  // Suspended by the compositor or starved of frame callbacks; nothing is drawn
+  uint32_t is_hidden;
+  uint64_t frame_requested_ns;
+  // Adaptive resolution
+  uint32_t render_scale; // percent of the window size
+  uint32_t frames_over_budget;
+  uint32_t frames_under_budget;
+  uint64_t last_draw_ns;
+  uint32_t last_draw_us;
   // User draw hook
+  enum twl_draw_hint draw_hint; // for the frame being drawn
   draw_fn draw_fn;
   void *user_data;
+  pthread_t prepare_thread; // running constraints.prepare_fn
+  uint32_t is_preparing;
+  // User input hooks, called on the thread that draws the window. Set them directly.
+  twl_key_fn key_fn;
+  // Called once per frame, right before draw_fn, with the pointer input since the last frame
+  twl_pointer_fn pointer_fn;
+  struct twl_pointer_batch pointer;
+  // Input-to-commit latency: time of the oldest input not drawn yet, and of the last drawn one
+  uint64_t input_ns;
+  uint32_t input_latency_us;
+  struct twl_latency_stats latency; // with constraints.measure_latency
+  struct wp_presentation *presentation_wrapper;
+  struct wl_list feedbacks; // frames waiting to be presented
+  // Threaded mode
+  pthread_t render_thread;
+  struct twl_mailbox mailbox;
+  int event_fd;
+};
+
+// Subsurface with its own swapchain, stacked above its window.
+// Static content goes into the window, small overlays that change often (caret, selection,
+// status bar) into layers: redrawing a layer posts only its own buffer.
+struct twl_layer {
+  struct twl_window *win;
+  struct wl_list link;
+  // Wayland objects
+  struct wl_surface *wl_surface;
+  struct wl_subsurface *wl_subsurface;
+  struct wp_viewport *wp_viewport;
+  struct wl_callback *frame_callback;
+  // Position and size in window coordinates
+  int32_t x;
+  int32_t y;
+  uint32_t width;
+  uint32_t height;
+  // Sync layers only change along with the window's next commit
+  uint32_t is_sync;
+  // Solid layers show a single color and are never drawn into
+  uint32_t is_solid;
+  uint32_t color; // premultiplied ARGB
+  struct wl_buffer *solid_buffer; // from wp_single_pixel_buffer_manager_v1
+  // Buffers, in the window's format and scale
+  struct twl_buffer buffers[TWL_NUM_BUFFERS];
+  struct twl_buffer *buffer; // buffer handed to draw_fn
+  uint32_t needs_draw;
+  uint32_t buffers_dirty;
+  // User draw hook
+  twl_layer_draw_fn draw_fn;
+  void *user_data;
 };
 
 int twl_init(struct twl_context *ctx);
+void twl_destroy(struct twl_context *ctx);
+int twl_run(struct twl_context *ctx);
+int twl_run_threaded(struct twl_context *ctx);
+int twl_watch_fd(struct twl_context *ctx, int fd, short events, twl_watch_fn fn, void *data);
+// Call it from the loop's thread, a callback may be running otherwise
+void twl_unwatch_fd(struct twl_context *ctx, int fd);
+struct twl_window *twl_window_create(struct twl_context *ctx, const char *title, const struct twl_window_constraints *constraints, draw_fn draw,
+                                     void *user_data);
+void twl_window_destroy(struct twl_window *win);
+// Subpixel order of the window's outputs if they agree and the buffer isn't scaled by the compositor
+enum twl_subpixel twl_window_subpixel(const struct twl_window *win);
+// Only these rects of the buffer changed in the frame being drawn, in buffer pixels. Call it from
+// draw_fn, once per rect, none for an unchanged frame; without a call the whole buffer is damaged.
+// The buffer must still be complete: it replaces the one on screen.
+void twl_window_damage(struct twl_window *win, int32_t x, int32_t y, int32_t width, int32_t height);
+// Layers are only drawn on twl_layer_damage() (or when their buffers have to be recreated).
+// Call these from the thread that draws the window. Returns NULL without wl_subcompositor.
+struct twl_layer *twl_layer_create(struct twl_window *win, int32_t x, int32_t y, uint32_t width, uint32_t height, twl_layer_draw_fn draw,
+                                   void *user_data);
+// Solid layers cost no fill and, with wp_single_pixel_buffer_manager_v1, no shm at all:
+// the compositor stretches a single pixel over the layer.
+struct twl_layer *twl_layer_create_solid(struct twl_window *win, int32_t x, int32_t y, uint32_t width, uint32_t height, uint32_t color);
+void twl_layer_set_color(struct twl_layer *layer, uint32_t color);
+void twl_layer_destroy(struct twl_layer *layer);
+void twl_layer_set_position(struct twl_layer *layer, int32_t x, int32_t y);
+void twl_layer_set_sync(struct twl_layer *layer, uint32_t is_sync);
+void twl_layer_resize(struct twl_layer *layer, uint32_t width, uint32_t height);
+void twl_layer_damage(struct twl_layer *layer);
 int twl_main(char *title, struct twl_window_constraints *constraints, draw_fn draw, void *user_data);
 int twl_process();
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __TWL_TEST_CHECK_H__
+#define __TWL_TEST_CHECK_H__
+
+#include "../src/text/document.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Unlike assert(), kept with NDEBUG and reports the expression
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+    } \
+  } while (0)
+
+static inline void sleep_ms(long ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+// Path of a new temporary file holding `len` bytes of text, free() it after unlinking
+static inline char *write_temp_file(const char *text, size_t len) {
+  char *path = strdup("/tmp/twl-test-XXXXXX");
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(fd, text + done, len - done);
+    CHECK(n > 0);
+    done += n;
+  }
+  close(fd);
+  return path;
+}
+
+// Loads a document and waits for the loader to finish
+static inline void load_document(struct twl_document *doc, const char *path) {
+  CHECK(twl_document_load(doc, path) == 0);
+  for (int i = 0; i < 10000 && twl_document_state(doc) != TWL_DOCUMENT_LOADED; ++i) {
+    CHECK(twl_document_state(doc) != TWL_DOCUMENT_FAILED);
+    sleep_ms(1);
+  }
+  CHECK(twl_document_state(doc) == TWL_DOCUMENT_LOADED);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Builds and runs the unit tests, from anywhere: tests/run.sh [name...]
+# Each test links only the units it covers, the rest is stubbed in the test itself.
+# Nothing here talks to a compositor: runs against a headless mock one are yet to come.
+set -e
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS="-Wall -g -O1 $(pkg-config --cflags freetype2 wayland-client xkbcommon)"
+LIBS="-lpthread -lm $(pkg-config --libs wayland-client)"
+OUT=build/tests
+mkdir -p $OUT
+
+build() {
+  name=$1
+  shift
+  $CC $CFLAGS -o $OUT/$name tests/$name.c "$@" $LIBS
+}
+
+build test_latency src/wayland/latency.c
+build test_languages src/text/languages.c
+build test_pool src/wayland/pool.c src/wayland/utils/shm.c
+build test_search src/text/search.c src/text/document.c src/wayland/utils/fzn_std.c
+build test_wrap src/text/wrap.c src/text/document.c src/wayland/utils/fzn_std.c
+
+tests=${*:-"test_latency test_languages test_pool test_search test_wrap"}
+failed=0
+for name in $tests; do
+  if $OUT/$name; then
+    echo "PASS $name"
+  else
+    echo "FAIL $name"
+    failed=1
+  fi
+done
+exit $failed
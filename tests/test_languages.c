@@ -0,0 +1,123 @@
+#include "../src/text/highlight.h"
+#include "check.h"
+
+#define MAX_SPANS 64
+
+struct lexed {
+  struct twl_token_span spans[MAX_SPANS];
+  uint32_t num_spans;
+  uint32_t state;
+};
+
+static struct lexed lex(const struct twl_language *language, uint32_t state, const char *text) {
+  struct lexed lexed = {0};
+  lexed.state = language->lex(state, text, strlen(text), lexed.spans, &lexed.num_spans, MAX_SPANS);
+  return lexed;
+}
+
+// Token of the span covering `word` in `text`, TWL_TOKEN_TEXT outside any
+static enum twl_token token_at(const struct lexed *lexed, const char *text, const char *word) {
+  const char *at = strstr(text, word);
+  CHECK(at != NULL);
+  uint32_t start = at - text, end = start + strlen(word);
+  for (uint32_t i = 0; i < lexed->num_spans; ++i) {
+    const struct twl_token_span *span = &lexed->spans[i];
+    if (span->start <= start && end <= span->start + span->len)
+      return span->token;
+  }
+  return TWL_TOKEN_TEXT;
+}
+
+static void check_sorted(const struct lexed *lexed) {
+  for (uint32_t i = 1; i < lexed->num_spans; ++i)
+    CHECK(lexed->spans[i - 1].start + lexed->spans[i - 1].len <= lexed->spans[i].start);
+}
+
+static void test_c(void) {
+  const char *line = "static const char *s = \"a \\\" b\"; int n = 0x1F; // done";
+  struct lexed lexed = lex(&twl_language_c, 0, line);
+  check_sorted(&lexed);
+  CHECK(lexed.state == 0);
+  CHECK(token_at(&lexed, line, "static") == TWL_TOKEN_KEYWORD);
+  CHECK(token_at(&lexed, line, "char") == TWL_TOKEN_TYPE);
+  CHECK(token_at(&lexed, line, "\"a \\\" b\"") == TWL_TOKEN_STRING);
+  CHECK(token_at(&lexed, line, "int") == TWL_TOKEN_TYPE);
+  CHECK(token_at(&lexed, line, "0x1F") == TWL_TOKEN_NUMBER);
+  CHECK(token_at(&lexed, line, "// done") == TWL_TOKEN_COMMENT);
+  CHECK(token_at(&lexed, line, "s =") == TWL_TOKEN_TEXT);
+
+  // Prefixes of keywords aren't keywords
+  const char *ident = "int integer = returned;";
+  lexed = lex(&twl_language_c, 0, ident);
+  CHECK(token_at(&lexed, ident, "integer") == TWL_TOKEN_TEXT);
+  CHECK(token_at(&lexed, ident, "returned") == TWL_TOKEN_TEXT);
+}
+
+static void test_c_states(void) {
+  // A block comment carries over to the next lines
+  struct lexed first = lex(&twl_language_c, 0, "int a; /* open");
+  CHECK(first.state != 0);
+  struct lexed middle = lex(&twl_language_c, first.state, "still comment");
+  CHECK(middle.state == first.state);
+  CHECK(middle.num_spans == 1 && middle.spans[0].token == TWL_TOKEN_COMMENT);
+  const char *close = "end */ return 1;";
+  struct lexed last = lex(&twl_language_c, middle.state, close);
+  CHECK(last.state == 0);
+  CHECK(token_at(&last, close, "end */") == TWL_TOKEN_COMMENT);
+  CHECK(token_at(&last, close, "return") == TWL_TOKEN_KEYWORD);
+
+  // So does a directive continued with a backslash
+  struct lexed define = lex(&twl_language_c, 0, "  #define X \\");
+  CHECK(define.state != 0);
+  CHECK(define.spans[0].token == TWL_TOKEN_PREPROC);
+  struct lexed continued = lex(&twl_language_c, define.state, "  1");
+  CHECK(continued.state == 0);
+  CHECK(continued.num_spans == 1 && continued.spans[0].token == TWL_TOKEN_PREPROC);
+}
+
+static void test_log(void) {
+  const char *line = "2024-05-01 12:00:00.123 ERROR disk \"sda 1\" failed after 9 tries, warn x2";
+  struct lexed lexed = lex(&twl_language_log, 0, line);
+  check_sorted(&lexed);
+  CHECK(token_at(&lexed, line, "2024-05-01 12:00:00.123") == TWL_TOKEN_TIME);
+  CHECK(token_at(&lexed, line, "ERROR") == TWL_TOKEN_ERROR);
+  CHECK(token_at(&lexed, line, "\"sda 1\"") == TWL_TOKEN_STRING);
+  CHECK(token_at(&lexed, line, "9") == TWL_TOKEN_NUMBER);
+  CHECK(token_at(&lexed, line, "warn") == TWL_TOKEN_WARNING);
+  // Digits inside a word aren't numbers
+  CHECK(token_at(&lexed, line, "x2") == TWL_TOKEN_TEXT);
+
+  // Not a timestamp without two separators
+  const char *plain = "404 not found";
+  lexed = lex(&twl_language_log, 0, plain);
+  CHECK(token_at(&lexed, plain, "404") == TWL_TOKEN_NUMBER);
+}
+
+static void test_span_limit(void) {
+  const char *line = "1 2 3 4 5 6 7 8";
+  struct twl_token_span spans[3];
+  uint32_t num_spans = 0;
+  twl_language_c.lex(0, line, strlen(line), spans, &num_spans, 3);
+  CHECK(num_spans == 3);
+  num_spans = 0;
+  twl_language_c.lex(0, line, strlen(line), NULL, &num_spans, 0);
+  CHECK(num_spans == 0);
+}
+
+static void test_for_path(void) {
+  CHECK(twl_language_for_path("a/b.c") == &twl_language_c);
+  CHECK(twl_language_for_path("b.h") == &twl_language_c);
+  CHECK(twl_language_for_path("/var/log/syslog.log") == &twl_language_log);
+  CHECK(twl_language_for_path("notes.txt") == NULL);
+  CHECK(twl_language_for_path("dir.c/file") == NULL);
+  CHECK(twl_language_for_path("Makefile") == NULL);
+}
+
+int main(void) {
+  test_c();
+  test_c_states();
+  test_log();
+  test_span_limit();
+  test_for_path();
+  return 0;
+}
@@ -0,0 +1,53 @@
+#include "../src/wayland/latency.h"
+#include "check.h"
+
+static void test_empty(void) {
+  struct twl_latency_stats stats = {0};
+  CHECK(twl_latency_percentile(&stats, 50) == 0);
+  CHECK(twl_latency_percentile(&stats, 100) == 0);
+}
+
+static void test_nearest_rank(void) {
+  struct twl_latency_stats stats = {0};
+  // Recorded out of order: 1..100
+  for (uint32_t i = 0; i < 100; ++i)
+    twl_latency_record(&stats, (i * 37) % 100 + 1);
+  CHECK(stats.count == 100);
+  CHECK(twl_latency_percentile(&stats, 0) == 1);
+  CHECK(twl_latency_percentile(&stats, 1) == 1);
+  CHECK(twl_latency_percentile(&stats, 50) == 50);
+  CHECK(twl_latency_percentile(&stats, 90) == 90);
+  CHECK(twl_latency_percentile(&stats, 99) == 99);
+  CHECK(twl_latency_percentile(&stats, 100) == 100);
+
+  struct twl_latency_stats one = {0};
+  twl_latency_record(&one, 7);
+  CHECK(twl_latency_percentile(&one, 1) == 7);
+  CHECK(twl_latency_percentile(&one, 100) == 7);
+}
+
+static void test_ring(void) {
+  // Only the last TWL_LATENCY_SAMPLES count: the early outliers are gone
+  struct twl_latency_stats stats = {0};
+  for (uint32_t i = 0; i < 10; ++i)
+    twl_latency_record(&stats, 1000000);
+  for (uint32_t i = 0; i < TWL_LATENCY_SAMPLES; ++i)
+    twl_latency_record(&stats, 5);
+  CHECK(stats.count == TWL_LATENCY_SAMPLES + 10);
+  CHECK(twl_latency_percentile(&stats, 100) == 5);
+}
+
+static void test_startup_mark(void) {
+  _Atomic uint64_t milestone = 0;
+  CHECK(twl_startup_mark(&milestone, 42) == 1);
+  CHECK(twl_startup_mark(&milestone, 43) == 0);
+  CHECK(milestone == 42);
+}
+
+int main(void) {
+  test_empty();
+  test_nearest_rank();
+  test_ring();
+  test_startup_mark();
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "../src/wayland/pool.h"
+#include "check.h"
+
+// No compositor: requests go nowhere, created objects are a placeholder
+static char fake_proxy;
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode, const struct wl_interface *interface, uint32_t version, uint32_t flags,
+                                        ...) {
+  return interface ? (struct wl_proxy *)&fake_proxy : NULL;
+}
+uint32_t wl_proxy_get_version(struct wl_proxy *proxy) { return 1; }
+void wl_proxy_destroy(struct wl_proxy *proxy) {}
+
+#define PAGE ((uint32_t)getpagesize())
+#define MAX_POOL_SIZE (INT32_MAX & ~(PAGE - 1))
+
+static uint32_t num_free_ranges(struct twl_shm_pool *shm_pool) { return shm_pool->free_ranges.size / sizeof(struct twl_pool_range); }
+
+static void test_first_fit(void) {
+  struct twl_buffer_pool pool;
+  twl_pool_init(&pool, NULL);
+
+  struct twl_shm_pool *shm_pools[4];
+  uint32_t offsets[4];
+  for (int i = 0; i < 4; ++i) {
+    // Rounded up to pages
+    CHECK(twl_pool_alloc(&pool, PAGE * 2 - 100, &shm_pools[i], &offsets[i]) == 0);
+    CHECK(shm_pools[i] == shm_pools[0]);
+    CHECK(offsets[i] % PAGE == 0);
+    for (int k = 0; k < i; ++k)
+      CHECK(offsets[i] >= offsets[k] + PAGE * 2 || offsets[k] >= offsets[i] + PAGE * 2);
+  }
+
+  // A freed range is the first fit for the next one that fits it
+  twl_pool_free(&pool, shm_pools[1], offsets[1], PAGE * 2);
+  struct twl_shm_pool *shm_pool;
+  uint32_t offset;
+  CHECK(twl_pool_alloc(&pool, PAGE, &shm_pool, &offset) == 0);
+  CHECK(shm_pool == shm_pools[1] && offset == offsets[1]);
+  twl_pool_free(&pool, shm_pool, offset, PAGE);
+
+  // Freed neighbours merge back into one range with the tail
+  twl_pool_free(&pool, shm_pools[0], offsets[0], PAGE * 2);
+  twl_pool_free(&pool, shm_pools[3], offsets[3], PAGE * 2);
+  twl_pool_free(&pool, shm_pools[2], offsets[2], PAGE * 2);
+  CHECK(num_free_ranges(shm_pools[0]) == 1);
+  struct twl_pool_range *range = shm_pools[0]->free_ranges.data;
+  CHECK(range->offset == 0 && range->size == shm_pools[0]->size);
+
+  // Freeing without a range does nothing
+  twl_pool_free(&pool, NULL, 0, PAGE);
+  twl_pool_trim(&pool);
+  twl_pool_destroy(&pool);
+}
+
+static void test_int32_limit(void) {
+  struct twl_buffer_pool pool;
+  twl_pool_init(&pool, NULL);
+
+  // Pools never outgrow what wl_shm takes: the last one is full, a new one starts
+  struct twl_shm_pool *shm_pool, *first = NULL;
+  uint32_t offset;
+  for (int i = 0; i < 8; ++i) {
+    CHECK(twl_pool_alloc(&pool, 600u << 20, &shm_pool, &offset) == 0);
+    CHECK(shm_pool->size <= MAX_POOL_SIZE);
+    CHECK((uint64_t)offset + (600u << 20) <= shm_pool->size);
+    if (first == NULL)
+      first = shm_pool;
+  }
+  CHECK(pool.pools.size / sizeof(struct twl_shm_pool *) > 1);
+
+  // Space freed in a full pool is used again before the newest one grows
+  twl_pool_free(&pool, first, 0, 600u << 20);
+  CHECK(twl_pool_alloc(&pool, 500u << 20, &shm_pool, &offset) == 0);
+  CHECK(shm_pool == first && offset == 0);
+
+  // Larger than any pool can be
+  CHECK(twl_pool_alloc(&pool, MAX_POOL_SIZE + PAGE, &shm_pool, &offset) == -1);
+  CHECK(twl_pool_alloc(&pool, UINT32_MAX, &shm_pool, &offset) == -1);
+  twl_pool_destroy(&pool);
+}
+
+int main(void) {
+  test_first_fit();
+  test_int32_limit();
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include "../src/text/search.h"
+#include "check.h"
+
+// Spans several chunks, with matches across their boundaries
+#define TEXT_SIZE (TWL_SEARCH_CHUNK_SIZE * 2 + TWL_SEARCH_CHUNK_SIZE / 2)
+
+static char *make_text(void) {
+  char *text = malloc(TEXT_SIZE);
+  for (size_t i = 0; i < TEXT_SIZE; ++i)
+    text[i] = i % 61 == 60 ? '\n' : 'a' + (i * 7 + i / 13) % 26;
+  // Plain hits, overlapping ones and ones split by a chunk boundary
+  const size_t at[] = {0, 1000, TWL_SEARCH_CHUNK_SIZE - 3, TWL_SEARCH_CHUNK_SIZE * 2 - 1, TEXT_SIZE - 6};
+  for (size_t i = 0; i < sizeof(at) / sizeof(*at); ++i)
+    memcpy(text + at[i], "needle", 6);
+  memcpy(text + 5000, "nenenene", 8);
+  return text;
+}
+
+static uint64_t count_plain(const char *text, const char *pattern) {
+  uint64_t n = 0;
+  size_t len = strlen(pattern);
+  for (size_t i = 0; i + len <= TEXT_SIZE; ++i)
+    n += memcmp(text + i, pattern, len) == 0;
+  return n;
+}
+
+static void wait_done(struct twl_search *search) {
+  for (int i = 0; i < 10000 && !twl_search_is_done(search); ++i)
+    sleep_ms(1);
+  CHECK(twl_search_is_done(search));
+}
+
+// Every match, in order and found by both lookups
+static void check_matches(struct twl_search *search, const char *text, const char *pattern, uint64_t expected) {
+  CHECK(search->num_matches == expected);
+  struct twl_match *matches = malloc((expected + 1) * sizeof(struct twl_match));
+  CHECK(twl_search_find(search, 0, TEXT_SIZE, matches, expected + 1) == expected);
+
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < expected; ++i) {
+    CHECK(memcmp(text + matches[i].offset, pattern, matches[i].len) == 0);
+    CHECK(i == 0 || matches[i].offset > matches[i - 1].offset);
+    struct twl_match next;
+    CHECK(twl_search_next(search, offset, &next) == 0);
+    CHECK(next.offset == matches[i].offset);
+    offset = next.offset + 1;
+  }
+  struct twl_match next;
+  CHECK(twl_search_next(search, offset, &next) == -1);
+  free(matches);
+}
+
+static void test_plain(struct twl_document *doc, const char *text) {
+  struct twl_search search;
+  CHECK(twl_search_start(&search, doc, "needle", 0) == 0);
+  wait_done(&search);
+  check_matches(&search, text, "needle", count_plain(text, "needle"));
+
+  // Only matches overlapping the range
+  struct twl_match matches[4];
+  uint64_t boundary = TWL_SEARCH_CHUNK_SIZE;
+  CHECK(twl_search_find(&search, boundary, boundary + 1, matches, 4) == 1);
+  CHECK(matches[0].offset == boundary - 3);
+  twl_search_destroy(&search);
+
+  // Overlapping matches are all found
+  CHECK(twl_search_start(&search, doc, "nene", 0) == 0);
+  wait_done(&search);
+  uint64_t expected = count_plain(text, "nene");
+  CHECK(expected >= 3);
+  check_matches(&search, text, "nene", expected);
+  twl_search_destroy(&search);
+}
+
+static void test_regex(struct twl_document *doc, const char *text) {
+  struct twl_search search;
+  CHECK(twl_search_start(&search, doc, "ne+dle", TWL_SEARCH_REGEX) == 0);
+  wait_done(&search);
+  check_matches(&search, text, "needle", count_plain(text, "needle"));
+  twl_search_destroy(&search);
+
+  CHECK(twl_search_start(&search, doc, "(", TWL_SEARCH_REGEX) == -1);
+  CHECK(twl_search_start(&search, doc, "", 0) == -1);
+}
+
+int main(void) {
+  char *text = make_text();
+  char *path = write_temp_file(text, TEXT_SIZE);
+  struct twl_document doc;
+  load_document(&doc, path);
+
+  test_plain(&doc, text);
+  test_regex(&doc, text);
+
+  twl_document_destroy(&doc);
+  unlink(path);
+  free(path);
+  free(text);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include "../src/text/wrap.h"
+#include "check.h"
+
+// Every codepoint is one unit wide, tabs are TWL_TAB_WIDTH
+float twl_glyph_atlas_measure_utf8(struct twl_glyph_atlas *atlas, const char *text, size_t len, float size) { return 1; }
+
+static void test_wrap_line(void) {
+  struct twl_wrap wrap = {.advances = {0}, .fallback = 1, .tab = TWL_TAB_WIDTH};
+  for (int c = 0; c < 0x80; ++c)
+    wrap.advances[c] = 1;
+
+  size_t starts[8];
+  // Breaks after the spaces, which may hang past the width
+  const char *words = "hello world foo";
+  CHECK(twl_wrap_line(&wrap, NULL, words, strlen(words), 8, starts, 0, 8) == 3);
+  CHECK(starts[0] == 0 && starts[1] == 6 && starts[2] == 12);
+  // A word longer than the width is cut
+  const char *word = "abcdefghijklmnopqrstuvwxy";
+  CHECK(twl_wrap_line(&wrap, NULL, word, strlen(word), 10, starts, 0, 8) == 3);
+  CHECK(starts[1] == 10 && starts[2] == 20);
+  // Only rows from first_row on are written
+  CHECK(twl_wrap_line(&wrap, NULL, word, strlen(word), 10, starts, 2, 1) == 3);
+  CHECK(starts[0] == 20);
+  // Not wrapped without a width, a CR before the end isn't drawn
+  CHECK(twl_wrap_line(&wrap, NULL, word, strlen(word), 0, NULL, 0, 0) == 1);
+  CHECK(twl_wrap_line(&wrap, NULL, "0123456789\r", 11, 10, NULL, 0, 0) == 1);
+  // Tabs jump to the next stop
+  CHECK(twl_wrap_line(&wrap, NULL, "\t\tx", 3, 16, NULL, 0, 0) == 2);
+  // Multibyte codepoints aren't split and count as one glyph
+  CHECK(twl_wrap_line(&wrap, NULL, "\xc3\xa9\xc3\xa9\xc3\xa9", 6, 2, starts, 0, 8) == 2);
+  CHECK(starts[1] == 4);
+}
+
+// Rows of line i at width 10: i % 7 * 10 + 1 letters, so i % 7 + 1 rows
+#define NUM_LINES 20000
+#define WIDTH 10
+
+static uint32_t expected_rows(uint64_t line) { return line % 7 + 1; }
+
+static char *make_text(size_t *len) {
+  char *text = malloc(NUM_LINES * 72);
+  *len = 0;
+  for (uint64_t i = 0; i < NUM_LINES; ++i) {
+    size_t n = expected_rows(i) * WIDTH - (WIDTH - 1);
+    memset(text + *len, 'a' + i % 26, n);
+    *len += n;
+    text[(*len)++] = '\n';
+  }
+  return text;
+}
+
+static void wait_wrapped(struct twl_wrap *wrap, uint64_t num_lines) {
+  for (int i = 0; i < 10000; ++i) {
+    pthread_mutex_lock(&wrap->lock);
+    uint64_t wrapped = wrap->num_wrapped;
+    pthread_mutex_unlock(&wrap->lock);
+    if (wrapped >= num_lines)
+      return;
+    sleep_ms(1);
+  }
+  CHECK(!"the worker never caught up");
+}
+
+static void check_index(struct twl_wrap *wrap) {
+  // Against a running sum, both ways: line to row and row to line
+  uint64_t row = 0;
+  for (uint64_t line = 0; line < NUM_LINES; ++line) {
+    CHECK(twl_wrap_row(wrap, line) == row);
+    for (uint32_t r = 0; r < expected_rows(line); r += 3) {
+      uint32_t line_row;
+      CHECK(twl_wrap_line_at(wrap, row + r, &line_row) == line);
+      CHECK(line_row == r);
+    }
+    row += expected_rows(line);
+  }
+  CHECK(twl_wrap_num_rows(wrap) == row);
+}
+
+static void test_index(void) {
+  size_t len;
+  char *text = make_text(&len);
+  char *path = write_temp_file(text, len);
+  struct twl_document doc;
+  load_document(&doc, path);
+  CHECK(twl_document_num_lines(&doc) == NUM_LINES);
+
+  struct twl_wrap wrap;
+  CHECK(twl_wrap_init(&wrap, &doc, NULL, 16) == 0);
+  // Before the worker gets to them lines count as one row each
+  uint32_t line_row;
+  CHECK(twl_wrap_line_at(&wrap, 5, &line_row) == 5 && line_row == 0);
+
+  twl_wrap_view(&wrap, WIDTH);
+  wait_wrapped(&wrap, NUM_LINES);
+  check_index(&wrap);
+
+  // Rows of lines in view replace the worker's
+  twl_wrap_set(&wrap, 3, 100);
+  CHECK(twl_wrap_row(&wrap, 4) == 1 + 2 + 3 + 100);
+  twl_wrap_set(&wrap, 3, expected_rows(3));
+
+  // A new width restarts the worker, unwrapped lines are one row
+  twl_wrap_view(&wrap, 0);
+  wait_wrapped(&wrap, NUM_LINES);
+  CHECK(twl_wrap_row(&wrap, 1234) == 1234);
+  twl_wrap_view(&wrap, WIDTH);
+  wait_wrapped(&wrap, NUM_LINES);
+  check_index(&wrap);
+
+  twl_wrap_destroy(&wrap);
+  twl_document_destroy(&doc);
+  unlink(path);
+  free(path);
+  free(text);
+}
+
+int main(void) {
+  test_wrap_line();
+  test_index();
+  return 0;
+}